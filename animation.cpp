@@ -0,0 +1,278 @@
+#include "animation.hpp"
+#include "text_parse.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+/**
+ * Parses exactly count blank separated numbers from p to eol (a trailing
+ * // comment is allowed), setting error otherwise.
+ **/
+static bool parse_numbers(const char *p, const char *eol, float *values,
+                          int count, char type, std::string *error) {
+  for (int i = 0; i < count; i++) {
+    p = skip_blanks(p, eol);
+    if (p == eol) {
+      std::ostringstream msg;
+      msg << "expected " << count << " numbers after '" << type
+          << "', found " << i;
+      *error = msg.str();
+      return false;
+    }
+
+    const char *start = p;
+    if (!parse_float(p, eol, &values[i]) || (p < eol && !is_blank(*p))) {
+      const char *token_end = start;
+      while (token_end < eol && !is_blank(*token_end))
+        token_end++;
+      *error = "bad number '" + std::string(start, token_end) + "'";
+      return false;
+    }
+  }
+
+  p = skip_blanks(p, eol);
+  if (p < eol && !(eol - p >= 2 && p[0] == '/' && p[1] == '/')) {
+    std::ostringstream msg;
+    msg << "more than " << count << " numbers after '" << type << "'";
+    *error = msg.str();
+    return false;
+  }
+  return true;
+}
+
+static bool check_index(float v, int size, const char *what,
+                        std::string *error) {
+  if (v >= 0 && v < size && v == (int)v)
+    return true;
+  std::ostringstream msg;
+  msg << "no " << what << " " << v << ", the scene has " << size;
+  *error = msg.str();
+  return false;
+}
+
+/**
+ * Reads a keyframe file for scene, one record per line:
+ *   a frames fps
+ *   c time eye look_at fov
+ *   l time light point
+ *   i time instance translate rotate_degrees scale
+ * Lights and instances are numbered from 0 in scene file order. Keys of a
+ * value must come in time order. Without an a record the animation runs at
+ * DEFAULT_FPS until its last key.
+ **/
+bool read_animation(const std::string &path, const Scene &scene,
+                    Animation *animation) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    std::cerr << "Could not open file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  long long size = file.tellg();
+  std::vector<char> buffer(size + 1);
+  file.seekg(0);
+  if (!file.read(buffer.data(), size)) {
+    std::cerr << "Could not read file '" << path << "'" << std::endl;
+    return false;
+  }
+  buffer[size] = '\0';
+  const char *data = buffer.data(), *end = data + size;
+
+  Animation &a = *animation;
+  a.frames = 0;
+  a.fps = DEFAULT_FPS;
+  a.tracks.clear();
+  a.refit.clear();
+
+  // The BVH build reordered the instances, find them by id
+  const InstanceSet &set = scene.instances;
+  std::vector<int> slot(set.count);
+  for (int i = 0; i < set.count; i++)
+    slot[set.list[i].id] = i;
+
+  int camera_track = -1;
+  std::vector<int> light_tracks(scene.l_size, -1);
+  std::vector<int> instance_tracks(set.count, -1);
+
+  std::string error;
+  long long line = 1;
+  for (const char *p = data; p < end; line++) {
+    const char *eol = line_end(p, end);
+    const char *next = eol + 1;
+    p = skip_blanks(p, eol);
+    if (p == eol || *p == '/') {
+      p = next;
+      continue;
+    }
+
+    char type = *p++;
+    float v[9];
+    int *track = NULL;
+    Track added;
+    switch (type) {
+    case 'a':
+      if (!parse_numbers(p, eol, v, 2, type, &error))
+        break;
+      if (!(v[0] >= 1 && v[0] < 1e9f && v[0] == (int)v[0] && v[1] > 0)) {
+        error = "expected a positive frame count and frame rate";
+        break;
+      }
+      a.frames = (int)v[0];
+      a.fps = v[1];
+      break;
+
+    case 'c':
+      if (!parse_numbers(p, eol, v, 8, type, &error))
+        break;
+      track = &camera_track;
+      added.kind = TRACK_CAMERA;
+      added.target = 0;
+      added.width = 7;
+      break;
+
+    case 'l':
+      if (!parse_numbers(p, eol, v, 5, type, &error) ||
+          !check_index(v[1], scene.l_size, "light", &error))
+        break;
+      track = &light_tracks[(int)v[1]];
+      added.kind = TRACK_LIGHT;
+      added.target = (int)v[1];
+      added.width = 3;
+      break;
+
+    case 'i':
+      if (!parse_numbers(p, eol, v, 9, type, &error) ||
+          !check_index(v[1], set.count, "instance", &error))
+        break;
+      track = &instance_tracks[(int)v[1]];
+      added.kind = TRACK_INSTANCE;
+      added.target = slot[(int)v[1]];
+      added.width = 7;
+      break;
+
+    default:
+      error = std::string("unknown record type '") + type + "'";
+    }
+    if (!error.empty())
+      break;
+
+    if (track != NULL) {
+      if (*track < 0) {
+        *track = a.tracks.size();
+        a.tracks.push_back(added);
+      }
+      Track &t = a.tracks[*track];
+      if (!t.times.empty() && v[0] < t.times.back()) {
+        error = "keys of a value must be in time order";
+        break;
+      }
+      const float *values = t.kind == TRACK_CAMERA ? v + 1 : v + 2;
+      t.times.push_back(v[0]);
+      t.values.insert(t.values.end(), values, values + t.width);
+    }
+    p = next;
+  }
+
+  if (!error.empty()) {
+    std::cerr << path << ":" << line << ": " << error << std::endl;
+    return false;
+  }
+
+  if (a.frames == 0) {
+    float last = 0;
+    for (size_t i = 0; i < a.tracks.size(); i++)
+      last = std::max(last, a.tracks[i].times.back());
+    a.frames = (int)(last * a.fps + 0.5f) + 1;
+  }
+
+  // Moving instances only touches the BVH above them
+  bool moves = false;
+  for (size_t i = 0; i < a.tracks.size(); i++)
+    moves |= a.tracks[i].kind == TRACK_INSTANCE;
+  if (moves && scene.nodes != NULL) {
+    a.refit.resize(scene.n_nodes);
+    a.refit.resize(bvh_refit_order(scene.nodes, scene.n_nodes, BVH_INSTANCE,
+                                   a.refit.data()));
+  }
+  return true;
+}
+
+static void sample_track(const Track &track, float time, float *out) {
+  const std::vector<float> &times = track.times;
+  const float *values = track.values.data();
+  int n = times.size(), w = track.width;
+
+  // First key after time, the value is held outside the keys
+  int k = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+  if (k == 0 || k == n) {
+    copy_array(out, (float *)values + (k == 0 ? 0 : n - 1) * w, w);
+    return;
+  }
+
+  float f = (time - times[k - 1]) / (times[k] - times[k - 1]);
+  const float *a = values + (k - 1) * w, *b = values + k * w;
+  for (int i = 0; i < w; i++)
+    out[i] = a[i] + (b[i] - a[i]) * f;
+}
+
+/**
+ * Moves the camera, lights and instances to where they are at frame and
+ * refits the BVH if an instance moved. Values that did not change are left
+ * alone; returns which of ANIMATED_CAMERA, ANIMATED_LIGHTS and
+ * ANIMATED_INSTANCES did.
+ **/
+int animate(const Animation &animation, int frame, Camera *camera,
+            Scene *scene) {
+  float time = frame / animation.fps;
+  int changed = 0;
+
+  for (size_t i = 0; i < animation.tracks.size(); i++) {
+    const Track &track = animation.tracks[i];
+    float v[7];
+    sample_track(track, time, v);
+
+    if (track.kind == TRACK_CAMERA) {
+      if (memcmp(camera->position, v, sizeof(float) * 3) != 0 ||
+          memcmp(camera->look_at, v + 3, sizeof(float) * 3) != 0 ||
+          camera->fov != v[6]) {
+        copy_array(camera->position, v, 3);
+        copy_array(camera->look_at, v + 3, 3);
+        camera->fov = v[6];
+        changed |= ANIMATED_CAMERA;
+      }
+    } else if (track.kind == TRACK_LIGHT) {
+      float *light = scene->lights + track.target * LIGHT_FLOATS;
+      if (memcmp(light, v, sizeof(float) * 3) != 0) {
+        copy_array(light, v, 3);
+        changed |= ANIMATED_LIGHTS;
+      }
+    } else {
+      MeshInstance &instance = scene->instances.list[track.target];
+      MeshInstance moved = instance;
+      instance_transform(&moved, v, v + 3, v[6]);
+      if (memcmp(moved.to_world, instance.to_world,
+                 sizeof(instance.to_world)) != 0) {
+        instance = moved;
+        changed |= ANIMATED_INSTANCES;
+      }
+    }
+  }
+
+  // Lights moved out of their cells, the grid is cheap to build again
+  if (changed & ANIMATED_LIGHTS) {
+    free_light_grid(&scene->light_grid);
+    build_light_grid(&scene->light_grid, scene->lights, scene->l_size);
+  }
+  if ((changed & ANIMATED_INSTANCES) && scene->nodes != NULL)
+    refit_bvh(scene->nodes, animation.refit.data(), animation.refit.size(),
+              &scene->instances);
+  if ((changed & ANIMATED_INSTANCES) && scene->grid.first != NULL) {
+    free_grid(&scene->grid);
+    build_grid(&scene->grid, &scene->tris, &scene->spheres,
+               &scene->instances);
+  }
+  return changed;
+}
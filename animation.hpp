@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+#include "scene.hpp"
+
+#define TRACK_CAMERA 0
+#define TRACK_LIGHT 1
+#define TRACK_INSTANCE 2
+
+// What animate changed, or-ed together
+#define ANIMATED_CAMERA 1
+#define ANIMATED_LIGHTS 2
+#define ANIMATED_INSTANCES 4
+
+#define DEFAULT_FPS 24
+
+/**
+ * Keyframes of one animated value, interpolated linearly and held before
+ * the first and after the last key. Camera tracks hold the eye, the point
+ * looked at and the fov (7 values), light tracks a position (3), instance
+ * tracks the translation, rotation and scale of the scene file (7).
+ **/
+struct Track {
+  int kind;   // TRACK_CAMERA, TRACK_LIGHT or TRACK_INSTANCE
+  int target; // light index, or position of the instance in the scene list
+  int width;  // values per key
+  std::vector<float> times;
+  std::vector<float> values;
+};
+
+/**
+ * A keyframe file bound to the scene it animates. Frame f shows time
+ * f / fps.
+ **/
+struct Animation {
+  int frames;
+  float fps;
+  std::vector<Track> tracks;
+  std::vector<int> refit; // BVH nodes above instances, see bvh_refit_order
+};
+
+bool read_animation(const std::string &path, const Scene &scene,
+                    Animation *animation);
+int animate(const Animation &animation, int frame, Camera *camera,
+            Scene *scene);
@@ -0,0 +1,79 @@
+#include "arena.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+/**
+ * Throws std::bad_alloc like new[] when there is no memory for size bytes
+ **/
+void arena_init(Arena *arena, size_t size) {
+  arena->base = NULL;
+  arena->size = size;
+  arena->used = 0;
+  arena->backing = ARENA_HEAP;
+  if (size == 0)
+    return;
+
+  void *data;
+  if (size >= ARENA_HUGE_PAGE) {
+#ifdef MAP_HUGETLB
+    size_t huge = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE *
+                  ARENA_HUGE_PAGE;
+    data = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+      arena->base = (char *)data;
+      arena->size = huge;
+      arena->backing = ARENA_HUGE_PAGES;
+      return;
+    }
+#endif
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      madvise(data, size, MADV_HUGEPAGE);
+#endif
+      arena->base = (char *)data;
+      arena->backing = ARENA_PAGES;
+      return;
+    }
+  }
+
+  if (posix_memalign(&data, ARENA_ALIGN, size) != 0)
+    throw std::bad_alloc();
+  arena->base = (char *)data;
+}
+
+/**
+ * Next bytes of the arena, NULL for none or when the arena is full
+ **/
+void *arena_alloc(Arena *arena, size_t bytes) {
+  bytes = arena_size(bytes);
+  if (bytes == 0 || arena->size - arena->used < bytes)
+    return NULL;
+  void *data = arena->base + arena->used;
+  arena->used += bytes;
+  return data;
+}
+
+void arena_free(Arena *arena) {
+  if (arena->backing == ARENA_HEAP)
+    free(arena->base);
+  else
+    munmap(arena->base, arena->size);
+  arena->base = NULL;
+  arena->size = arena->used = 0;
+  arena->backing = ARENA_HEAP;
+}
+
+const char *arena_backing_name(int backing) {
+  switch (backing) {
+  case ARENA_PAGES:
+    return "transparent huge pages";
+  case ARENA_HUGE_PAGES:
+    return "huge pages";
+  }
+  return "heap";
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <omp.h>
+
+#define ARENA_ALIGN 64            // a cache line, or an AVX-512 vector
+#define ARENA_HUGE_PAGE (2 << 20) // x86-64 huge page, the smallest mapped
+
+/**
+ * One allocation holding every array of a scene, carved out in order and
+ * released at once. Arenas of a huge page or more are mapped on their
+ * own, on reserved huge pages when the system has some, else advised to
+ * use transparent ones: the streams of millions of primitives then take a
+ * few TLB entries and page faults rather than one per 4 KB. Smaller ones
+ * come from the heap. Every array starts on an ARENA_ALIGN boundary.
+ *
+ * Sizes are known before anything is carved: callers add up arena_size()
+ * of every array, call arena_init() once, then arena_alloc() each. Pages
+ * are only touched when the arrays are written, so filling them in
+ * parallel spreads them over the memory of the threads that render.
+ **/
+struct Arena {
+  char *base;
+  size_t size, used;
+  int backing; // ARENA_HEAP, ARENA_PAGES or ARENA_HUGE_PAGES
+};
+
+#define ARENA_HEAP 0
+#define ARENA_PAGES 1      // mmap, transparent huge pages advised
+#define ARENA_HUGE_PAGES 2 // mmap on reserved huge pages
+
+inline size_t arena_size(size_t bytes) {
+  return (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+void arena_init(Arena *arena, size_t size);
+void *arena_alloc(Arena *arena, size_t bytes);
+void arena_free(Arena *arena);
+const char *arena_backing_name(int backing);
+
+// NULL for none
+template <class T> T *arena_array(Arena *arena, size_t count) {
+  return (T *)arena_alloc(arena, count * sizeof(T));
+}
+
+/**
+ * Copies count T into the arena, in parallel chunks so that pages are
+ * first touched by every thread
+ **/
+template <class T>
+T *arena_copy(Arena *arena, const T *from, size_t count) {
+  T *to = arena_array<T>(arena, count);
+  const size_t chunk = 1 << 16;
+#pragma omp parallel for schedule(static)
+  for (long long i = 0; i < (long long)count; i += chunk)
+    memcpy(to + i, from + i,
+           (count - i < chunk ? count - i : chunk) * sizeof(T));
+  return to;
+}
@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "image.hpp"
+#include "input.hpp"
+#include "renderer.hpp"
+#include "scene_file.hpp"
+#include "scene_gen.hpp"
+#include "scene_text.hpp"
+
+#define PHASE_LOAD 0
+#define PHASE_BUILD 1
+#define PHASE_PRIMARY 2 // the frame without lights, so no shadow rays
+#define PHASE_RENDER 3
+#define PHASE_SHADOW 4 // render - primary
+#define PHASE_OUTPUT 5
+#define PHASES 6
+
+static const char *phase_names[PHASES] = {"load",   "build",  "primary",
+                                          "render", "shadow", "output"};
+
+/**
+ * Named scenes, a sphere grid of rows x cols over a soup of random
+ * triangles and instances of a BENCH_TORUS_SEGMENTS^2 x 2 triangle torus,
+ * any part possibly empty. The grids replace the former
+ * BENCHMIN/BENCHMID/BENCHMAX builds.
+ **/
+struct BenchScene {
+  const char *name;
+  int rows, cols;
+  int triangles;
+  int instances;
+};
+
+#define BENCH_TORUS_SEGMENTS 128
+
+static const BenchScene bench_scenes[] = {
+    {"spheres10", 10, 10, 0, 0},   {"spheres30", 30, 30, 0, 0},
+    {"spheres70", 70, 70, 0, 0},   {"spheres100", 100, 100, 0, 0},
+    {"spheres316", 316, 316, 0, 0}, {"spheres1000", 1000, 1000, 0, 0},
+    {"spheres3162", 3162, 3162, 0, 0},
+    {"soup100k", 0, 0, 100000, 0}, {"soup1m", 0, 0, 1000000, 0},
+    {"mixed", 30, 30, 100000, 0},  {"instanced", 0, 0, 0, 256},
+};
+
+struct BenchResult {
+  std::string scene;
+  long long t_size; // instanced triangles included
+  int s_size, l_size;
+  std::vector<double> times[PHASES];
+};
+
+static const BenchScene *find_scene(const std::string &name) {
+  for (size_t i = 0; i < sizeof(bench_scenes) / sizeof(bench_scenes[0]); i++)
+    if (name == bench_scenes[i].name)
+      return &bench_scenes[i];
+  return NULL;
+}
+
+/**
+ * Loads and prepares a named scene or a file:<path> one, filling the load
+ * and build times. Text files are taken as they are, without the sphere
+ * grid the raytracer adds.
+ **/
+static bool load_scene(const std::string &name, int accel, Scene *scene,
+                       SceneMapping *mapping, Camera *camera,
+                       RenderSettings *settings, double *load, double *build) {
+  float *tris = NULL, *spheres = NULL, *radius = NULL, *lights = NULL;
+  float *materials = NULL;
+  unsigned char *t_colors = NULL, *s_colors = NULL;
+  int t_size = 0, s_size = 0, l_size = 0, n_materials = 0;
+  SceneMeshes meshes;
+
+  mapping->data = NULL;
+  double start = omp_get_wtime();
+  if (name.compare(0, 5, "file:") == 0) {
+    std::string path = name.substr(5);
+    RenderSettings file_settings = *settings;
+    if (is_scene_binary(path)) {
+      if (!map_scene_binary(path, mapping, scene, camera, &file_settings))
+        return false;
+      if (accel != ACCEL_BVH) {
+        scene->nodes = NULL;
+        scene->n_nodes = 0;
+      }
+      *load = omp_get_wtime() - start;
+      start = omp_get_wtime();
+      if (accel == ACCEL_GRID)
+        build_grid(&scene->grid, &scene->tris, &scene->spheres,
+                   &scene->instances);
+      *build = omp_get_wtime() - start;
+      return true;
+    }
+    if (!ReadSceneFile(path, &tris, &t_colors, &spheres, &radius, &s_colors,
+                       &lights, &materials, t_size, s_size, l_size,
+                       n_materials, meshes, *camera, file_settings))
+      return false;
+  } else {
+    const BenchScene *bench = find_scene(name);
+    if (bench == NULL) {
+      std::cerr << "Unknown scene '" << name << "', see -list" << std::endl;
+      return false;
+    }
+    s_size = init_spheres(&spheres, &radius, &s_colors, bench->rows,
+                          bench->cols);
+    t_size = triangle_soup(&tris, &t_colors, bench->triangles, 1);
+    l_size = init_lights(&lights);
+    n_materials = init_materials(&materials);
+    if (bench->instances > 0) {
+      meshes.meshes.resize(1);
+      torus_mesh(&meshes.meshes[0], BENCH_TORUS_SEGMENTS,
+                 BENCH_TORUS_SEGMENTS, 2.0f, 0.6f);
+      instance_grid(&meshes, bench->instances, 1);
+    }
+  }
+  *load = omp_get_wtime() - start;
+
+  start = omp_get_wtime();
+  prepare_scene(scene, tris, t_colors, t_size, spheres, radius, s_colors,
+                s_size, lights, l_size, materials, n_materials, &meshes,
+                accel);
+  *build = omp_get_wtime() - start;
+  return true;
+}
+
+static double median(std::vector<double> v) {
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  size_t n = v.size();
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static double minimum(const std::vector<double> &v) {
+  return v.empty() ? 0 : *std::min_element(v.begin(), v.end());
+}
+
+static double mean(const std::vector<double> &v) {
+  double sum = 0;
+  for (size_t i = 0; i < v.size(); i++)
+    sum += v[i];
+  return v.empty() ? 0 : sum / v.size();
+}
+
+static double mrays(const BenchResult &result, long long pixels) {
+  double render = median(result.times[PHASE_RENDER]);
+  return render > 0 ? pixels / render * 1e-6 : 0;
+}
+
+static std::vector<std::string> split(const std::string &list) {
+  std::vector<std::string> items;
+  std::istringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+/**
+ * One row per scene with the median of every phase, appended so runs from
+ * several commits pile up in the same file.
+ **/
+static void write_csv(const std::string &path, const std::string &label,
+                      const std::vector<BenchResult> &results,
+                      const RenderSettings &settings, int repeat) {
+  std::ifstream existing(path);
+  bool header = !existing.good() || existing.peek() == EOF;
+  existing.close();
+
+  std::ofstream csv(path, std::ios::app);
+  if (header) {
+    csv << "label,scene,triangles,spheres,lights,width,height,threads,simd,"
+           "repeats";
+    for (int p = 0; p < PHASES; p++)
+      csv << "," << phase_names[p];
+    csv << ",mrays_per_s\n";
+  }
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    csv << label << "," << r.scene << "," << r.t_size << "," << r.s_size << ","
+        << r.l_size << "," << settings.width << "," << settings.height << ","
+        << omp_get_max_threads() << "," << simd_name(simd_level) << ","
+        << repeat;
+    for (int p = 0; p < PHASES; p++)
+      csv << "," << median(r.times[p]);
+    csv << "," << mrays(r, (long long)settings.width * settings.height)
+        << "\n";
+  }
+}
+
+static void write_json(const std::string &path, const std::string &label,
+                       const std::vector<BenchResult> &results,
+                       const RenderSettings &settings, int warmup,
+                       int repeat) {
+  std::ofstream json(path);
+  json << "{\n  \"label\": \"" << label << "\",\n"
+       << "  \"width\": " << settings.width << ",\n"
+       << "  \"height\": " << settings.height << ",\n"
+       << "  \"threads\": " << omp_get_max_threads() << ",\n"
+       << "  \"simd\": \"" << simd_name(simd_level) << "\",\n"
+       << "  \"warmup\": " << warmup << ",\n"
+       << "  \"repeats\": " << repeat << ",\n"
+       << "  \"scenes\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    json << (i ? "," : "") << "\n    {\n"
+         << "      \"scene\": \"" << r.scene << "\",\n"
+         << "      \"triangles\": " << r.t_size << ",\n"
+         << "      \"spheres\": " << r.s_size << ",\n"
+         << "      \"lights\": " << r.l_size << ",\n"
+         << "      \"mrays_per_s\": "
+         << mrays(r, (long long)settings.width * settings.height) << ",\n"
+         << "      \"phases\": {";
+    for (int p = 0; p < PHASES; p++) {
+      json << (p ? "," : "") << "\n        \"" << phase_names[p] << "\": {"
+           << "\"median\": " << median(r.times[p])
+           << ", \"min\": " << minimum(r.times[p])
+           << ", \"mean\": " << mean(r.times[p]) << ", \"samples\": [";
+      for (size_t k = 0; k < r.times[p].size(); k++)
+        json << (k ? ", " : "") << r.times[p][k];
+      json << "]}";
+    }
+    json << "\n      }\n    }";
+  }
+  json << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv) {
+  InputParser input(argc, argv);
+  if (input.cmdOptionExists("-h") || input.cmdOptionExists("-list")) {
+    std::cout
+        << "Ray-Tracer benchmark\n"
+        << "-scene <a,b>  : Scenes to run (default: spheres30,soup100k,mixed)"
+           "\n"
+        << "-warmup <n>   : Untimed runs per scene (default: 1)\n"
+        << "-repeat <n>   : Timed runs per scene (default: 5)\n"
+        << "-width <px>   : Image width (default: 1280)\n"
+        << "-height <px>  : Image height (default: 720)\n"
+        << "-accel <type> : bvh, grid or none (default: bvh)\n"
+        << "-simd <isa>   : auto, avx512, avx2 or scalar (default: auto)\n"
+        << "-packet <n>   : Primary ray packet size (default: 0)\n"
+        << "-tile <px>    : Tile size (default: 32)\n"
+        << "-order <name> : morton, spiral or scanline (default: morton)\n"
+        << "-numa <nodes> : Render NUMA aware on the nodes of the machine "
+           "(auto) or on that\n                many simulated ones, the "
+           "replicas being made in the build phase\n"
+        << "-o <file>     : Image written in the output phase (default: "
+           "bench.ppm)\n"
+        << "-label <text> : Tag for the results, e.g. a commit hash\n"
+        << "-csv <file>   : Append the medians to a CSV file\n"
+        << "-json <file>  : Write every sample to a JSON file\n"
+        << "\nScenes:";
+    for (size_t i = 0; i < sizeof(bench_scenes) / sizeof(bench_scenes[0]);
+         i++) {
+      const BenchScene &s = bench_scenes[i];
+      std::cout << "\n  " << s.name << ": " << s.rows * s.cols
+                << " spheres, " << s.triangles << " triangles";
+      if (s.instances > 0)
+        std::cout << ", " << s.instances << " torus instances";
+    }
+    std::cout << "\n  file:<path>: a text or binary scene file\n";
+    return 0;
+  }
+
+  std::vector<std::string> names =
+      split(input.cmdOptionExists("-scene") ? input.getCmdOption("-scene")
+                                            : "spheres30,soup100k,mixed");
+  int warmup = input.cmdOptionExists("-warmup")
+                   ? stoi(input.getCmdOption("-warmup"))
+                   : 1;
+  int repeat = input.cmdOptionExists("-repeat")
+                   ? stoi(input.getCmdOption("-repeat"))
+                   : 5;
+  const std::string &output =
+      input.cmdOptionExists("-o") ? input.getCmdOption("-o") : "bench.ppm";
+  const std::string &label = input.getCmdOption("-label");
+  int accel = input.cmdOptionExists("-accel")
+                  ? accel_type(input.getCmdOption("-accel"))
+                  : ACCEL_BVH;
+  simd_init(input.cmdOptionExists("-simd") ? input.getCmdOption("-simd")
+                                           : "auto");
+
+  RenderSettings settings = default_settings();
+  settings.width = 1280;
+  settings.height = 720;
+  if (input.cmdOptionExists("-width"))
+    settings.width = stoi(input.getCmdOption("-width"));
+  if (input.cmdOptionExists("-height"))
+    settings.height = stoi(input.getCmdOption("-height"));
+  if (input.cmdOptionExists("-packet"))
+    settings.packet = stoi(input.getCmdOption("-packet"));
+  if (input.cmdOptionExists("-tile"))
+    settings.tile_size = stoi(input.getCmdOption("-tile"));
+  if (input.cmdOptionExists("-order"))
+    settings.tile_order = tile_order(input.getCmdOption("-order"));
+  if (settings.width <= 0 || settings.height <= 0 || repeat <= 0 ||
+      warmup < 0 || !image_format_supported(output)) {
+    std::cerr << "Invalid resolution, repeat count or output" << std::endl;
+    return 1;
+  }
+
+  unsigned char *frameBuffer =
+      new unsigned char[(size_t)4 * settings.width * settings.height];
+  float *hdr = new float[4LL * settings.width * settings.height];
+
+  NumaScenes numa_scenes;
+  numa_scenes.topology.n_nodes = 0;
+  if (input.cmdOptionExists("-numa"))
+    numa_topology(input.getCmdOption("-numa"), &numa_scenes.topology);
+  NumaScenes *numa =
+      numa_scenes.topology.n_nodes > 0 ? &numa_scenes : NULL;
+
+  std::cout << "SIMD: " << simd_name(simd_level)
+            << ", accel: " << accel_name(accel)
+            << ", threads: " << omp_get_max_threads() << ", "
+            << settings.width << "x" << settings.height;
+  if (numa != NULL)
+    std::cout << ", NUMA nodes: " << numa->topology.n_nodes
+              << (numa->topology.simulated ? " (simulated)" : "");
+  std::cout << std::endl;
+
+  std::vector<BenchResult> results;
+  for (size_t s = 0; s < names.size(); s++) {
+    BenchResult result;
+    result.scene = names[s];
+
+    for (int run = 0; run < warmup + repeat; run++) {
+      Scene scene;
+      SceneMapping mapping;
+      Camera camera = default_camera();
+      double t[PHASES];
+      if (!load_scene(names[s], accel, &scene, &mapping, &camera, &settings,
+                      &t[PHASE_LOAD], &t[PHASE_BUILD])) {
+        delete[] frameBuffer;
+        delete[] hdr;
+        return 1;
+      }
+      SceneRelease release(&scene, &mapping);
+
+      Scene unlit = scene;
+      unlit.l_size = 0;
+      NumaScenes unlit_numa;
+      if (numa != NULL) {
+        numa_replicate(numa, scene);
+        t[PHASE_BUILD] += numa->time;
+        unlit_numa = *numa;
+        for (int k = 0; k < numa->topology.n_nodes; k++)
+          unlit_numa.replicas[k].l_size = 0;
+      }
+      t[PHASE_PRIMARY] =
+          render(hdr, frameBuffer, camera, settings, unlit, NULL, NULL,
+                 numa != NULL ? &unlit_numa : NULL)
+              .time;
+      t[PHASE_RENDER] =
+          render(hdr, frameBuffer, camera, settings, scene, NULL, NULL, numa)
+              .time;
+      if (numa != NULL)
+        numa_free(numa);
+      t[PHASE_SHADOW] = std::max(0.0, t[PHASE_RENDER] - t[PHASE_PRIMARY]);
+
+      double start = omp_get_wtime();
+      write_image(output, frameBuffer, hdr, settings.width, settings.height);
+      t[PHASE_OUTPUT] = omp_get_wtime() - start;
+
+      result.t_size = scene.tris.count + instanced_triangles(scene.instances);
+      result.s_size = scene.spheres.count;
+      result.l_size = scene.l_size;
+
+      if (run >= warmup)
+        for (int p = 0; p < PHASES; p++)
+          result.times[p].push_back(t[p]);
+    }
+
+    std::cout << result.scene << " (" << result.t_size << " triangles, "
+              << result.s_size << " spheres, " << result.l_size << " lights)"
+              << std::endl;
+    for (int p = 0; p < PHASES; p++)
+      std::cout << "  " << phase_names[p] << ": "
+                << median(result.times[p]) << " s median, "
+                << minimum(result.times[p]) << " s min" << std::endl;
+    std::cout << "  "
+              << mrays(result, (long long)settings.width * settings.height)
+              << " Mrays/s primary" << std::endl;
+    results.push_back(result);
+  }
+
+  if (input.cmdOptionExists("-csv"))
+    write_csv(input.getCmdOption("-csv"), label, results, settings, repeat);
+  if (input.cmdOptionExists("-json"))
+    write_json(input.getCmdOption("-json"), label, results, settings, warmup,
+               repeat);
+
+  delete[] frameBuffer;
+  delete[] hdr;
+  return 0;
+}
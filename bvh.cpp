@@ -0,0 +1,468 @@
+#include "bvh.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "stats.hpp"
+
+#include <vector>
+
+/**
+ * Build-time primitive reference: bounds, centroid and where it came from.
+ **/
+struct PrimRef {
+  float bmin[3], bmax[3], c[3];
+  int type;
+  int index;
+};
+
+struct Bin {
+  float bmin[3], bmax[3];
+  int count;
+};
+
+static void empty_bounds(float bmin[], float bmax[]) {
+  for (int k = 0; k < 3; k++) {
+    bmin[k] = FLT_MAX;
+    bmax[k] = -FLT_MAX;
+  }
+}
+
+static void grow_bounds(float bmin[], float bmax[], const float omin[],
+                        const float omax[]) {
+  for (int k = 0; k < 3; k++) {
+    bmin[k] = omin[k] < bmin[k] ? omin[k] : bmin[k];
+    bmax[k] = omax[k] > bmax[k] ? omax[k] : bmax[k];
+  }
+}
+
+static float half_area(const float bmin[], const float bmax[]) {
+  float e[3] = {bmax[0] - bmin[0], bmax[1] - bmin[1], bmax[2] - bmin[2]};
+  if (e[0] < 0 || e[1] < 0 || e[2] < 0)
+    return 0;
+  return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+}
+
+static void make_leaf(BVHNode *node, PrimRef *refs, int start, int end) {
+  node->first = start;
+  node->count = end - start;
+  node->type = refs[start].type;
+}
+
+/**
+ * Splits refs[start, end) by primitive type, the lowest type present
+ * (triangles, then spheres, then instances) first. Returns the position of
+ * the first primitive of another type.
+ **/
+static int partition_type(PrimRef *refs, int start, int end) {
+  int first = BVH_INSTANCE;
+  for (int i = start; i < end; i++)
+    first = refs[i].type < first ? refs[i].type : first;
+
+  int mid = start;
+  for (int i = start; i < end; i++) {
+    if (refs[i].type == first) {
+      PrimRef tmp = refs[i];
+      refs[i] = refs[mid];
+      refs[mid] = tmp;
+      mid++;
+    }
+  }
+  return mid;
+}
+
+static int partition_bin(PrimRef *refs, int start, int end, int axis,
+                         float cmin, float scale, int split) {
+  int mid = start;
+  for (int i = start; i < end; i++) {
+    int b = (int)((refs[i].c[axis] - cmin) * scale);
+    b = b < BVH_BINS - 1 ? b : BVH_BINS - 1;
+    if (b < split) {
+      PrimRef tmp = refs[i];
+      refs[i] = refs[mid];
+      refs[mid] = tmp;
+      mid++;
+    }
+  }
+  return mid;
+}
+
+/**
+ * Builds the subtree of nodes[node_id] over refs[start, end). Past
+ * BVH_MAX_DEPTH the primitives only get split by type, so the traversal
+ * stacks, which hold at most one node per level, cannot overflow.
+ **/
+static void build_node(BVHNode *nodes, int &n_nodes, int node_id,
+                       PrimRef *refs, int start, int end, int depth) {
+  BVHNode *node = &nodes[node_id];
+  int n = end - start;
+
+  float cmin[3], cmax[3];
+  empty_bounds(node->bmin, node->bmax);
+  empty_bounds(cmin, cmax);
+  bool mixed = false;
+  for (int i = start; i < end; i++) {
+    grow_bounds(node->bmin, node->bmax, refs[i].bmin, refs[i].bmax);
+    grow_bounds(cmin, cmax, refs[i].c, refs[i].c);
+    mixed |= refs[i].type != refs[start].type;
+  }
+
+  // Binned SAH: find the cheapest bin boundary over all three axes
+  float best_cost = FLT_MAX;
+  int best_axis = -1, best_split = 0;
+  for (int axis = 0; axis < 3 && n > 1; axis++) {
+    float extent = cmax[axis] - cmin[axis];
+    if (extent <= 0)
+      continue;
+
+    Bin bins[BVH_BINS];
+    for (int b = 0; b < BVH_BINS; b++) {
+      empty_bounds(bins[b].bmin, bins[b].bmax);
+      bins[b].count = 0;
+    }
+
+    float scale = BVH_BINS / extent;
+    for (int i = start; i < end; i++) {
+      int b = (int)((refs[i].c[axis] - cmin[axis]) * scale);
+      b = b < BVH_BINS - 1 ? b : BVH_BINS - 1;
+      bins[b].count++;
+      grow_bounds(bins[b].bmin, bins[b].bmax, refs[i].bmin, refs[i].bmax);
+    }
+
+    // Sweep from the right to get the cost of every right side
+    float right_area[BVH_BINS];
+    int right_count[BVH_BINS];
+    float rmin[3], rmax[3];
+    empty_bounds(rmin, rmax);
+    int count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      grow_bounds(rmin, rmax, bins[b].bmin, bins[b].bmax);
+      count += bins[b].count;
+      right_area[b] = half_area(rmin, rmax);
+      right_count[b] = count;
+    }
+
+    float lmin[3], lmax[3];
+    empty_bounds(lmin, lmax);
+    count = 0;
+    for (int b = 1; b < BVH_BINS; b++) {
+      grow_bounds(lmin, lmax, bins[b - 1].bmin, bins[b - 1].bmax);
+      count += bins[b - 1].count;
+      if (count == 0 || right_count[b] == 0)
+        continue;
+      float cost =
+          half_area(lmin, lmax) * count + right_area[b] * right_count[b];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  // Leaf cost is n intersections, a split costs one traversal step plus the
+  // area weighted intersections of both children
+  float area = half_area(node->bmin, node->bmax);
+  float split_cost =
+      best_axis >= 0 && area > 0 ? 1.0f + best_cost / area : FLT_MAX;
+  bool want_leaf = n <= 1 || (n <= BVH_MAX_LEAF && split_cost >= n) ||
+                   depth >= BVH_MAX_DEPTH;
+
+  if (want_leaf && !mixed) {
+    make_leaf(node, refs, start, end);
+    return;
+  }
+
+  int mid;
+  if (want_leaf) {
+    // Leaves hold a single primitive type
+    mid = partition_type(refs, start, end);
+  } else if (best_axis >= 0) {
+    float scale = BVH_BINS / (cmax[best_axis] - cmin[best_axis]);
+    mid = partition_bin(refs, start, end, best_axis, cmin[best_axis], scale,
+                        best_split);
+  } else {
+    // All centroids coincide, fall back to splitting the range in half
+    mid = mixed ? partition_type(refs, start, end) : start + n / 2;
+  }
+
+  int left = n_nodes;
+  n_nodes += 2;
+  node->first = left;
+  node->count = 0;
+  node->type = 0;
+
+  build_node(nodes, n_nodes, left, refs, start, mid, depth + 1);
+  build_node(nodes, n_nodes, left + 1, refs, mid, end, depth + 1);
+}
+
+/**
+ * Builds a BVH over all triangles, spheres and mesh instances of the scene.
+ *
+ * The primitive arrays (and their colors) are reordered in place so that
+ * every leaf references a contiguous range of one of them. Either color
+ * array may be NULL. Returns the number of nodes, the root being nodes[0].
+ **/
+int build_bvh(BVHNode **nodes, float *tris, unsigned char *t_colors,
+              int t_size, float *spheres, float *radius,
+              unsigned char *s_colors, int s_size, MeshInstance *instances,
+              int i_size, const Mesh *meshes) {
+  int n = t_size + s_size + i_size;
+  if (n == 0) {
+    (*nodes) = NULL;
+    return 0;
+  }
+
+  std::vector<PrimRef> refs(n);
+
+  for (int i = 0; i < t_size; i++) {
+    PrimRef &ref = refs[i];
+    float *p = tris + i * 9;
+    empty_bounds(ref.bmin, ref.bmax);
+    grow_bounds(ref.bmin, ref.bmax, p + 0, p + 0);
+    grow_bounds(ref.bmin, ref.bmax, p + 3, p + 3);
+    grow_bounds(ref.bmin, ref.bmax, p + 6, p + 6);
+    for (int k = 0; k < 3; k++)
+      ref.c[k] = (p[k] + p[k + 3] + p[k + 6]) / 3.0f;
+    ref.type = BVH_TRIANGLE;
+    ref.index = i;
+  }
+
+  for (int i = 0; i < s_size; i++) {
+    PrimRef &ref = refs[t_size + i];
+    for (int k = 0; k < 3; k++) {
+      ref.c[k] = spheres[i * 3 + k];
+      ref.bmin[k] = spheres[i * 3 + k] - radius[i];
+      ref.bmax[k] = spheres[i * 3 + k] + radius[i];
+    }
+    ref.type = BVH_SPHERE;
+    ref.index = i;
+  }
+
+  for (int i = 0; i < i_size; i++) {
+    PrimRef &ref = refs[t_size + s_size + i];
+    instance_bounds(instances[i], meshes[instances[i].mesh], ref.bmin,
+                    ref.bmax);
+    for (int k = 0; k < 3; k++)
+      ref.c[k] = (ref.bmin[k] + ref.bmax[k]) * 0.5f;
+    ref.type = BVH_INSTANCE;
+    ref.index = i;
+  }
+
+  (*nodes) = new BVHNode[2 * n - 1];
+  int n_nodes = 1;
+  build_node(*nodes, n_nodes, 0, &refs[0], 0, n, 0);
+
+  // Number the primitives of each type in leaf order
+  std::vector<int> typed(n);
+  int next[4] = {0, 0, 0, 0};
+  for (int i = 0; i < n; i++)
+    typed[i] = next[refs[i].type]++;
+
+  for (int i = 0; i < n_nodes; i++) {
+    if ((*nodes)[i].count > 0)
+      (*nodes)[i].first = typed[(*nodes)[i].first];
+  }
+
+  // Reorder the scene arrays to match
+  std::vector<float> old_tris(tris, tris + t_size * 9);
+  std::vector<float> old_spheres(spheres, spheres + s_size * 3);
+  std::vector<float> old_radius(radius, radius + s_size);
+  std::vector<unsigned char> old_tcol, old_scol;
+  if (t_colors != NULL)
+    old_tcol.assign(t_colors, t_colors + t_size * COLOR_BYTES);
+  if (s_colors != NULL)
+    old_scol.assign(s_colors, s_colors + s_size * COLOR_BYTES);
+  std::vector<MeshInstance> old_instances(instances, instances + i_size);
+
+  for (int i = 0; i < n; i++) {
+    int from = refs[i].index, to = typed[i];
+    if (refs[i].type == BVH_TRIANGLE) {
+      copy_array(tris + to * 9, &old_tris[from * 9], 9);
+      if (t_colors != NULL)
+        copy_array(t_colors + to * COLOR_BYTES,
+                   &old_tcol[from * COLOR_BYTES], COLOR_BYTES);
+    } else if (refs[i].type == BVH_SPHERE) {
+      copy_array(spheres + to * 3, &old_spheres[from * 3], 3);
+      if (s_colors != NULL)
+        copy_array(s_colors + to * COLOR_BYTES,
+                   &old_scol[from * COLOR_BYTES], COLOR_BYTES);
+      radius[to] = old_radius[from];
+    } else {
+      instances[to] = old_instances[from];
+    }
+  }
+
+  return n_nodes;
+}
+
+/**
+ * Lists the nodes whose bounds depend on primitives of the given type: the
+ * leaves holding them and every interior node above. Children always come
+ * after their parent in the array, so walking it backwards lists them
+ * before their parent, the order refit_bvh needs. Returns how many of the
+ * n_nodes slots of order were filled.
+ **/
+int bvh_refit_order(const BVHNode *nodes, int n_nodes, int type,
+                    int *order) {
+  std::vector<char> marked(n_nodes, 0);
+  int n = 0;
+  for (int i = n_nodes - 1; i >= 0; i--) {
+    const BVHNode &node = nodes[i];
+    if (node.count > 0)
+      marked[i] = node.type == type;
+    else
+      marked[i] = marked[node.first] || marked[node.first + 1];
+    if (marked[i])
+      order[n++] = i;
+  }
+  return n;
+}
+
+/**
+ * Refits the nodes listed by bvh_refit_order for BVH_INSTANCE once the
+ * instances moved: their leaves are bounded again from the instance
+ * transforms and the interior nodes by their children. The tree itself is
+ * kept, so it only stays as good as the original split for small motions.
+ **/
+void refit_bvh(BVHNode *nodes, const int *order, int n,
+               const InstanceSet *instances) {
+  for (int i = 0; i < n; i++) {
+    BVHNode *node = &nodes[order[i]];
+    empty_bounds(node->bmin, node->bmax);
+    if (node->count > 0) {
+      for (int j = node->first; j < node->first + node->count; j++) {
+        const MeshInstance &instance = instances->list[j];
+        float bmin[3], bmax[3];
+        instance_bounds(instance, instances->meshes[instance.mesh], bmin,
+                        bmax);
+        grow_bounds(node->bmin, node->bmax, bmin, bmax);
+      }
+    } else {
+      for (int c = 0; c < 2; c++) {
+        const BVHNode *child = &nodes[node->first + c];
+        grow_bounds(node->bmin, node->bmax, child->bmin, child->bmax);
+      }
+    }
+  }
+}
+
+#pragma omp declare target
+
+/**
+ * Closest hit through the BVH. Returns 0 when nothing is hit, else
+ * BVH_TRIANGLE, BVH_SPHERE or BVH_INSTANCE with the index of the primitive
+ * and the distance along dir; for BVH_INSTANCE, index is the triangle of
+ * the mesh and instance the instance hit.
+ **/
+int bvh_intersect(BVHNode *nodes, TriangleSoA *tris, SphereSoA *spheres,
+                  InstanceSet *instances, int *index, int *instance, float *t,
+                  float *orig, float *dir) {
+  *t = FLT_MAX;
+  return bvh_traverse(nodes, 0, tris, spheres, instances, index, instance, t,
+                      orig, dir);
+}
+
+/**
+ * Closest hit in the subtree under root, only accepting hits nearer than
+ * *t. Returns the primitive type when *t and *index were updated, 0
+ * otherwise. For an instance, *index is the triangle of its mesh and
+ * *instance the instance.
+ **/
+int bvh_traverse(BVHNode *nodes, int root, TriangleSoA *tris,
+                 SphereSoA *spheres, InstanceSet *instances, int *index,
+                 int *instance, float *t, float *orig, float *dir) {
+  float inv_dir[3] = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+  float t_best = *t;
+  int hit = 0;
+
+  int stack[BVH_STACK_SIZE];
+  int sp = 0;
+
+  if (ray_box(&nodes[root], orig, inv_dir, t_best) == FLT_MAX)
+    return 0;
+  stack[sp++] = root;
+
+  while (sp > 0) {
+    BVHNode *node = &nodes[stack[--sp]];
+    STAT_ADD(node_visits, 1);
+
+    if (node->count > 0) {
+      if (node->type == BVH_TRIANGLE) {
+        if (triangles_closest(tris, node->first, node->count, orig, dir,
+                              &t_best, index))
+          hit = BVH_TRIANGLE;
+      } else if (node->type == BVH_SPHERE) {
+        if (spheres_closest(spheres, node->first, node->count, orig, dir,
+                            &t_best, index))
+          hit = BVH_SPHERE;
+      } else {
+        if (instances_closest(instances, node->first, node->count, orig, dir,
+                              &t_best, index, instance))
+          hit = BVH_INSTANCE;
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, skip boxes beyond the closest hit
+    float tl = ray_box(&nodes[node->first], orig, inv_dir, t_best);
+    float tr = ray_box(&nodes[node->first + 1], orig, inv_dir, t_best);
+    if (tl <= tr) {
+      if (tr != FLT_MAX)
+        stack[sp++] = node->first + 1;
+      if (tl != FLT_MAX)
+        stack[sp++] = node->first;
+    } else {
+      if (tl != FLT_MAX)
+        stack[sp++] = node->first;
+      stack[sp++] = node->first + 1;
+    }
+  }
+
+  *t = t_best;
+  return hit;
+}
+
+/**
+ * Any-hit through the BVH: true as soon as a primitive is hit with a
+ * distance in (tmin, tmax). Children are not ordered since any hit will do.
+ **/
+int bvh_occluded(BVHNode *nodes, TriangleSoA *tris, SphereSoA *spheres,
+                 InstanceSet *instances, float *orig, float *dir, float tmin,
+                 float tmax) {
+  float inv_dir[3] = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  int stack[BVH_STACK_SIZE];
+  int sp = 0;
+
+  if (ray_box(&nodes[0], orig, inv_dir, tmax) == FLT_MAX)
+    return false;
+  stack[sp++] = 0;
+
+  while (sp > 0) {
+    BVHNode *node = &nodes[stack[--sp]];
+    STAT_ADD(node_visits, 1);
+
+    if (node->count == 0) {
+      if (ray_box(&nodes[node->first + 1], orig, inv_dir, tmax) != FLT_MAX)
+        stack[sp++] = node->first + 1;
+      if (ray_box(&nodes[node->first], orig, inv_dir, tmax) != FLT_MAX)
+        stack[sp++] = node->first;
+      continue;
+    }
+
+    int blocked;
+    if (node->type == BVH_TRIANGLE)
+      blocked = triangles_occluded(tris, node->first, node->count, orig, dir,
+                                   tmin, tmax);
+    else if (node->type == BVH_SPHERE)
+      blocked = spheres_occluded(spheres, node->first, node->count, orig, dir,
+                                 tmin, tmax);
+    else
+      blocked = instances_occluded(instances, node->first, node->count, orig,
+                                   dir, tmin, tmax);
+    if (blocked)
+      return true;
+  }
+
+  return false;
+}
+#pragma omp end declare target
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cfloat>
+#include <omp.h>
+
+#include "maths.hpp"
+#include "simd.hpp"
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 8
+#define BVH_STACK_SIZE 64
+// Deepest split on position, leaving room for the splits by type below it
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 4)
+
+#define BVH_TRIANGLE 1
+#define BVH_SPHERE 2
+#define BVH_INSTANCE 3
+
+struct InstanceSet;
+struct MeshInstance;
+struct Mesh;
+
+#pragma omp declare target
+/**
+ * Flat BVH node, 32 bytes so two of them share a cache line.
+ *
+ * Interior nodes have count == 0 and their children stored next to each
+ * other at first and first + 1. Leaves hold count primitives of a single
+ * type, starting at index first of the (reordered) triangle, sphere or
+ * instance arrays.
+ **/
+struct BVHNode {
+  float bmin[3];
+  int first;
+  float bmax[3];
+  unsigned short count;
+  unsigned short type;
+};
+
+/**
+ * Slab test, returns the entry distance or FLT_MAX when the box is missed
+ * or lies beyond t_max.
+ **/
+static inline float ray_box(const BVHNode *node, const float orig[],
+                            const float inv_dir[], float t_max) {
+  float t0 = 0, t1 = t_max;
+  for (int k = 0; k < 3; k++) {
+    float ta = (node->bmin[k] - orig[k]) * inv_dir[k];
+    float tb = (node->bmax[k] - orig[k]) * inv_dir[k];
+    if (ta > tb) {
+      float tmp = ta;
+      ta = tb;
+      tb = tmp;
+    }
+    t0 = ta > t0 ? ta : t0;
+    t1 = tb < t1 ? tb : t1;
+  }
+  return t0 <= t1 ? t0 : FLT_MAX;
+}
+
+int bvh_intersect(BVHNode *nodes, TriangleSoA *tris, SphereSoA *spheres,
+                  InstanceSet *instances, int *index, int *instance, float *t,
+                  float *orig, float *dir);
+int bvh_traverse(BVHNode *nodes, int root, TriangleSoA *tris,
+                 SphereSoA *spheres, InstanceSet *instances, int *index,
+                 int *instance, float *t, float *orig, float *dir);
+int bvh_occluded(BVHNode *nodes, TriangleSoA *tris, SphereSoA *spheres,
+                 InstanceSet *instances, float *orig, float *dir, float tmin,
+                 float tmax);
+#pragma omp end declare target
+
+int build_bvh(BVHNode **nodes, float *tris, unsigned char *t_colors,
+              int t_size, float *spheres, float *radius,
+              unsigned char *s_colors, int s_size, MeshInstance *instances,
+              int i_size, const Mesh *meshes);
+int bvh_refit_order(const BVHNode *nodes, int n_nodes, int type, int *order);
+void refit_bvh(BVHNode *nodes, const int *order, int n,
+               const InstanceSet *instances);
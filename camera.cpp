@@ -0,0 +1,105 @@
+#include "camera.hpp"
+
+Camera default_camera() {
+  Camera camera = {{0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f},
+                   DEFAULT_FOV};
+  return camera;
+}
+
+RenderSettings default_settings() {
+  RenderSettings settings = {DEFAULT_WIDTH,     DEFAULT_HEIGHT, 0,
+                             DEFAULT_TILE_SIZE, TILE_MORTON,    false,
+                             0,                 1,              0,
+                             TONEMAP_CLAMP,     1.0f,           0,
+                             DEFAULT_MAX_DEPTH, DEFAULT_ROULETTE};
+  return settings;
+}
+
+/**
+ * Unit vectors of the camera: w the view direction, u to the right of the
+ * image and v up it
+ **/
+void camera_basis(const Camera &camera, vec3 *w, vec3 *u, vec3 *v) {
+  *w = normalize(load3(camera.look_at) - load3(camera.position));
+  *u = cross(*w, load3(camera.up));
+  if (length(*u) == 0) {
+    // Looking along up, any perpendicular will do
+    vec3 alt = w->z != 0 ? vec3{0.0f, 1.0f, 0.0f} : vec3{0.0f, 0.0f, 1.0f};
+    *u = cross(*w, alt);
+  }
+  *u = normalize(*u);
+  *v = cross(*u, *w);
+}
+
+/**
+ * Builds the camera basis and folds the field of view, the aspect ratio
+ * and the pixel size into it, so no trigonometry is left per pixel.
+ **/
+void camera_frame(const Camera &camera, int width, int height,
+                  CameraFrame *frame) {
+  vec3 w, u, v;
+  camera_basis(camera, &w, &u, &v);
+
+  float tan_half = tan(camera.fov * 0.5 * M_PI / 180);
+  float sx = tan_half * (float)width / (float)height;
+  float sy = tan_half;
+
+  store3(frame->orig, load3(camera.position));
+  store3(frame->base, w - u * sx + v * sy);
+  store3(frame->du, u * (2 * sx / width));
+  store3(frame->dv, -v * (2 * sy / height));
+}
+
+/**
+ * Moves the eye and the point looked at together: forward along the view,
+ * right along the image and up along camera->up, in scene units.
+ **/
+void move_camera(Camera *camera, float forward, float right, float up) {
+  vec3 w, u, v;
+  camera_basis(*camera, &w, &u, &v);
+  vec3 offset = w * forward + u * right + normalize(load3(camera->up)) * up;
+  store3(camera->position, load3(camera->position) + offset);
+  store3(camera->look_at, load3(camera->look_at) + offset);
+}
+
+/**
+ * v turned by angle radians around the unit vector axis (Rodrigues)
+ **/
+static vec3 rotate(vec3 v, vec3 axis, float angle) {
+  float c = cosf(angle), s = sinf(angle);
+  return v * c + cross(axis, v) * s + axis * (dot(axis, v) * (1 - c));
+}
+
+/**
+ * Turns the view around the eye, yaw degrees to the right about
+ * camera->up and pitch degrees up, never past CAMERA_MAX_PITCH from the
+ * horizon so up stays meaningful. The distance to the point looked at is
+ * kept.
+ **/
+void turn_camera(Camera *camera, float yaw, float pitch) {
+  vec3 eye = load3(camera->position);
+  vec3 view = load3(camera->look_at) - eye;
+  vec3 up = normalize(load3(camera->up));
+  const float rad = M_PI / 180;
+
+  view = rotate(view, up, -yaw * rad);
+
+  vec3 right = normalize(cross(view, up));
+  float dist = length(view);
+  if (length(right) > 0 && dist > 0) {
+    float elevation = asinf(clamp(dot(view, up) / dist, -1.0f, 1.0f));
+    float target = clamp(elevation + pitch * rad, -CAMERA_MAX_PITCH * rad,
+                         CAMERA_MAX_PITCH * rad);
+    view = rotate(view, right, target - elevation);
+  }
+  store3(camera->look_at, eye + view);
+}
+
+#pragma omp declare target
+void camera_ray(const CameraFrame *frame, float x, float y, float *orig,
+                float *dir) {
+  store3(orig, load3(frame->orig));
+  store3(dir, normalize(load3(frame->base) + x * load3(frame->du) +
+                        y * load3(frame->dv)));
+}
+#pragma omp end declare target
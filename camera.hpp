@@ -0,0 +1,62 @@
+#pragma once
+
+#include <omp.h>
+
+#include "maths.hpp"
+#include "scheduler.hpp"
+#include "tonemap.hpp"
+
+// Same framing as the former fixed setup: eye at z = 1 looking down -z
+// with the image plane spanning [-1, 1] vertically at z = -1
+#define DEFAULT_FOV 53.1301f
+#define DEFAULT_WIDTH 2560
+#define DEFAULT_HEIGHT 1440
+#define DEFAULT_MAX_DEPTH 5
+#define DEFAULT_ROULETTE 3
+#define CAMERA_MAX_PITCH 89.0f // degrees above or below the horizon
+
+struct Camera {
+  float position[3];
+  float look_at[3];
+  float up[3];
+  float fov; // vertical, in degrees
+};
+
+struct RenderSettings {
+  int width, height;
+  int packet; // primary ray packet size, 0 for single rays
+  int tile_size;
+  int tile_order;     // TILE_SCANLINE, TILE_MORTON or TILE_SPIRAL
+  bool thread_report; // print per worker busy/idle time after the frame
+  int progressive;    // stride of the first coarse pass, 0 or 1 for none
+  int samples;        // per pixel, on a square grid, 1 for the pixel centre
+  int aa_threshold;   // contrast refined when adaptive, 0 to refine all
+  int tonemap;        // TONEMAP_CLAMP or TONEMAP_REINHARD
+  float exposure;     // scale applied before tonemapping
+  int light_samples;  // lights shaded per hit point at most, 0 for all
+  int max_depth;      // mirror and glass bounces, up to MAX_RAY_DEPTH
+  int roulette;       // bounce from which rays may be dropped, 0 for never
+};
+
+#pragma omp declare target
+/**
+ * Everything a primary ray needs, computed once per frame: the ray through
+ * the continuous pixel position (x, y) has direction base + x * du + y * dv.
+ **/
+struct CameraFrame {
+  float orig[3];
+  float base[3];
+  float du[3], dv[3];
+};
+
+void camera_ray(const CameraFrame *frame, float x, float y, float *orig,
+                float *dir);
+#pragma omp end declare target
+
+Camera default_camera();
+RenderSettings default_settings();
+void camera_basis(const Camera &camera, vec3 *w, vec3 *u, vec3 *v);
+void camera_frame(const Camera &camera, int width, int height,
+                  CameraFrame *frame);
+void move_camera(Camera *camera, float forward, float right, float up);
+void turn_camera(Camera *camera, float yaw, float pitch);
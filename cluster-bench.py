@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+
+import subprocess
+import sys
+import os
+import re
+import time
+
+# Renders SCENE with 1 to MAX_WORKERS worker processes on this machine and
+# prints the speedup over one worker. Point HOSTS at other machines (run
+# through ssh) to measure a real cluster.
+SCENE = "scene.txt"
+MAX_WORKERS = 4
+THREADS = 1  # OMP_NUM_THREADS of every worker
+TIMES = 3  # Runs per worker count, the median is kept
+PORT = 7900
+EXTRA_ARGS = []  # e.g. ["-width", "2560", "-height", "1440"]
+HOSTS = []  # e.g. ["node1", "node2"], workers go round robin over them
+
+dir_path = os.path.dirname(os.path.realpath(__file__))
+BUILD_DIR = os.path.join(dir_path, "build")
+RAYTRACER = os.path.join(BUILD_DIR, "raytracer")
+
+PROFILE_NAME = "raytracer-logs"
+WORKING_DIR = os.path.join(dir_path, PROFILE_NAME)
+
+BUILD = False
+
+
+def start_worker(index, coordinator):
+    env = dict(os.environ, OMP_NUM_THREADS=str(THREADS))
+    if not HOSTS:
+        args = [RAYTRACER, "-worker", "localhost:{}".format(PORT)]
+        return subprocess.Popen(args, env=env, stdout=subprocess.DEVNULL,
+                                stderr=subprocess.STDOUT)
+    host = HOSTS[index % len(HOSTS)]
+    command = "OMP_NUM_THREADS={} {} -worker {}:{}".format(
+        THREADS, RAYTRACER, coordinator, PORT)
+    return subprocess.Popen(["ssh", host, command],
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.STDOUT)
+
+
+def run(workers, log):
+    args = [RAYTRACER, "-n", "-f", os.path.join(dir_path, SCENE),
+            "-cluster", str(PORT), "-wait", str(workers),
+            "-o", os.path.join(log_dir, "cluster.ppm")] + EXTRA_ARGS
+    coordinator = subprocess.Popen(args, stdout=subprocess.PIPE,
+                                   stderr=subprocess.STDOUT,
+                                   universal_newlines=True)
+    host = os.uname()[1]
+    started = [start_worker(i, host) for i in range(workers)]
+
+    seconds = None
+    for line in coordinator.stdout:
+        log.write(line)
+        match = re.match(r"Cluster Time: ([0-9.e+-]+) s", line)
+        if match:
+            seconds = float(match.group(1))
+    for worker in started:
+        worker.wait()
+    if coordinator.wait() != 0 or seconds is None:
+        print("Execution error, see " + log.name)
+        sys.exit(1)
+    return seconds
+
+
+if BUILD or not os.path.exists(RAYTRACER):
+    print("Building...")
+    subprocess.run(["cmake", "-S", dir_path, "-B", BUILD_DIR,
+                    "-DCMAKE_BUILD_TYPE=Release"], check=True)
+    subprocess.run(["cmake", "--build", BUILD_DIR, "--target",
+                    "raytracer"], check=True)
+
+if not os.path.exists(WORKING_DIR):
+    os.mkdir(WORKING_DIR)
+timestr = time.strftime("%Y%m%d-%H%M%S")
+log_dir = os.path.join(WORKING_DIR, "cluster-" + timestr)
+os.mkdir(log_dir)
+
+print("- EXPERIMENTS STARTING ({}, {} threads per worker)".format(
+    SCENE, THREADS))
+print("{:>8} {:>10} {:>8} {:>11}".format(
+    "workers", "seconds", "speedup", "efficiency"))
+
+base = None
+with open(os.path.join(log_dir, "output.log"), mode='w') as log:
+    for workers in range(1, MAX_WORKERS + 1):
+        times = sorted(run(workers, log) for _ in range(TIMES))
+        median = times[len(times) // 2]
+        if base is None:
+            base = median
+        speedup = base / median
+        print("{:>8} {:>10.4f} {:>8.2f} {:>10.0f}%".format(
+            workers, median, speedup, 100 * speedup / workers))
+
+print("- EXPERIMENTS ENDING, results in " + log_dir)
@@ -0,0 +1,655 @@
+#include "cluster.hpp"
+#include "renderer.hpp"
+#include "scene_file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// How long a worker keeps trying to reach the coordinator
+#define CONNECT_RETRY_SECONDS 10
+
+#define CLUSTER_SOCKET_BUFFER (4 << 20)
+
+static bool send_all(int fd, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size) {
+  char *p = (char *)data;
+  while (size > 0) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Sends the header and payload in one call where the socket takes it, so
+ * a message is not split over two packets. A peer that is gone makes it
+ * fail, EPIPE rather than SIGPIPE, like send_all.
+ **/
+static bool send_message(int fd, unsigned int type, int count,
+                         const void *payload, long long bytes) {
+  ClusterMessage msg = {CLUSTER_MAGIC, type, count, 0, bytes};
+  struct iovec iov[2] = {{&msg, sizeof(msg)}, {(void *)payload, (size_t)bytes}};
+  struct msghdr parts = msghdr();
+  parts.msg_iov = iov;
+  parts.msg_iovlen = bytes > 0 ? 2 : 1;
+  ssize_t n;
+  do
+    n = sendmsg(fd, &parts, MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return false;
+
+  long long header = sizeof(msg);
+  if (n < header)
+    return send_all(fd, (char *)&msg + n, header - n) &&
+           send_all(fd, payload, bytes);
+  return send_all(fd, (const char *)payload + (n - header),
+                  bytes - (n - header));
+}
+
+static bool recv_message(int fd, ClusterMessage *msg) {
+  return recv_all(fd, msg, sizeof(*msg)) && msg->magic == CLUSTER_MAGIC &&
+         msg->count >= 0 && msg->bytes >= 0;
+}
+
+/**
+ * Makes blocking calls on fd give up after seconds, so a worker dying in
+ * the middle of a message cannot hang the coordinator
+ **/
+static void set_timeout(int fd, double seconds) {
+  struct timeval tv;
+  tv.tv_sec = (long)seconds;
+  tv.tv_usec = (long)((seconds - tv.tv_sec) * 1e6);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Tile lists are small, they go out right away; results are large, the
+ * buffers hold a few batches of them
+ **/
+static void tune_socket(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  int bytes = CLUSTER_SOCKET_BUFFER;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+static long long tile_bytes(const Tile &tile) {
+  return 4LL * sizeof(float) * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+}
+
+/**
+ * A connected worker and the batches of tiles it holds, oldest first
+ **/
+struct Peer {
+  int fd;
+  int threads;
+  std::deque<std::vector<int> > batches; // tile numbers, in the order sent
+  double started; // when the worker could start on the oldest batch
+  int stats;      // index in ClusterStats::workers
+};
+
+/**
+ * Coordinator state for one frame. Every tile is pending, held by one or
+ * two workers, or done; remaining counts those not done.
+ **/
+struct ClusterFrame {
+  std::vector<Tile> tiles;
+  std::vector<char> done;
+  std::vector<int> holders; // live workers holding each tile
+  std::deque<int> pending;  // tiles nobody holds, in tile order
+  int remaining;
+
+  std::vector<Peer> peers;
+  std::string scene; // the scene file shipped to every worker
+  RenderSettings settings;
+  float *hdr;
+  unsigned char *frameBuffer; // tonemapped as tiles come in, may be NULL
+  DirtyTileQueue *dirty;
+  ClusterStats *stats;
+  double timeout;
+};
+
+/**
+ * Takes a new connection: the worker says hello, then gets the settings
+ * and the scene once.
+ **/
+static void join(ClusterFrame *c, int listener) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = accept(listener, (struct sockaddr *)&addr, &len);
+  if (fd < 0)
+    return;
+  set_timeout(fd, c->timeout);
+  tune_socket(fd);
+
+  char host[INET_ADDRSTRLEN] = "?";
+  inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+  std::ostringstream address;
+  address << host << ":" << ntohs(addr.sin_port);
+
+  double start = omp_get_wtime();
+  ClusterMessage hello;
+  ClusterMessage msg = {CLUSTER_MAGIC, CLUSTER_SCENE, 0, 0,
+                        (long long)(sizeof(RenderSettings) + c->scene.size())};
+  if (!recv_message(fd, &hello) || hello.type != CLUSTER_HELLO ||
+      hello.count < 1 || hello.count > CLUSTER_MAX_THREADS ||
+      !send_all(fd, &msg, sizeof(msg)) ||
+      !send_all(fd, &c->settings, sizeof(RenderSettings)) ||
+      !send_all(fd, c->scene.data(), c->scene.size())) {
+    std::cerr << "Cluster: worker " << address.str()
+              << " failed to join, ignoring it" << std::endl;
+    close(fd);
+    return;
+  }
+
+  ClusterWorkerStats worker;
+  worker.address = address.str();
+  worker.threads = hello.count;
+  worker.tiles = worker.batches = 0;
+  worker.ship_time = omp_get_wtime() - start;
+  worker.lost = false;
+  c->stats->workers.push_back(worker);
+
+  Peer peer;
+  peer.fd = fd;
+  peer.threads = hello.count;
+  peer.started = 0;
+  peer.stats = c->stats->workers.size() - 1;
+  c->peers.push_back(peer);
+}
+
+/**
+ * Picks the next batch for a worker: two tiles per thread while there are
+ * plenty, fewer towards the end so the last ones spread out. Once nothing
+ * is pending, a worker with nothing left to do doubles up on the tiles
+ * held longest by the others, so a slow one does not hold the frame back.
+ **/
+static std::vector<int> next_batch(ClusterFrame *c, const Peer &peer) {
+  std::vector<int> batch;
+  int share = c->pending.size() / (2 * c->peers.size());
+  int k = std::max(1, std::min(peer.threads * 2, share));
+
+  while ((int)batch.size() < k && !c->pending.empty()) {
+    int t = c->pending.front();
+    c->pending.pop_front();
+    if (!c->done[t])
+      batch.push_back(t);
+  }
+  if (!batch.empty() || !peer.batches.empty())
+    return batch;
+
+  std::vector<std::pair<double, int> > oldest;
+  for (size_t i = 0; i < c->peers.size(); i++)
+    if (!c->peers[i].batches.empty())
+      oldest.push_back(std::make_pair(c->peers[i].started, (int)i));
+  std::sort(oldest.begin(), oldest.end());
+  for (size_t i = 0; i < oldest.size() && (int)batch.size() < k; i++) {
+    const Peer &slow = c->peers[oldest[i].second];
+    for (size_t b = 0; b < slow.batches.size(); b++) {
+      for (size_t j = 0; j < slow.batches[b].size(); j++) {
+        int t = slow.batches[b][j];
+        if ((int)batch.size() < k && !c->done[t] && c->holders[t] == 1) {
+          batch.push_back(t);
+          c->stats->duplicated++;
+        }
+      }
+    }
+  }
+  return batch;
+}
+
+/**
+ * Keeps CLUSTER_PIPELINE batches in flight on a worker, so the next one
+ * is already there when it finishes one. Returns false if the worker
+ * could not be reached.
+ **/
+static bool hand_out(ClusterFrame *c, Peer &peer) {
+  while ((int)peer.batches.size() < CLUSTER_PIPELINE) {
+    std::vector<int> batch = next_batch(c, peer);
+    if (batch.empty())
+      return true;
+
+    std::vector<Tile> list(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+      list[i] = c->tiles[batch[i]];
+      c->holders[batch[i]]++;
+    }
+    if (peer.batches.empty())
+      peer.started = omp_get_wtime();
+    peer.batches.push_back(batch);
+    c->stats->workers[peer.stats].batches++;
+    if (!send_message(peer.fd, CLUSTER_TILES, list.size(), list.data(),
+                      list.size() * sizeof(Tile)))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Reads the results of a worker's oldest batch into the frame. Returns
+ * false if the worker is gone or sent something else than that batch.
+ **/
+static bool collect(ClusterFrame *c, Peer &peer) {
+  if (peer.batches.empty())
+    return false;
+  const std::vector<int> &batch = peer.batches.front();
+  long long expected = 0;
+  for (size_t i = 0; i < batch.size(); i++)
+    expected += sizeof(Tile) + tile_bytes(c->tiles[batch[i]]);
+
+  ClusterMessage msg;
+  if (!recv_message(peer.fd, &msg) || msg.type != CLUSTER_PIXELS ||
+      msg.count != (int)batch.size() || msg.bytes != expected)
+    return false;
+  std::vector<unsigned char> payload(expected);
+  if (!recv_all(peer.fd, payload.data(), expected))
+    return false;
+
+  // All of it must be right before any is used
+  const unsigned char *p = payload.data();
+  for (size_t i = 0; i < batch.size(); i++) {
+    const Tile &tile = c->tiles[batch[i]];
+    if (memcmp(p, &tile, sizeof(Tile)) != 0)
+      return false;
+    p += sizeof(Tile) + tile_bytes(tile);
+  }
+
+  p = payload.data();
+  int width = c->settings.width;
+  for (size_t i = 0; i < batch.size(); i++) {
+    int t = batch[i];
+    const Tile &tile = c->tiles[t];
+    p += sizeof(Tile);
+
+    c->holders[t]--;
+    if (!c->done[t]) {
+      int row = (tile.x1 - tile.x0) * 4 * sizeof(float);
+      for (int y = tile.y0; y < tile.y1; y++)
+        memcpy(c->hdr + ((long long)y * width + tile.x0) * 4,
+               p + (y - tile.y0) * row, row);
+      if (c->frameBuffer != NULL)
+        tonemap(c->hdr, width, tile,
+                c->frameBuffer + ((long long)tile.y0 * width + tile.x0) * 4,
+                width * 4, c->settings.tonemap, c->settings.exposure);
+      c->done[t] = 1;
+      c->remaining--;
+      c->stats->workers[peer.stats].tiles++;
+      if (c->dirty != NULL)
+        c->dirty->push(tile);
+    }
+    p += tile_bytes(tile);
+  }
+  peer.batches.pop_front();
+  peer.started = omp_get_wtime();
+  return true;
+}
+
+/**
+ * Forgets a dead or silent worker, its tiles going back to the front of
+ * the queue unless another worker holds them too
+ **/
+static void drop(ClusterFrame *c, int index) {
+  Peer &peer = c->peers[index];
+  for (size_t b = 0; b < peer.batches.size(); b++) {
+    for (size_t i = 0; i < peer.batches[b].size(); i++) {
+      int t = peer.batches[b][i];
+      if (--c->holders[t] == 0 && !c->done[t]) {
+        c->pending.push_front(t);
+        c->stats->reassigned++;
+      }
+    }
+  }
+  std::cerr << "Cluster: lost worker "
+            << c->stats->workers[peer.stats].address << std::endl;
+  c->stats->workers[peer.stats].lost = true;
+  close(peer.fd);
+  c->peers.erase(c->peers.begin() + index);
+}
+
+static int listen_on(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 64) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Renders the frame into hdr on workers connecting to port (run_worker),
+ * as coordinator, tonemapping tiles into frameBuffer as they arrive unless
+ * it is NULL. Waits up to timeout seconds for wait workers before
+ * handing out tiles, taking later ones in along the way. Workers get
+ * batches of tiles as they finish the previous one; one that dies or
+ * stays silent with tiles for timeout seconds is dropped and its tiles
+ * handed out again. With no worker left, the coordinator finishes the
+ * frame itself. Returns false if port cannot be listened on.
+ **/
+bool render_cluster(float *hdr, unsigned char *frameBuffer, Camera camera,
+                    RenderSettings settings, const Scene &scene, int port,
+                    int wait, double timeout, DirtyTileQueue *dirty,
+                    ClusterStats *stats) {
+  int listener = listen_on(port);
+  if (listener < 0) {
+    std::cerr << "Cluster: could not listen on port " << port << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+
+  ClusterFrame c;
+  c.settings = settings;
+  c.hdr = hdr;
+  c.frameBuffer = frameBuffer;
+  c.dirty = dirty;
+  c.stats = stats;
+  c.timeout = timeout;
+
+  std::ostringstream blob;
+  write_scene_stream(blob, scene, camera, settings);
+  c.scene = blob.str();
+
+  // The usual tiles in the usual order, handed out from the front
+  TileScheduler scheduler(settings.width, settings.height,
+                          settings.tile_size > 0 ? settings.tile_size : 1,
+                          settings.tile_order, 1);
+  Tile tile;
+  while (scheduler.next(0, tile))
+    c.tiles.push_back(tile);
+  int n = c.tiles.size();
+  c.done.assign(n, 0);
+  c.holders.assign(n, 0);
+  for (int t = 0; t < n; t++)
+    c.pending.push_back(t);
+  c.remaining = n;
+
+  *stats = ClusterStats();
+  stats->scene_bytes = c.scene.size();
+  stats->tiles = n;
+
+  std::cout << "Cluster: listening on port " << port << ", waiting for "
+            << wait << " worker" << (wait > 1 ? "s" : "") << std::endl;
+  double wait_start = omp_get_wtime();
+  while ((int)c.peers.size() < wait &&
+         omp_get_wtime() - wait_start < timeout) {
+    struct pollfd p = {listener, POLLIN, 0};
+    if (poll(&p, 1, 100) > 0)
+      join(&c, listener);
+  }
+
+  double start = omp_get_wtime();
+  while (c.remaining > 0) {
+    if (c.peers.empty()) {
+      std::cerr << "Cluster: no workers, rendering the last " << c.remaining
+                << " tiles here" << std::endl;
+      std::vector<Tile> rest;
+      for (int t = 0; t < n; t++)
+        if (!c.done[t])
+          rest.push_back(c.tiles[t]);
+      render_tiles(hdr, rest.data(), rest.size(), camera, settings, scene);
+      for (size_t t = 0; t < rest.size(); t++) {
+        const Tile &r = rest[t];
+        if (frameBuffer != NULL)
+          tonemap(hdr, settings.width, r,
+                  frameBuffer + ((long long)r.y0 * settings.width + r.x0) * 4,
+                  settings.width * 4, settings.tonemap, settings.exposure);
+        if (dirty != NULL)
+          dirty->push(r);
+      }
+      stats->local = rest.size();
+      c.remaining = 0;
+      break;
+    }
+
+    // Top up first, pending tiles may have come back
+    for (int i = c.peers.size() - 1; i >= 0; i--)
+      if (!hand_out(&c, c.peers[i]))
+        drop(&c, i);
+
+    std::vector<struct pollfd> fds(c.peers.size() + 1);
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < c.peers.size(); i++) {
+      fds[i + 1].fd = c.peers[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+      break;
+
+    double now = omp_get_wtime();
+    for (int i = c.peers.size() - 1; i >= 0; i--) {
+      if (fds[i + 1].revents != 0) {
+        if (!collect(&c, c.peers[i]) || !hand_out(&c, c.peers[i]))
+          drop(&c, i);
+      } else if (!c.peers[i].batches.empty() &&
+                 now - c.peers[i].started > timeout) {
+        drop(&c, i);
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+      join(&c, listener);
+  }
+  stats->time = omp_get_wtime() - start;
+
+  for (size_t i = 0; i < c.peers.size(); i++) {
+    send_message(c.peers[i].fd, CLUSTER_DONE, 0, NULL, 0);
+    close(c.peers[i].fd);
+  }
+  close(listener);
+  return true;
+}
+
+void print_cluster_stats(const ClusterStats &stats, std::ostream &out) {
+  out << "Cluster Time: " << stats.time << " s (" << stats.workers.size()
+      << " workers, " << stats.tiles << " tiles, " << stats.reassigned
+      << " reassigned, " << stats.duplicated << " duplicated, "
+      << stats.local << " rendered here)" << std::endl;
+  out << "Scene Shipped: " << stats.scene_bytes * 1e-6 << " MB per worker"
+      << std::endl;
+  for (size_t w = 0; w < stats.workers.size(); w++) {
+    const ClusterWorkerStats &worker = stats.workers[w];
+    out << "  worker " << std::setw(3) << w << ": " << worker.address << ", "
+        << worker.threads << " threads, " << worker.tiles << " tiles in "
+        << worker.batches << " batches, scene sent in " << worker.ship_time
+        << " s" << (worker.lost ? ", lost" : "") << std::endl;
+  }
+}
+
+/**
+ * Connects to host:port, retrying for a while so workers may start before
+ * the coordinator. Returns the socket, or -1.
+ **/
+static int connect_to(const std::string &address) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos)
+    return -1;
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+
+  double start = omp_get_wtime();
+  while (omp_get_wtime() - start < CONNECT_RETRY_SECONDS) {
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+      return -1;
+
+    for (struct addrinfo *a = found; a != NULL; a = a->ai_next) {
+      int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd < 0)
+        continue;
+      if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+        freeaddrinfo(found);
+        return fd;
+      }
+      close(fd);
+    }
+    freeaddrinfo(found);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return -1;
+}
+
+/**
+ * Worker side: joins the coordinator at address (host:port), receives the
+ * scene, then renders the batches of tiles it is handed with every thread
+ * until the frame is done. Returns the exit status.
+ **/
+int run_worker(const std::string &address) {
+  int fd = connect_to(address);
+  if (fd < 0) {
+    std::cerr << "Could not connect to '" << address << "'" << std::endl;
+    return 1;
+  }
+  tune_socket(fd);
+
+  double start = omp_get_wtime();
+  ClusterMessage msg;
+  RenderSettings settings;
+  if (!send_message(fd, CLUSTER_HELLO, omp_get_max_threads(), NULL, 0) ||
+      !recv_message(fd, &msg) || msg.type != CLUSTER_SCENE ||
+      msg.bytes <= (long long)sizeof(RenderSettings) ||
+      !recv_all(fd, &settings, sizeof(settings))) {
+    std::cerr << "Worker: no scene from '" << address << "'" << std::endl;
+    close(fd);
+    return 1;
+  }
+  if (settings.width <= 0 || settings.width > CLUSTER_MAX_SIDE ||
+      settings.height <= 0 || settings.height > CLUSTER_MAX_SIDE) {
+    std::cerr << "Worker: bad resolution " << settings.width << "x"
+              << settings.height << " from '" << address << "'"
+              << std::endl;
+    close(fd);
+    return 1;
+  }
+
+  // Received straight into anonymous memory, attached like a mapped file
+  size_t size = msg.bytes - sizeof(settings);
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED || !recv_all(fd, data, size)) {
+    std::cerr << "Worker: no scene from '" << address << "'" << std::endl;
+    if (data != MAP_FAILED)
+      munmap(data, size);
+    close(fd);
+    return 1;
+  }
+
+  Scene scene;
+  Camera camera;
+  RenderSettings file_settings;
+  SceneMapping mapping = {NULL, 0, NULL};
+  if (!attach_scene_binary(data, size, address, &mapping, &scene, &camera,
+                           &file_settings)) {
+    close(fd);
+    return 1;
+  }
+  std::cout << "Worker: " << size * 1e-6 << " MB scene from " << address
+            << " in " << omp_get_wtime() - start << " s" << std::endl;
+
+  const int width = settings.width, height = settings.height;
+  float *hdr = new float[4LL * width * height];
+
+  bool ok = true;
+  int tiles = 0, batches = 0;
+  double busy = 0;
+  std::vector<Tile> batch;
+  std::vector<unsigned char> payload;
+  while (recv_message(fd, &msg) && msg.type != CLUSTER_DONE) {
+    ok = msg.type == CLUSTER_TILES &&
+         msg.bytes == (long long)msg.count * (long long)sizeof(Tile);
+    batch.resize(msg.count);
+    ok = ok && recv_all(fd, batch.data(), msg.bytes);
+    for (int i = 0; i < msg.count && ok; i++) {
+      const Tile &tile = batch[i];
+      ok = tile.x0 >= 0 && tile.x0 < tile.x1 && tile.x1 <= width &&
+           tile.y0 >= 0 && tile.y0 < tile.y1 && tile.y1 <= height;
+    }
+    if (!ok) {
+      std::cerr << "Worker: bad message from '" << address << "'"
+                << std::endl;
+      break;
+    }
+
+    double batch_start = omp_get_wtime();
+    render_tiles(hdr, batch.data(), msg.count, camera, settings, scene);
+    busy += omp_get_wtime() - batch_start;
+
+    payload.clear();
+    for (int i = 0; i < msg.count; i++) {
+      const Tile &tile = batch[i];
+      const unsigned char *t = (const unsigned char *)&tile;
+      payload.insert(payload.end(), t, t + sizeof(Tile));
+      int row = (tile.x1 - tile.x0) * 4 * sizeof(float);
+      for (int y = tile.y0; y < tile.y1; y++) {
+        const unsigned char *p =
+            (const unsigned char *)(hdr + ((long long)y * width + tile.x0) * 4);
+        payload.insert(payload.end(), p, p + row);
+      }
+    }
+    if (!send_message(fd, CLUSTER_PIXELS, msg.count, payload.data(),
+                      payload.size()))
+      break;
+    tiles += msg.count;
+    batches++;
+  }
+
+  std::cout << "Worker: " << tiles << " tiles in " << batches
+            << " batches, busy " << busy << " s of "
+            << omp_get_wtime() - start << " s" << std::endl;
+
+  delete[] hdr;
+  unmap_scene_binary(&mapping, &scene);
+  close(fd);
+  return ok ? 0 : 1;
+}
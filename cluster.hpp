@@ -0,0 +1,63 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+#include "scene.hpp"
+#include "tile_queue.hpp"
+
+#define CLUSTER_MAGIC 0x52544332u // "RTC2", also catches a byte order mismatch
+
+#define CLUSTER_HELLO 1  // worker: count is its number of threads
+#define CLUSTER_SCENE 2  // coordinator: RenderSettings then bytes of scene file
+#define CLUSTER_TILES 3  // coordinator: count Tile to render
+#define CLUSTER_PIXELS 4 // worker: count times a Tile and its float RGBA rows
+#define CLUSTER_DONE 5   // coordinator: the frame is complete
+
+#define CLUSTER_TIMEOUT 30 // seconds a worker may hold tiles without answering
+#define CLUSTER_PIPELINE 2 // batches in flight per worker
+
+// Largest values a peer is believed, anything more is a broken message
+#define CLUSTER_MAX_SIDE 65536   // pixels along either side of the frame
+#define CLUSTER_MAX_THREADS 4096 // threads of one worker
+
+/**
+ * Every message starts with this header, bytes of payload following. Both
+ * ends run the same build, so structs go over the wire as they are.
+ **/
+struct ClusterMessage {
+  unsigned int magic;
+  unsigned int type;
+  int count;
+  int pad;
+  long long bytes;
+};
+
+struct ClusterWorkerStats {
+  std::string address;
+  int threads;
+  int tiles; // results that were used
+  int batches;
+  double ship_time; // sending it the scene
+  bool lost;        // died or stayed silent past the timeout
+};
+
+struct ClusterStats {
+  double time; // from the first tiles handed out to the last one back
+  long long scene_bytes;
+  int tiles;
+  int reassigned; // tiles handed out again after their worker was lost
+  int duplicated; // tiles handed out twice to finish ahead of a slow worker
+  int local;      // tiles rendered by the coordinator, left without workers
+  std::vector<ClusterWorkerStats> workers;
+};
+
+bool render_cluster(float *hdr, unsigned char *frameBuffer, Camera camera,
+                    RenderSettings settings, const Scene &scene, int port,
+                    int wait, double timeout, DirtyTileQueue *dirty,
+                    ClusterStats *stats);
+void print_cluster_stats(const ClusterStats &stats, std::ostream &out);
+
+int run_worker(const std::string &address);
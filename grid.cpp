@@ -0,0 +1,458 @@
+#include "grid.hpp"
+#include "bvh.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+/**
+ * Cells a ray goes through, 3D-DDA (Amanatides and Woo): the cell it is
+ * in, the distance at which it crosses the next boundary along each axis
+ * and the distance between two boundaries.
+ **/
+struct GridWalk {
+  int c[3], step[3];
+  float next[3], delta[3];
+  float t_end; // where the ray leaves the grid or ends
+};
+
+#pragma omp declare target
+/**
+ * Starts the walk where the ray enters the grid, false when it misses it
+ * or only reaches it beyond t_max
+ **/
+static inline bool walk_start(const UniformGrid *grid, const float *orig,
+                              const float *dir, float t_max, GridWalk *w) {
+  float inv_dir[3] = {1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+  float t0 = 0, t1 = t_max;
+  for (int k = 0; k < 3; k++) {
+    float hi = grid->lo[k] + grid->dims[k] * grid->cell[k];
+    float ta = (grid->lo[k] - orig[k]) * inv_dir[k];
+    float tb = (hi - orig[k]) * inv_dir[k];
+    if (ta > tb) {
+      float tmp = ta;
+      ta = tb;
+      tb = tmp;
+    }
+    t0 = ta > t0 ? ta : t0;
+    t1 = tb < t1 ? tb : t1;
+  }
+  if (!(t0 <= t1))
+    return false;
+
+  w->t_end = t1;
+  for (int k = 0; k < 3; k++) {
+    float p = orig[k] + dir[k] * t0;
+    w->c[k] = clamp((int)((p - grid->lo[k]) * grid->inv_cell[k]), 0,
+                    grid->dims[k] - 1);
+    if (dir[k] > 0) {
+      w->step[k] = 1;
+      float bound = grid->lo[k] + (w->c[k] + 1) * grid->cell[k];
+      w->next[k] = (bound - orig[k]) * inv_dir[k];
+      w->delta[k] = grid->cell[k] * inv_dir[k];
+    } else if (dir[k] < 0) {
+      w->step[k] = -1;
+      float bound = grid->lo[k] + w->c[k] * grid->cell[k];
+      w->next[k] = (bound - orig[k]) * inv_dir[k];
+      w->delta[k] = -grid->cell[k] * inv_dir[k];
+    } else {
+      w->step[k] = 0;
+      w->next[k] = FLT_MAX;
+      w->delta[k] = 0;
+    }
+  }
+  return true;
+}
+
+static inline int walk_axis(const GridWalk *w) {
+  if (w->next[0] < w->next[1])
+    return w->next[0] < w->next[2] ? 0 : 2;
+  return w->next[1] < w->next[2] ? 1 : 2;
+}
+
+static inline int walk_cell(const UniformGrid *grid, const GridWalk *w) {
+  return (w->c[2] * grid->dims[1] + w->c[1]) * grid->dims[0] + w->c[0];
+}
+
+/**
+ * Moves to the next cell along the ray, false once it leaves the grid or
+ * ends in the current one
+ **/
+static inline bool walk_next(const UniformGrid *grid, GridWalk *w) {
+  int axis = walk_axis(w);
+  if (w->next[axis] > w->t_end)
+    return false;
+  w->c[axis] += w->step[axis];
+  if (w->c[axis] < 0 || w->c[axis] >= grid->dims[axis])
+    return false;
+  w->next[axis] += w->delta[axis];
+  return true;
+}
+
+/**
+ * Tests the count primitives listed at refs for a hit nearer than *t_best,
+ * returning the type of the nearest one found, 0 for none
+ **/
+static inline int refs_closest(const int *refs, int count, TriangleSoA *tris,
+                               SphereSoA *spheres, InstanceSet *instances,
+                               float *orig, float *dir, float *t_best,
+                               int *index, int *instance) {
+  vec3 o = load3(orig), d = load3(dir);
+  float t, u, v;
+  int hit = 0;
+  for (int r = 0; r < count; r++) {
+    int i = refs[r] >> 2;
+    switch (refs[r] & 3) {
+    case BVH_TRIANGLE: {
+      STAT_ADD(triangle_tests, 1);
+      vec3 p = {tris->px[i], tris->py[i], tris->pz[i]};
+      vec3 e1 = {tris->e1x[i], tris->e1y[i], tris->e1z[i]};
+      vec3 e2 = {tris->e2x[i], tris->e2y[i], tris->e2z[i]};
+      if (rayTriangleIntersects(o, d, p, e1, e2, &t, &u, &v) && t < *t_best) {
+        *t_best = t;
+        *index = i;
+        hit = BVH_TRIANGLE;
+      }
+      break;
+    }
+    case BVH_SPHERE: {
+      STAT_ADD(sphere_tests, 1);
+      vec3 c = {spheres->x[i], spheres->y[i], spheres->z[i]};
+      if (raySphereIntersects(o, d, c, spheres->r[i], &t) && t < *t_best) {
+        *t_best = t;
+        *index = i;
+        hit = BVH_SPHERE;
+      }
+      break;
+    }
+    default:
+      if (instances_closest(instances, i, 1, orig, dir, t_best, index,
+                            instance))
+        hit = BVH_INSTANCE;
+    }
+  }
+  return hit;
+}
+
+static inline bool refs_occluded(const int *refs, int count,
+                                 TriangleSoA *tris, SphereSoA *spheres,
+                                 InstanceSet *instances, float *orig,
+                                 float *dir, float tmin, float tmax) {
+  vec3 o = load3(orig), d = load3(dir);
+  float t, u, v;
+  for (int r = 0; r < count; r++) {
+    int i = refs[r] >> 2;
+    switch (refs[r] & 3) {
+    case BVH_TRIANGLE: {
+      STAT_ADD(triangle_tests, 1);
+      vec3 p = {tris->px[i], tris->py[i], tris->pz[i]};
+      vec3 e1 = {tris->e1x[i], tris->e1y[i], tris->e1z[i]};
+      vec3 e2 = {tris->e2x[i], tris->e2y[i], tris->e2z[i]};
+      if (rayTriangleIntersects(o, d, p, e1, e2, &t, &u, &v) && t > tmin &&
+          t < tmax)
+        return true;
+      break;
+    }
+    case BVH_SPHERE: {
+      STAT_ADD(sphere_tests, 1);
+      vec3 c = {spheres->x[i], spheres->y[i], spheres->z[i]};
+      if (raySphereIntersects(o, d, c, spheres->r[i], &t) && t > tmin &&
+          t < tmax)
+        return true;
+      break;
+    }
+    default:
+      if (instances_occluded(instances, i, 1, orig, dir, tmin, tmax))
+        return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Closest hit, *t being set to the distance. Returns the primitive type
+ * when something was hit, 0 otherwise, like bvh_intersect.
+ *
+ * The global primitives come first, the cells are then only walked up to
+ * the nearest of their hits. A primitive listed in the current cell may be
+ * hit beyond it, so the walk only stops once the closest hit so far is
+ * before the cell's far side. Primitives over several cells are tested
+ * again in each: the lattices the grid is meant for have few of them.
+ **/
+int grid_intersect(UniformGrid *grid, TriangleSoA *tris, SphereSoA *spheres,
+                   InstanceSet *instances, int *index, int *instance, float *t,
+                   float *orig, float *dir) {
+  float t_best = FLT_MAX;
+  int hit = refs_closest(grid->global, grid->n_global, tris, spheres,
+                         instances, orig, dir, &t_best, index, instance);
+
+  GridWalk w;
+  if (walk_start(grid, orig, dir, t_best, &w)) {
+    do {
+      STAT_ADD(node_visits, 1);
+      int cell = walk_cell(grid, &w);
+      int found = refs_closest(grid->refs + grid->first[cell],
+                               grid->first[cell + 1] - grid->first[cell],
+                               tris, spheres, instances, orig, dir, &t_best,
+                               index, instance);
+      hit = found != 0 ? found : hit;
+    } while (t_best > w.next[walk_axis(&w)] && walk_next(grid, &w));
+  }
+
+  *t = t_best;
+  return hit;
+}
+
+/**
+ * Any hit between tmin and tmax, the cells being walked up to tmax
+ **/
+int grid_occluded(UniformGrid *grid, TriangleSoA *tris, SphereSoA *spheres,
+                  InstanceSet *instances, float *orig, float *dir, float tmin,
+                  float tmax) {
+  if (refs_occluded(grid->global, grid->n_global, tris, spheres, instances,
+                    orig, dir, tmin, tmax))
+    return true;
+
+  GridWalk w;
+  if (!walk_start(grid, orig, dir, tmax, &w))
+    return false;
+  do {
+    STAT_ADD(node_visits, 1);
+    int cell = walk_cell(grid, &w);
+    if (refs_occluded(grid->refs + grid->first[cell],
+                      grid->first[cell + 1] - grid->first[cell], tris,
+                      spheres, instances, orig, dir, tmin, tmax))
+      return true;
+  } while (walk_next(grid, &w));
+
+  return false;
+}
+#pragma omp end declare target
+
+/**
+ * Box of primitive p of the scene, p running over the triangles, then the
+ * spheres, then the instances. Returns its reference.
+ **/
+static int prim_bounds(TriangleSoA *tris, SphereSoA *spheres,
+                       InstanceSet *instances, int p, float bmin[3],
+                       float bmax[3]) {
+  if (p < tris->count) {
+    float v[3][3] = {{tris->px[p], tris->py[p], tris->pz[p]},
+                     {tris->px[p] + tris->e1x[p], tris->py[p] + tris->e1y[p],
+                      tris->pz[p] + tris->e1z[p]},
+                     {tris->px[p] + tris->e2x[p], tris->py[p] + tris->e2y[p],
+                      tris->pz[p] + tris->e2z[p]}};
+    for (int k = 0; k < 3; k++) {
+      bmin[k] = std::min(v[0][k], std::min(v[1][k], v[2][k]));
+      bmax[k] = std::max(v[0][k], std::max(v[1][k], v[2][k]));
+    }
+    return p << 2 | BVH_TRIANGLE;
+  }
+
+  p -= tris->count;
+  if (p < spheres->count) {
+    float c[3] = {spheres->x[p], spheres->y[p], spheres->z[p]};
+    for (int k = 0; k < 3; k++) {
+      bmin[k] = c[k] - spheres->r[p];
+      bmax[k] = c[k] + spheres->r[p];
+    }
+    return p << 2 | BVH_SPHERE;
+  }
+
+  p -= spheres->count;
+  const MeshInstance &instance = instances->list[p];
+  instance_bounds(instance, instances->meshes[instance.mesh], bmin, bmax);
+  return p << 2 | BVH_INSTANCE;
+}
+
+/**
+ * Calls visit(cell) for every cell the box of primitive ref overlaps;
+ * spheres skip the cells only their box reaches, as the light grid does.
+ **/
+template <class Visit>
+static void prim_cells(const UniformGrid *grid, const SphereSoA *spheres,
+                       int ref, const float bmin[3], const float bmax[3],
+                       Visit visit) {
+  // A sphere touching the far side of a cell, as in a lattice of spheres
+  // one cell apart, does not reach into the next one
+  bool sphere = (ref & 3) == BVH_SPHERE;
+  int s = ref >> 2;
+  int c0[3], c1[3];
+  for (int k = 0; k < 3; k++) {
+    float f0 = (bmin[k] - grid->lo[k]) * grid->inv_cell[k];
+    float f1 = (bmax[k] - grid->lo[k]) * grid->inv_cell[k];
+    c0[k] = clamp((int)f0, 0, grid->dims[k] - 1);
+    c1[k] = clamp(sphere ? (int)std::ceil(f1) - 1 : (int)f1, 0,
+                  grid->dims[k] - 1);
+  }
+
+  for (int z = c0[2]; z <= c1[2]; z++) {
+    for (int y = c0[1]; y <= c1[1]; y++) {
+      for (int x = c0[0]; x <= c1[0]; x++) {
+        if (sphere) {
+          int c[3] = {x, y, z};
+          float center[3] = {spheres->x[s], spheres->y[s], spheres->z[s]};
+          float d2 = 0;
+          for (int k = 0; k < 3; k++) {
+            float lo = grid->lo[k] + c[k] * grid->cell[k];
+            float hi = lo + grid->cell[k];
+            float d = std::max(std::max(lo - center[k], center[k] - hi), 0.0f);
+            d2 += d * d;
+          }
+          if (d2 >= spheres->r[s] * spheres->r[s])
+            continue;
+        }
+        visit((z * grid->dims[1] + y) * grid->dims[0] + x);
+      }
+    }
+  }
+}
+
+/**
+ * Builds the grid over the SoA streams and the instances of a scene.
+ *
+ * Primitives over GRID_LARGE times the median size go to the global list,
+ * the others to the cells. The cell size is picked so that there are about
+ * GRID_DENSITY cells per primitive in them over their box, at most
+ * GRID_MAX_CELLS. Axes along which the box is thinner than the median
+ * primitive, like the plane of spheres the raytracer adds, are widened to
+ * that size and get a single layer of cells. The lists are counted, then
+ * filled, in parallel, and each sorted so that ties between hits resolve
+ * the same way every run.
+ **/
+void build_grid(UniformGrid *grid, TriangleSoA *tris, SphereSoA *spheres,
+                InstanceSet *instances) {
+  int n = tris->count + spheres->count + instances->count;
+  grid->first = grid->refs = grid->global = NULL;
+  grid->n_global = 0;
+  for (int k = 0; k < 3; k++) {
+    grid->lo[k] = grid->cell[k] = grid->inv_cell[k] = 0;
+    grid->dims[k] = 0;
+  }
+  if (n == 0)
+    return;
+
+  // Size of a primitive is the longest side of its box
+  std::vector<float> sizes(n);
+#pragma omp parallel for
+  for (int p = 0; p < n; p++) {
+    float bmin[3], bmax[3];
+    prim_bounds(tris, spheres, instances, p, bmin, bmax);
+    sizes[p] = std::max(bmax[0] - bmin[0],
+                        std::max(bmax[1] - bmin[1], bmax[2] - bmin[2]));
+  }
+  std::vector<float> sorted(sizes);
+  std::nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+  float median = sorted[n / 2];
+  std::vector<float>().swap(sorted);
+  float large = median > 0 ? median * GRID_LARGE : FLT_MAX;
+
+  std::vector<int> global;
+  float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  for (int p = 0; p < n; p++) {
+    float bmin[3], bmax[3];
+    int ref = prim_bounds(tris, spheres, instances, p, bmin, bmax);
+    if (sizes[p] > large) {
+      global.push_back(ref);
+      continue;
+    }
+    for (int k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], bmin[k]);
+      hi[k] = std::max(hi[k], bmax[k]);
+    }
+  }
+  grid->n_global = global.size();
+  grid->global = new int[global.size()];
+  copy_array(grid->global, global.data(), global.size());
+  int n_cell_prims = n - grid->n_global;
+
+  float extent[3];
+  float widest = 0;
+  for (int k = 0; k < 3; k++)
+    widest = std::max(widest, hi[k] - lo[k]);
+  float pad = median > 0 ? median : (widest > 0 ? widest * 1e-3f : 1);
+  double volume = 1;
+  for (int k = 0; k < 3; k++) {
+    extent[k] = hi[k] - lo[k];
+    if (extent[k] < pad) {
+      lo[k] -= (pad - extent[k]) / 2;
+      extent[k] = pad;
+    }
+    volume *= extent[k];
+  }
+
+  long long cells = std::min((long long)GRID_DENSITY * n_cell_prims,
+                             (long long)GRID_MAX_CELLS);
+  double size = std::cbrt(volume / cells);
+  for (;;) {
+    cells = 1;
+    for (int k = 0; k < 3; k++) {
+      double d = std::min(std::ceil(extent[k] / size), (double)GRID_MAX_CELLS);
+      grid->dims[k] = std::max(1, (int)d);
+      cells *= grid->dims[k];
+    }
+    if (cells <= GRID_MAX_CELLS)
+      break;
+    size *= 1.25;
+  }
+  for (int k = 0; k < 3; k++) {
+    grid->lo[k] = lo[k];
+    grid->cell[k] = extent[k] / grid->dims[k];
+    grid->inv_cell[k] = grid->dims[k] / extent[k];
+  }
+
+  // Count, then fill each cell's run of the list
+  int n_cells = cells;
+  grid->first = new int[n_cells + 1]();
+  int *count = grid->first + 1;
+#pragma omp parallel for
+  for (int p = 0; p < n; p++) {
+    if (sizes[p] > large)
+      continue;
+    float bmin[3], bmax[3];
+    int ref = prim_bounds(tris, spheres, instances, p, bmin, bmax);
+    prim_cells(grid, spheres, ref, bmin, bmax, [&](int cell) {
+#pragma omp atomic
+      count[cell]++;
+    });
+  }
+  for (int c = 0; c < n_cells; c++)
+    grid->first[c + 1] += grid->first[c];
+
+  grid->refs = new int[grid->first[n_cells]];
+  std::vector<int> next(grid->first, grid->first + n_cells);
+#pragma omp parallel for
+  for (int p = 0; p < n; p++) {
+    if (sizes[p] > large)
+      continue;
+    float bmin[3], bmax[3];
+    int ref = prim_bounds(tris, spheres, instances, p, bmin, bmax);
+    prim_cells(grid, spheres, ref, bmin, bmax, [&](int cell) {
+      int slot;
+#pragma omp atomic capture
+      slot = next[cell]++;
+      grid->refs[slot] = ref;
+    });
+  }
+
+#pragma omp parallel for schedule(dynamic, 4096)
+  for (int c = 0; c < n_cells; c++)
+    std::sort(grid->refs + grid->first[c], grid->refs + grid->first[c + 1]);
+}
+
+void free_grid(UniformGrid *grid) {
+  delete[] grid->first;
+  delete[] grid->refs;
+  delete[] grid->global;
+  grid->first = grid->refs = grid->global = NULL;
+  grid->n_global = 0;
+  for (int k = 0; k < 3; k++)
+    grid->dims[k] = 0;
+}
+
+long long grid_cells(const UniformGrid &grid) {
+  return (long long)grid.dims[0] * grid.dims[1] * grid.dims[2];
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <omp.h>
+
+#include "maths.hpp"
+#include "mesh.hpp"
+#include "simd.hpp"
+
+#define GRID_DENSITY 1           // cells per primitive, see build_grid
+#define GRID_MAX_CELLS (1 << 24) // 64 MB of offsets
+#define GRID_LARGE 16            // times the median size, kept out of cells
+
+#pragma omp declare target
+/**
+ * Uniform grid over the primitives of a scene, an alternative to the BVH
+ * for many primitives of about the same size spread evenly, such as the
+ * sphere lattices. Cell c, x running fastest, lists its primitives at
+ * refs[first[c]] up to refs[first[c + 1]], each as index << 2 | type with
+ * the BVH_* types. A primitive is listed in every cell it overlaps.
+ * Primitives much larger than most, such as a ground plane, would be in
+ * every cell and stretch the grid: they are listed in global instead and
+ * tested by every ray before it walks the cells.
+ **/
+struct UniformGrid {
+  float lo[3];       // corner of the grid
+  float cell[3];     // size of a cell along each axis
+  float inv_cell[3]; // cells per unit along each axis
+  int dims[3];       // 0 when there is no grid
+  int *first;
+  int *refs;
+  int *global;
+  int n_global;
+};
+
+int grid_intersect(UniformGrid *grid, TriangleSoA *tris, SphereSoA *spheres,
+                   InstanceSet *instances, int *index, int *instance, float *t,
+                   float *orig, float *dir);
+int grid_occluded(UniformGrid *grid, TriangleSoA *tris, SphereSoA *spheres,
+                  InstanceSet *instances, float *orig, float *dir, float tmin,
+                  float tmax);
+#pragma omp end declare target
+
+void build_grid(UniformGrid *grid, TriangleSoA *tris, SphereSoA *spheres,
+                InstanceSet *instances);
+void free_grid(UniformGrid *grid);
+long long grid_cells(const UniformGrid &grid);
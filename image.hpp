@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+// Rows deflated together by one thread when writing PNG
+#define PNG_BLOCK_ROWS 64
+
+/**
+ * Writes an ARGB8888 frame buffer to path, the format being picked by the
+ * extension: .ppm (binary P6), .png or .pfm (32 bit float RGB). A .pfm is
+ * written from hdr, the float RGBA image behind the frame buffer, unless
+ * it is NULL. Returns false after printing why the image could not be
+ * written.
+ **/
+bool write_image(const std::string &path, const unsigned char *frameBuffer,
+                 const float *hdr, int width, int height);
+
+bool image_format_supported(const std::string &path);
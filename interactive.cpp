@@ -0,0 +1,207 @@
+#include "interactive.hpp"
+
+#include <algorithm>
+#include <omp.h>
+
+InteractiveRenderer::InteractiveRenderer(float *hdr, Camera camera,
+                                         RenderSettings settings, Scene scene,
+                                         DirtyTileQueue *dirty, double budget)
+    : hdr(hdr), settings(settings), scene(scene), dirty(dirty),
+      budget(budget), camera(camera), requested(0), stop(false), idle(false),
+      cancel(false), started(-1), frames(0), frame_generation(-1),
+      scale(INTERACTIVE_MAX_SCALE / 2), previews(0), full_frames(0),
+      preview_time(0), preview_scales(0), latest(0), uploaded_frames(0),
+      refresh(false), waiting(-1), waiting_time(0), moves(0) {
+  thread = std::thread(&InteractiveRenderer::run, this);
+}
+
+InteractiveRenderer::~InteractiveRenderer() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+    cancel = true;
+  }
+  wake.notify_one();
+  thread.join();
+}
+
+void InteractiveRenderer::move(const Camera &view, double input_time) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    camera = view;
+    latest = ++requested;
+    cancel = true;
+    idle = false;
+  }
+  wake.notify_one();
+
+  moves++;
+  if (waiting < 0) {
+    waiting = latest;
+    waiting_time = input_time;
+  }
+}
+
+bool InteractiveRenderer::busy() const {
+  return !idle || refresh || frames != uploaded_frames;
+}
+
+bool InteractiveRenderer::frame_changed(int *generation) {
+  int f = frames;
+  bool overflowed = dirty->overflowed();
+  if (f == uploaded_frames && !overflowed && !refresh)
+    return false;
+
+  uploaded_frames = f;
+  refresh = false;
+  // Tiles of the latest camera may be in hdr over its preview
+  *generation = started == latest ? latest : frame_generation;
+  return true;
+}
+
+bool InteractiveRenderer::next_tile(Tile &tile, int *generation) {
+  for (;;) {
+    // Read before popping: once it is the latest camera, the render thread
+    // has taken every older tile out of the queue
+    int before = started;
+    if (!dirty->pop(tile))
+      return false;
+    if (before == latest) {
+      *generation = before;
+      return true;
+    }
+
+    // The render of the latest camera started meanwhile, so the tile may
+    // have been its own: upload the whole frame rather than lose it
+    if (started == latest)
+      refresh = true;
+  }
+}
+
+void InteractiveRenderer::presented(int generation) {
+  if (waiting < 0 || generation < waiting)
+    return;
+  latencies.push_back((omp_get_wtime() - waiting_time) * 1000);
+  waiting = -1;
+}
+
+/**
+ * Renders a preview of view at 1 / scale of the resolution, scales it up
+ * into hdr and picks the scale of the next one from the time it took.
+ **/
+void InteractiveRenderer::preview(const Camera &view, int generation) {
+  int width = settings.width, height = settings.height;
+  RenderSettings low = settings;
+  low.width = std::max(1, width / scale);
+  low.height = std::max(1, height / scale);
+  low.progressive = 0;
+  low.samples = 1;
+  low.thread_report = false;
+  if (small.size() < (size_t)low.width * low.height * 4)
+    small.resize((size_t)low.width * low.height * 4);
+
+  // Not cancelled: were every move to restart it, a camera moving every
+  // frame would never be shown
+  double start = omp_get_wtime();
+  render(small.data(), NULL, view, low, scene, NULL, NULL, NULL);
+
+  {
+    std::lock_guard<std::mutex> guard(frame_mutex);
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+      float *from = &small[(size_t)(y * low.height / height) * low.width * 4];
+      float *to = hdr + (size_t)y * width * 4;
+      for (int x = 0; x < width; x++)
+        copy_array(to + x * 4, from + (x * low.width / width) * 4, 4);
+    }
+    frame_generation = generation;
+    frames++;
+  }
+
+  double time = (omp_get_wtime() - start) * 1000;
+  previews++;
+  preview_time += time;
+  preview_scales += scale;
+  scale = interactive_scale(scale, time, budget);
+}
+
+/**
+ * The render thread: previews the latest camera but the first, then
+ * renders it at full resolution once no other comes. Cameras given while
+ * a preview runs are skipped but for the last.
+ **/
+void InteractiveRenderer::run() {
+  int previewed = 0, rendered = -1;
+  for (;;) {
+    Camera view;
+    int generation;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      if (rendered == requested)
+        idle = true;
+      wake.wait(guard, [&] { return stop || rendered != requested; });
+      if (stop)
+        return;
+      view = camera;
+      generation = requested;
+      cancel = false;
+    }
+
+    if (previewed != generation) {
+      // A full resolution preview without supersampling is the frame
+      bool whole = scale == 1 && settings.samples <= 1;
+      preview(view, generation);
+      previewed = generation;
+      if (whole)
+        rendered = generation;
+      continue;
+    }
+
+    Tile tile;
+    while (dirty->pop(tile))
+      ;
+    started = generation;
+    RenderStats stats =
+        render(hdr, NULL, view, settings, scene, dirty, &cancel, NULL);
+    if (stats.cancelled)
+      continue;
+
+    rendered = generation;
+    full_frames++;
+    print_render_stats(stats, std::cout);
+    // Until a preview is timed, the first frame tells what to expect
+    if (previews == 0)
+      scale = interactive_scale(1, stats.time * 1000, budget);
+  }
+}
+
+void InteractiveRenderer::report(std::ostream &out) const {
+  out << "Interactive: " << moves << " camera moves, " << previews
+      << " previews";
+  if (previews > 0)
+    out << " at 1/" << preview_scales / previews << " of the width, "
+        << preview_time / previews << " ms each (budget " << budget
+        << " ms)";
+  out << ", " << full_frames << " full frames" << std::endl;
+
+  if (latencies.empty())
+    return;
+  std::vector<double> sorted(latencies);
+  std::sort(sorted.begin(), sorted.end());
+  out << "Input to first pixel: " << sorted[sorted.size() / 2]
+      << " ms median, " << sorted[sorted.size() * 95 / 100]
+      << " ms 95th percentile, " << sorted.back() << " ms max ("
+      << sorted.size() << " updates)" << std::endl;
+}
+
+/**
+ * Smallest scale, up to INTERACTIVE_MAX_SCALE, at which a frame that took
+ * time milliseconds at the given scale should fit in budget, the time
+ * going with the number of pixels
+ **/
+int interactive_scale(int scale, double time, double budget) {
+  for (int k = 1; k < INTERACTIVE_MAX_SCALE; k++)
+    if (time * scale * scale <= budget * k * k)
+      return k;
+  return INTERACTIVE_MAX_SCALE;
+}
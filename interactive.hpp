@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "camera.hpp"
+#include "renderer.hpp"
+#include "scene.hpp"
+#include "tile_queue.hpp"
+
+#define INTERACTIVE_BUDGET 33.0 // milliseconds per preview, about 30 fps
+#define INTERACTIVE_MAX_SCALE 8 // previews are at least 1/8 of the width
+
+/**
+ * Renders for a viewer whose camera moves, on a thread of its own. A move
+ * cancels the full resolution frame in progress, if any, and the latest
+ * camera is previewed at 1/scale of the resolution without supersampling,
+ * scale being picked from the time of the previous preview so that the
+ * next fits in budget milliseconds.
+ * Previews are scaled up into hdr whole. Once the camera rests the frame is
+ * rendered again at full resolution with the settings given, its tiles
+ * going to dirty as render() does.
+ *
+ * Cameras are numbered in the order they are given, the first one being 0.
+ * The viewer learns which one what it uploads shows and tells when it
+ * presents it, which gives the latency from input to first pixel.
+ *
+ * Everything but the constructor and the destructor is meant for the
+ * viewer thread alone.
+ **/
+class InteractiveRenderer {
+public:
+  InteractiveRenderer(float *hdr, Camera camera, RenderSettings settings,
+                      Scene scene, DirtyTileQueue *dirty, double budget);
+  ~InteractiveRenderer();
+
+  // Restarts rendering from camera, input_time being when the viewer got
+  // the input that moved it, from omp_get_wtime
+  void move(const Camera &camera, double input_time);
+
+  // Whether frames or tiles may still come. Ask before taking them: once
+  // it is false, whatever is left is there to take.
+  bool busy() const;
+
+  // Held while reading hdr, so a preview is not scaled into it meanwhile
+  std::mutex &frame_lock() { return frame_mutex; }
+
+  // True when a whole frame replaced hdr since the last call, writing the
+  // camera it shows. Call with frame_lock held.
+  bool frame_changed(int *generation);
+
+  // Next finished tile of the full resolution render of the latest camera,
+  // tiles of earlier cameras being dropped
+  bool next_tile(Tile &tile, int *generation);
+
+  // What the camera given generation shows is on screen
+  void presented(int generation);
+
+  void report(std::ostream &out) const;
+
+private:
+  void run();
+  void preview(const Camera &view, int generation);
+
+  float *hdr;
+  std::vector<float> small; // preview before it is scaled up
+  RenderSettings settings;
+  Scene scene;
+  DirtyTileQueue *dirty;
+  double budget;
+
+  // Shared with the render thread under lock
+  std::mutex lock;
+  std::condition_variable wake;
+  Camera camera;
+  int requested; // latest camera
+  bool stop;
+  std::atomic<bool> idle;   // every camera rendered at full resolution
+  std::atomic<bool> cancel; // the camera moved, drop the frame
+  std::atomic<int> started; // camera whose full resolution tiles are out
+
+  std::mutex frame_mutex;
+  std::atomic<int> frames; // previews written to hdr
+  int frame_generation;
+
+  // Render thread only
+  int scale;
+  int previews, full_frames;
+  double preview_time, preview_scales;
+
+  // Viewer thread only
+  int latest;
+  int uploaded_frames;
+  bool refresh;        // a tile may have been dropped, upload everything
+  int waiting;         // camera whose first pixel is awaited, -1 for none
+  double waiting_time; // when its first input came
+  int moves;
+  std::vector<double> latencies;
+
+  std::thread thread;
+};
+
+int interactive_scale(int scale, double time, double budget);
@@ -0,0 +1,122 @@
+#include "lights.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+/**
+ * Range of cells along axis k touched by [a, b]
+ **/
+static void cell_range(const LightGrid *grid, int k, float a, float b,
+                       int *c0, int *c1) {
+  *c0 = clamp((int)((a - grid->lo[k]) * grid->inv_cell[k]), 0,
+              grid->dims[k] - 1);
+  *c1 = clamp((int)((b - grid->lo[k]) * grid->inv_cell[k]), 0,
+              grid->dims[k] - 1);
+}
+
+/**
+ * Calls visit(cell) for every cell the sphere of light l overlaps
+ **/
+template <class Visit>
+static void light_cells(const LightGrid *grid, const float *light,
+                        Visit visit) {
+  float r = light[3];
+  int c0[3], c1[3];
+  for (int k = 0; k < 3; k++)
+    cell_range(grid, k, light[k] - r, light[k] + r, &c0[k], &c1[k]);
+
+  for (int z = c0[2]; z <= c1[2]; z++) {
+    for (int y = c0[1]; y <= c1[1]; y++) {
+      for (int x = c0[0]; x <= c1[0]; x++) {
+        // Distance from the light to the cell box, corners left out
+        int c[3] = {x, y, z};
+        float d2 = 0;
+        for (int k = 0; k < 3; k++) {
+          float lo = grid->lo[k] + c[k] / grid->inv_cell[k];
+          float hi = grid->lo[k] + (c[k] + 1) / grid->inv_cell[k];
+          float d = std::max(std::max(lo - light[k], light[k] - hi), 0.0f);
+          d2 += d * d;
+        }
+        if (d2 < r * r)
+          visit((z * grid->dims[1] + y) * grid->dims[0] + x);
+      }
+    }
+  }
+}
+
+/**
+ * Builds the grid for l_size lights of LIGHT_FLOATS values. Cells are
+ * half the mean radius wide, so a light covers about four along each axis
+ * and a cell lists few lights that cannot reach any of its points. There
+ * are at most LIGHT_GRID_MAX cells per axis.
+ **/
+void build_light_grid(LightGrid *grid, const float *lights, int l_size) {
+  std::vector<int> global;
+  float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  double radius_sum = 0;
+  int bounded = 0;
+  for (int l = 0; l < l_size; l++) {
+    const float *light = lights + l * LIGHT_FLOATS;
+    if (light[3] <= 0) {
+      global.push_back(l);
+      continue;
+    }
+    for (int k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], light[k] - light[3]);
+      hi[k] = std::max(hi[k], light[k] + light[3]);
+    }
+    radius_sum += light[3];
+    bounded++;
+  }
+
+  grid->n_global = global.size();
+  grid->global = new int[global.size()];
+  copy_array(grid->global, global.data(), global.size());
+  grid->first = NULL;
+  grid->lights = NULL;
+  for (int k = 0; k < 3; k++) {
+    grid->lo[k] = 0;
+    grid->inv_cell[k] = 0;
+    grid->dims[k] = 0;
+  }
+  if (bounded == 0)
+    return;
+
+  float size = radius_sum / bounded / 2;
+  for (int k = 0; k < 3; k++) {
+    float extent = hi[k] - lo[k];
+    grid->dims[k] = clamp((int)std::ceil(extent / size), 1, LIGHT_GRID_MAX);
+    grid->lo[k] = lo[k];
+    grid->inv_cell[k] = grid->dims[k] / extent;
+  }
+
+  // Count, then fill each cell's run of the list
+  int n_cells = grid->dims[0] * grid->dims[1] * grid->dims[2];
+  grid->first = new int[n_cells + 1]();
+  for (int l = 0; l < l_size; l++)
+    if (lights[l * LIGHT_FLOATS + 3] > 0)
+      light_cells(grid, lights + l * LIGHT_FLOATS,
+                  [&](int cell) { grid->first[cell + 1]++; });
+  for (int c = 0; c < n_cells; c++)
+    grid->first[c + 1] += grid->first[c];
+
+  grid->lights = new int[grid->first[n_cells]];
+  std::vector<int> next(grid->first, grid->first + n_cells);
+  for (int l = 0; l < l_size; l++)
+    if (lights[l * LIGHT_FLOATS + 3] > 0)
+      light_cells(grid, lights + l * LIGHT_FLOATS,
+                  [&](int cell) { grid->lights[next[cell]++] = l; });
+}
+
+void free_light_grid(LightGrid *grid) {
+  delete[] grid->first;
+  delete[] grid->lights;
+  delete[] grid->global;
+  grid->first = grid->lights = grid->global = NULL;
+  grid->n_global = 0;
+  for (int k = 0; k < 3; k++)
+    grid->dims[k] = 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <omp.h>
+
+#include "maths.hpp"
+
+// Every light is x, y, z and the radius it reaches, 0 for everywhere
+#define LIGHT_FLOATS 4
+
+#define LIGHT_GRID_MAX 64 // cells per axis
+
+#pragma omp declare target
+/**
+ * Uniform grid over the spheres of influence of the lights with a radius.
+ * Cell c lists the lights reaching into it at lights[first[c]] up to
+ * lights[first[c + 1]], cells running x fastest. Lights without a radius
+ * reach every point and are listed in global instead.
+ **/
+struct LightGrid {
+  float lo[3];       // corner of the grid
+  float inv_cell[3]; // cells per unit along each axis
+  int dims[3];       // 0 when no light has a radius
+  int *first;
+  int *lights;
+  int *global;
+  int n_global;
+};
+
+/**
+ * Cell holding P, -1 outside the grid where no bounded light reaches
+ **/
+static inline int light_cell(const LightGrid *grid, const float *P) {
+  int c[3];
+  for (int k = 0; k < 3; k++) {
+    float f = (P[k] - grid->lo[k]) * grid->inv_cell[k];
+    if (!(f >= 0 && f < grid->dims[k]))
+      return -1;
+    c[k] = (int)f;
+  }
+  return (c[2] * grid->dims[1] + c[1]) * grid->dims[0] + c[0];
+}
+
+/**
+ * Light k of those that may reach a point of the cell whose list starts
+ * at first: the global ones, then the cell's own
+ **/
+static inline int light_candidate(const LightGrid *grid, int first, int k) {
+  return k < grid->n_global ? grid->global[k]
+                            : grid->lights[first + k - grid->n_global];
+}
+
+/**
+ * How much of a light at distance dist with the given radius is left:
+ * 1 without a radius, else falling smoothly from 1 to 0 at the radius.
+ **/
+static inline float light_falloff(float dist, float radius) {
+  if (radius <= 0)
+    return 1;
+  float x = dist / radius;
+  if (x >= 1)
+    return 0;
+  float w = 1 - x * x;
+  return w * w;
+}
+#pragma omp end declare target
+
+void build_light_grid(LightGrid *grid, const float *lights, int l_size);
+void free_light_grid(LightGrid *grid);
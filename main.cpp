@@ -1,8 +1,8 @@
 #include <algorithm>
+#include <atomic>
 #include <cfloat>
-#include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
 #include <stdio.h>
 #include <string>
 #include <thread>
@@ -16,46 +16,48 @@
 
 using namespace std;
 
+#include "animation.hpp"
+#include "cluster.hpp"
+#include "image.hpp"
+#include "interactive.hpp"
 #include "maths.hpp"
 #include "renderer.hpp"
+#include "input.hpp"
+#include "scene_file.hpp"
+#include "scene_gen.hpp"
+#include "scene_text.hpp"
 
-class InputParser {
-public:
-  InputParser(int &argc, char **argv) {
-    for (int i = 1; i < argc; ++i)
-      this->tokens.push_back(std::string(argv[i]));
-  }
-  /// @author iain
-  const std::string &getCmdOption(const std::string &option) const {
-    std::vector<std::string>::const_iterator itr;
-    itr = std::find(this->tokens.begin(), this->tokens.end(), option);
-    if (itr != this->tokens.end() && ++itr != this->tokens.end()) {
-      return *itr;
-    }
-    static const std::string empty_string("");
-    return empty_string;
-  }
-  /// @author iain
-  bool cmdOptionExists(const std::string &option) const {
-    return std::find(this->tokens.begin(), this->tokens.end(), option) !=
-           this->tokens.end();
-  }
-
-private:
-  std::vector<std::string> tokens;
-};
 
-void ReadSceneFile(std::string path, float **tris, unsigned char **t_colors,
-                   float **spheres, float **radius, unsigned char **s_colors,
-                   float **lights, int &t_size, int &s_size, int &l_size);
-int init_triangles(float **tris, unsigned char **colors);
-int init_spheres(float **spheres, float **radius, unsigned char **colors,
-                 int row, int col);
-int init_lights(float **lights);
+bool parse_vec3(const std::string &str, float v[]);
+std::string frame_path(const std::string &path, int frame);
+void render_animation(const Animation &animation, float *hdr,
+                      unsigned char *frameBuffer, Camera camera,
+                      RenderSettings settings, Scene *scene,
+                      DirtyTileQueue *dirty, const std::string *output,
+                      const std::atomic<bool> &closed);
 
 #ifdef USE_SDL
-void init_SDL(SDL_Window *&window, SDL_Renderer *&renderer);
+// Longest wait for input while frames are still coming, about 60 fps
+#define VIEWER_FRAME_MS 16
+#define VIEWER_TURN_RATE 60.0f  // degrees per second the arrow keys turn
+#define VIEWER_MOUSE_TURN 0.2f  // degrees per pixel dragged
+#define VIEWER_WHEEL_STEP 0.1f  // of the distance to the point looked at
+
+void init_SDL(SDL_Window *&window, SDL_Renderer *&renderer, int width,
+              int height);
 void put_pixel(SDL_Surface *screenSurface, int x, int y, vec3 color);
+void upload_frame(SDL_Texture *texture, float *hdr,
+                  const RenderSettings &settings);
+void upload_tile(SDL_Texture *texture, float *hdr,
+                 const RenderSettings &settings, Tile tile);
+void present(SDL_Renderer *renderer, SDL_Texture *texture);
+void show_render(SDL_Renderer *renderer, SDL_Texture *texture, float *hdr,
+                 const RenderSettings &settings, DirtyTileQueue *dirty,
+                 const std::atomic<bool> &finished);
+void show_interactive(SDL_Renderer *renderer, SDL_Texture *texture,
+                      float *hdr, Camera camera,
+                      const RenderSettings &settings, const Scene &scene,
+                      DirtyTileQueue *dirty, double budget);
 #endif // USE_SDL
 
 int main(int argc, char **argv) {
@@ -67,8 +69,92 @@ int main(int argc, char **argv) {
             "scene.txt)\n"
          << "-row          : Row number of the sphere matrix (default: 10)\n"
          << "-col          : Column number of the sphere matrix (default: 10)\n"
-         << "-n            : No display\n"
-         << "-h            : Print this message\n";
+         << "-n            : No display, write the image instead\n"
+         << "-o <file>     : Image to write, .ppm, .png or .pfm (default: "
+            "image.ppm with -n)\n"
+         << "-accel <type> : Ray acceleration structure, bvh, grid (uniform, "
+            "for evenly spread\n                primitives) or none "
+            "(default: bvh)\n"
+         << "-simd <isa>   : Intersection kernels, auto, avx512, avx2 or "
+            "scalar (default: auto)\n"
+         << "-packet <n>   : Trace primary rays in n x n packets, up to 8, "
+            "0 for single rays (default: 0)\n"
+         << "-tile <px>    : Tile size handed to a worker (default: 32)\n"
+         << "-order <name> : Tile order, morton, spiral or scanline "
+            "(default: morton)\n"
+         << "-threads      : Report per worker busy and idle time\n"
+         << "-numa <nodes> : Pin threads to the NUMA nodes, each reading a "
+            "copy of the scene of\n                its own and writing its "
+            "own band of the image; auto for the\n                nodes of "
+            "the machine, a number to split the CPUs into that many\n"
+         << "-progressive <n> : Start with a pass every n pixels and refine "
+            "down to 1, 0 to render in one pass (default: 0)\n"
+         << "-spp <n>      : Samples per pixel, on a stratified grid rounded "
+            "down to a square up\n                to 64 (default: 1)\n"
+         << "-adaptive <c> : Only supersample pixels whose neighbourhood "
+            "differs by more than c\n                (0 to 255) in a channel, "
+            "0 for all of them (default: 0)\n"
+         << "-tonemap <op> : Maps the float image to 8 bits, clamp or "
+            "reinhard (default: clamp)\n"
+         << "-exposure <ev> : Stops of exposure applied before tonemapping "
+            "(default: 0)\n"
+         << "-light-samples <n> : Shade at most n lights per hit point, "
+            "picked at random\n                by how much they could give, "
+            "0 for all of them (default: 0)\n"
+         << "-depth <n>    : Mirror and glass bounces traced, up to 16 "
+            "(default: 5)\n"
+         << "-roulette <n> : Bounce from which faint rays are dropped at "
+            "random, 0 for never\n                (default: 3)\n"
+         << "-width <px>   : Image width (default: 2560)\n"
+         << "-height <px>  : Image height (default: 1440)\n"
+         << "-fov <deg>    : Vertical field of view (default: 53.13)\n"
+         << "-eye x,y,z    : Camera position (default: 0,0,1)\n"
+         << "-lookat x,y,z : Point the camera looks at (default: 0,0,0)\n"
+         << "-convert <out> : Write the scene as the renderer sees it to a "
+            "binary file, loaded with -f instead of the text one\n"
+         << "-stats <file> : Write ray and primitive test counts as JSON, "
+            "needs a USE_STATS build\n"
+         << "-heatmap <file> : Write the per pixel cost as an image, needs a "
+            "USE_STATS build\n"
+         << "-animate <file> : Render every frame of a keyframe file, written "
+            "as <output>_0000.ppm and on\n"
+         << "-cluster <port> : Coordinate workers connecting on port instead "
+            "of rendering here\n"
+         << "-wait <n>     : Workers to wait for before handing out tiles "
+            "(default: 1)\n"
+         << "-timeout <s>  : Seconds a worker may hold tiles without answering "
+            "before it is dropped\n                (default: 30)\n"
+         << "-worker <host:port> : Render tiles for a coordinator, which sends "
+            "the scene\n"
+         << "-interactive  : Move the camera in the window, previewing at a "
+            "lower resolution\n                while it moves, needs an SDL "
+            "build\n"
+         << "-budget <ms>  : Time a preview may take in interactive mode "
+            "(default: 33)\n"
+         << "-h            : Print this message\n"
+         << "\nThe scene file may also set the camera and the resolution:\n"
+         << "  c eye look_at fov\n"
+         << "  r width height\n"
+         << "Command line options take precedence over the scene file.\n"
+         << "\nTriangle meshes (.obj or binary .ply) are placed by instances, "
+            "numbered from 0\nin the order of the m lines:\n"
+         << "  m path\n"
+         << "  i mesh translate rotate_degrees scale color [material]\n"
+         << "\nMaterials are numbered from 1 in the order of the M lines, 0 "
+            "being plain; a\nsphere, triangle or instance takes one as an "
+            "optional last value:\n"
+         << "  M reflectivity transparency index_of_refraction\n"
+         << "\nKeyframe files animate the camera, lights and instances, "
+            "numbered from 0 in\nscene file order; values are interpolated "
+            "between the keys of each one:\n"
+         << "  a frames fps\n"
+         << "  c time eye look_at fov\n"
+         << "  l time light point\n"
+         << "  i time instance translate rotate_degrees scale\n"
+         << "\nIn interactive mode W, A, S and D move, Q and E go down and up, "
+            "the arrow keys\nor dragging with the left button turn, the wheel "
+            "moves forward and back, R\ngoes back to the first camera and "
+            "Escape quits.\n";
     exit(0);
   }
 
@@ -85,25 +171,240 @@ int main(int argc, char **argv) {
   if (input.cmdOptionExists("-row"))
     row = stoi(input.getCmdOption("-row"));
 
-  int fov = 90;
-  unsigned char *frameBuffer;
+  const std::string &output =
+      input.cmdOptionExists("-o") ? input.getCmdOption("-o") : "image.ppm";
+  if (!image_format_supported(output)) {
+    std::cerr << "Unknown image format '" << output
+              << "', expected .ppm, .png or .pfm" << std::endl;
+    exit(1);
+  }
 
-  frameBuffer = new unsigned char[4 * CANVAS_HEIGHT * CANVAS_WIDTH];
+  const int accel = input.cmdOptionExists("-accel")
+                        ? accel_type(input.getCmdOption("-accel"))
+                        : ACCEL_BVH;
+  const std::string &simd =
+      input.cmdOptionExists("-simd") ? input.getCmdOption("-simd") : "auto";
 
-  float *tris, *spheres, *radius, *lights;
+  // Workers get everything from the coordinator
+  if (input.cmdOptionExists("-worker")) {
+    std::cout << "SIMD: " << simd_name(simd_init(simd)) << std::endl;
+    return run_worker(input.getCmdOption("-worker"));
+  }
+
+  Camera camera = default_camera();
+  RenderSettings settings = default_settings();
+
+  float *tris, *spheres, *radius, *lights, *materials;
   unsigned char *color_tri, *color_sphere;
 
-  int t_size, s_size, l_size;
+  int t_size, s_size, l_size, n_materials;
+  SceneMeshes meshes;
+
+  Scene scene;
+  scene.nodes = NULL;
+  scene.n_nodes = 0;
+
+  // Binary scenes are mapped ready to render, with their BVH
+  SceneMapping mapping = {NULL, 0, NULL};
+  const bool binary = is_scene_binary(filename);
 
-  ReadSceneFile(filename, &tris, &color_tri, &spheres, &radius, &color_sphere,
-                &lights, t_size, s_size, l_size);
+  double load_start = omp_get_wtime();
+  if (binary) {
+    if (!map_scene_binary(filename, &mapping, &scene, &camera, &settings))
+      exit(1);
+  } else {
+    if (!ReadSceneFile(filename, &tris, &color_tri, &spheres, &radius,
+                       &color_sphere, &lights, &materials, t_size, s_size,
+                       l_size, n_materials, meshes, camera, settings))
+      exit(1);
+  }
+  std::cout << "Scene Load Time: " << omp_get_wtime() - load_start << " s ("
+            << (binary ? "binary" : "text") << ")" << std::endl;
+
+  if (input.cmdOptionExists("-packet"))
+    settings.packet = stoi(input.getCmdOption("-packet"));
+  if (input.cmdOptionExists("-tile"))
+    settings.tile_size = stoi(input.getCmdOption("-tile"));
+  if (input.cmdOptionExists("-order"))
+    settings.tile_order = tile_order(input.getCmdOption("-order"));
+  settings.thread_report = input.cmdOptionExists("-threads");
+  if (input.cmdOptionExists("-progressive"))
+    settings.progressive = stoi(input.getCmdOption("-progressive"));
+  if (input.cmdOptionExists("-spp"))
+    settings.samples = stoi(input.getCmdOption("-spp"));
+  if (input.cmdOptionExists("-adaptive"))
+    settings.aa_threshold = stoi(input.getCmdOption("-adaptive"));
+  if (input.cmdOptionExists("-tonemap"))
+    settings.tonemap = tonemap_operator(input.getCmdOption("-tonemap"));
+  if (input.cmdOptionExists("-exposure"))
+    settings.exposure = powf(2, stof(input.getCmdOption("-exposure")));
+  if (input.cmdOptionExists("-light-samples"))
+    settings.light_samples = stoi(input.getCmdOption("-light-samples"));
+  if (input.cmdOptionExists("-depth"))
+    settings.max_depth = stoi(input.getCmdOption("-depth"));
+  if (input.cmdOptionExists("-roulette"))
+    settings.roulette = stoi(input.getCmdOption("-roulette"));
+  if (input.cmdOptionExists("-width"))
+    settings.width = stoi(input.getCmdOption("-width"));
+  if (input.cmdOptionExists("-height"))
+    settings.height = stoi(input.getCmdOption("-height"));
+  if (input.cmdOptionExists("-fov"))
+    camera.fov = stof(input.getCmdOption("-fov"));
+  if (input.cmdOptionExists("-eye") &&
+      !parse_vec3(input.getCmdOption("-eye"), camera.position))
+    std::cerr << "Ignoring malformed -eye, expected x,y,z" << std::endl;
+  if (input.cmdOptionExists("-lookat") &&
+      !parse_vec3(input.getCmdOption("-lookat"), camera.look_at))
+    std::cerr << "Ignoring malformed -lookat, expected x,y,z" << std::endl;
+
+  if (settings.width <= 0 || settings.height <= 0) {
+    std::cerr << "Invalid resolution " << settings.width << "x"
+              << settings.height << std::endl;
+    exit(1);
+  }
 
-  s_size = init_spheres(&spheres, &radius, &color_sphere, row, col);
+  const int width = settings.width, height = settings.height;
+
+  std::unique_ptr<unsigned char[]> frame_owner(
+      new unsigned char[(size_t)4 * height * width]);
+  std::unique_ptr<float[]> hdr_owner(new float[4LL * height * width]);
+  unsigned char *frameBuffer = frame_owner.get();
+  float *hdr = hdr_owner.get();
+
+  double build_start = omp_get_wtime();
+  if (binary) {
+    if (accel != ACCEL_BVH) {
+      scene.nodes = NULL;
+      scene.n_nodes = 0;
+    } else if (scene.nodes == NULL) {
+      std::cerr << "Scene file has no BVH, rendering without one"
+                << std::endl;
+    }
+    // Grids are not stored, they are quick to build over the mapped streams
+    if (accel == ACCEL_GRID)
+      build_grid(&scene.grid, &scene.tris, &scene.spheres, &scene.instances);
+  } else {
+    // The generated lattice replaces the spheres of the file
+    delete[] spheres;
+    delete[] radius;
+    delete[] color_sphere;
+    s_size = init_spheres(&spheres, &radius, &color_sphere, row, col);
+
+    // The renderer only sees the SoA copies from here on
+    prepare_scene(&scene, tris, color_tri, t_size, spheres, radius,
+                  color_sphere, s_size, lights, l_size, materials,
+                  n_materials, &meshes, accel);
+    if (scene.nodes != NULL)
+      std::cout << "BVH Build Time: " << omp_get_wtime() - build_start
+                << " s (" << scene.n_nodes << " nodes)" << std::endl;
+  }
+  if (scene.grid.first != NULL)
+    std::cout << "Grid Build Time: " << omp_get_wtime() - build_start
+              << " s (" << scene.grid.dims[0] << "x" << scene.grid.dims[1]
+              << "x" << scene.grid.dims[2] << " cells, "
+              << scene.grid.first[grid_cells(scene.grid)] << " references)"
+              << std::endl;
+  SceneRelease release(&scene, &mapping);
+  if (scene.arena.base != NULL)
+    std::cout << "Scene Arena: " << scene.arena.size * 1e-6 << " MB ("
+              << arena_backing_name(scene.arena.backing) << ")" << std::endl;
+
+  if (scene.instances.count > 0) {
+    long long unique = 0;
+    for (int i = 0; i < scene.instances.n_meshes; i++)
+      unique += scene.instances.meshes[i].tris.count;
+    std::cout << "Instances: " << scene.instances.count << " of "
+              << scene.instances.n_meshes << " meshes, "
+              << instanced_triangles(scene.instances) << " triangles ("
+              << unique << " stored)" << std::endl;
+  }
+
+  if (input.cmdOptionExists("-convert")) {
+    const std::string &out = input.getCmdOption("-convert");
+    double start = omp_get_wtime();
+    bool written = write_scene_binary(out, scene, camera, settings);
+    if (written)
+      std::cout << "Scene Write Time: " << omp_get_wtime() - start << " s ("
+                << out << ")" << std::endl;
+
+    return written ? 0 : 1;
+  }
+
+  // The scene, frame buffer and render thread are kept for every frame
+  Animation animation;
+  const bool animated = input.cmdOptionExists("-animate");
+  if (animated &&
+      !read_animation(input.getCmdOption("-animate"), scene, &animation))
+    return 1;
+
+  std::cout << "SIMD: " << simd_name(simd_init(simd)) << std::endl;
+
+  // Finished tiles are only worth publishing when someone displays them
+  DirtyTileQueue *dirty = NULL;
+#ifdef USE_SDL
+  if (!no_display)
+    dirty = new DirtyTileQueue();
+#endif // USE_SDL
+
+  const bool write = no_display || input.cmdOptionExists("-o");
+
+  // A viewer tonemaps tiles straight into its texture, the frame buffer is
+  // then only filled to be written
+  unsigned char *tonemapped = dirty != NULL ? NULL : frameBuffer;
+  std::atomic<bool> closed(false);
+
+  const bool cluster = input.cmdOptionExists("-cluster") && !animated;
+  int wait = 1;
+  double timeout = CLUSTER_TIMEOUT;
+  if (input.cmdOptionExists("-wait"))
+    wait = stoi(input.getCmdOption("-wait"));
+  if (input.cmdOptionExists("-timeout"))
+    timeout = stof(input.getCmdOption("-timeout"));
+  bool rendered = true;
+
+  // The interactive viewer renders the still image itself, again on every
+  // move of the camera
+  bool interactive = input.cmdOptionExists("-interactive");
+  if (interactive && (dirty == NULL || animated || cluster)) {
+    std::cerr << "Ignoring -interactive, it needs a window and a still image"
+              << std::endl;
+    interactive = false;
+  }
+  // Still images rendered here may have a replica of the scene per node
+  NumaScenes numa;
+  numa.topology.n_nodes = 0;
+  if (input.cmdOptionExists("-numa") && (animated || cluster || interactive))
+    std::cerr << "Ignoring -numa, it is for still images rendered here"
+              << std::endl;
+  else if (input.cmdOptionExists("-numa")) {
+    numa_topology(input.getCmdOption("-numa"), &numa.topology);
+    numa_replicate(&numa, scene);
+    print_numa_topology(numa, std::cout);
+  }
 
   // Create thread and start rendering
-  std::thread render_thread(render, frameBuffer, fov, tris, color_tri, t_size,
-                            spheres, radius, color_sphere, s_size, lights,
-                            l_size);
+  std::atomic<bool> finished(false);
+  std::thread render_thread;
+  if (!interactive)
+    render_thread = std::thread([&]() {
+      if (animated) {
+        render_animation(animation, hdr, frameBuffer, camera, settings,
+                         &scene, dirty, write ? &output : NULL, closed);
+      } else if (cluster) {
+        ClusterStats stats;
+        rendered = render_cluster(hdr, tonemapped, camera, settings, scene,
+                                  stoi(input.getCmdOption("-cluster")), wait,
+                                  timeout, dirty, &stats);
+        if (rendered)
+          print_cluster_stats(stats, std::cout);
+      } else {
+        RenderStats stats =
+            render(hdr, tonemapped, camera, settings, scene, dirty, NULL,
+                   numa.topology.n_nodes > 0 ? &numa : NULL);
+        print_render_stats(stats, std::cout);
+      }
+      finished = true;
+    });
 
 #ifdef USE_SDL
   if (!no_display) {
@@ -114,75 +415,52 @@ int main(int argc, char **argv) {
     SDL_Renderer *renderer = NULL;
     SDL_Texture *texture = NULL;
 
-    init_SDL(window, renderer);
+    init_SDL(window, renderer, width, height);
 
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-                                SDL_TEXTUREACCESS_STREAMING, CANVAS_WIDTH,
-                                CANVAS_HEIGHT);
+                                SDL_TEXTUREACCESS_STREAMING, width, height);
 
     /**
      * Keep the screen up until the user closes it
      **/
-    bool quit = false;
-    while (!quit) {
-      SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-      SDL_RenderClear(renderer);
-
-      SDL_Event event;
-      while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-        case SDL_QUIT:
-          quit = true;
-          break;
-        }
-      }
-
-      /* Draw the image to the texture */
-      SDL_UpdateTexture(texture, NULL, &frameBuffer[0], CANVAS_WIDTH * 4);
-      SDL_RenderCopy(renderer, texture, NULL, NULL);
-      SDL_RenderPresent(renderer);
-    }
-
+    double budget = INTERACTIVE_BUDGET;
+    if (input.cmdOptionExists("-budget"))
+      budget = stof(input.getCmdOption("-budget"));
+    if (interactive)
+      show_interactive(renderer, texture, hdr, camera, settings, scene, dirty,
+                       budget);
+    else
+      show_render(renderer, texture, hdr, settings, dirty, finished);
+
+    SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
+    closed = true;
   }
 #endif // USE_SDL
 
   // Join thread to wait for it to end before exiting
-  render_thread.join();
-
-  if (no_display) {
-    std::ofstream image;
-    image.open("image.ppm");
-
-    image << "P3\n"
-          << CANVAS_WIDTH << " " << CANVAS_HEIGHT << " " << 255 << std::endl;
-
-    for (int i = 0; i < CANVAS_HEIGHT; i++) {
-      for (int j = 0; j < CANVAS_WIDTH; j++) {
-        int fb_offset = CANVAS_WIDTH * i * 4 + j * 4;
-        int z = (int)abs(frameBuffer[fb_offset + 0]),
-            y = (int)abs(frameBuffer[fb_offset + 1]),
-            x = (int)abs(frameBuffer[fb_offset + 2]);
-
-        image << x << " " << y << " " << z << " ";
-      }
-      image << std::endl;
-    }
+  if (render_thread.joinable())
+    render_thread.join();
+  delete dirty;
+  numa_free(&numa);
+
+  if (input.cmdOptionExists("-stats"))
+    stats_write_json(input.getCmdOption("-stats"));
+  if (input.cmdOptionExists("-heatmap"))
+    stats_write_heatmap(input.getCmdOption("-heatmap"));
+
+  if (write && !animated && rendered) {
+    double start = omp_get_wtime();
+    if (tonemapped == NULL)
+      tonemap_frame(hdr, width, height, frameBuffer, width * 4,
+                    settings.tonemap, settings.exposure);
+    if (write_image(output, frameBuffer, hdr, width, height))
+      std::cout << "Output Time: " << omp_get_wtime() - start << " s ("
+                << output << ")" << std::endl;
   }
 
-  delete[] tris;
-  delete[] color_tri;
-
-  delete[] spheres;
-  delete[] color_sphere;
-  delete[] radius;
-
-  delete[] lights;
-
-  delete[] frameBuffer;
-
   return 0;
 }
 
@@ -193,219 +471,287 @@ void put_pixel(SDL_Surface *screenSurface, int x, int y, vec3 color) {
   *pixel = SDL_MapRGB(screenSurface->format, 255, 255, 255);
 }
 
-void init_SDL(SDL_Window *&window, SDL_Renderer *&renderer) {
+void init_SDL(SDL_Window *&window, SDL_Renderer *&renderer, int width,
+              int height) {
 
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     std::cout << "SDL Could not initialize! SDL Error: " << SDL_GetError()
               << std::endl;
   } else {
     window = SDL_CreateWindow("RayTracer", SDL_WINDOWPOS_UNDEFINED,
-                              SDL_WINDOWPOS_UNDEFINED, CANVAS_WIDTH,
-                              CANVAS_HEIGHT, SDL_WINDOW_SHOWN);
+                              SDL_WINDOWPOS_UNDEFINED, width, height,
+                              SDL_WINDOW_SHOWN);
     if (window == NULL) {
       std::cout << "Window could not be created! SDL Error: " << SDL_GetError()
                 << std::endl;
     } else {
-      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+      // Presenting waits for the display rather than spinning
+      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED |
+                                                    SDL_RENDERER_PRESENTVSYNC);
     }
   }
 }
-#endif // USE_SDL
-
-void ReadSceneFile(std::string path, float **tris, unsigned char **t_colors,
-                   float **spheres, float **radius, unsigned char **s_colors,
-                   float **lights, int &t_size, int &s_size, int &l_size) {
-  std::ifstream file;
-  file.open(path);
 
-  if (!file.is_open()) {
-    std::cerr << "Could not open file '" << path << "'" << std::endl;
+/**
+ * Tonemaps all of hdr into the texture
+ **/
+void upload_frame(SDL_Texture *texture, float *hdr,
+                  const RenderSettings &settings) {
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0) {
+    tonemap_frame(hdr, settings.width, settings.height,
+                  (unsigned char *)pixels, pitch, settings.tonemap,
+                  settings.exposure);
+    SDL_UnlockTexture(texture);
   }
+}
 
-  std::vector<float> vtriangles;
-  std::vector<float> vspheres;
-  std::vector<float> vlights;
-  while (!file.eof()) {
-    std::string line;
-    std::getline(file, line);
-
-    if (line.front() == '/')
-      continue;
-
-    std::istringstream stream(line);
-    char type;
-    stream >> type;
+void upload_tile(SDL_Texture *texture, float *hdr,
+                 const RenderSettings &settings, Tile tile) {
+  SDL_Rect rect = {tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0};
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0) {
+    tonemap(hdr, settings.width, tile, (unsigned char *)pixels, pitch,
+            settings.tonemap, settings.exposure);
+    SDL_UnlockTexture(texture);
+  }
+}
 
-    float val;
-    unsigned char col;
+void present(SDL_Renderer *renderer, SDL_Texture *texture) {
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+  SDL_RenderClear(renderer);
+  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderPresent(renderer);
+}
 
-    switch (type) {
-    case 's':
-      for (int i = 0; i < 7; i++) {
-        stream >> val;
-        vspheres.push_back(val);
+/**
+ * Shows the frames rendered by another thread as their tiles finish, until
+ * the window is closed. Waits on input a frame at a time while tiles may
+ * still come, and for input alone once finished is set.
+ **/
+void show_render(SDL_Renderer *renderer, SDL_Texture *texture, float *hdr,
+                 const RenderSettings &settings, DirtyTileQueue *dirty,
+                 const std::atomic<bool> &finished) {
+  bool full_upload = true, redraw = false;
+  for (;;) {
+    // Read before taking the tiles: once it is set, they are all queued
+    bool done = finished;
+
+    /* Upload the tiles finished since the last frame, or everything if
+     * the workers outran us and some were dropped */
+    Tile tile;
+    if (dirty->overflowed() || full_upload) {
+      while (dirty->pop(tile))
+        ;
+      upload_frame(texture, hdr, settings);
+      full_upload = false;
+      redraw = true;
+    } else {
+      while (dirty->pop(tile)) {
+        upload_tile(texture, hdr, settings, tile);
+        redraw = true;
       }
-      break;
+    }
+    if (redraw)
+      present(renderer, texture);
+    redraw = false;
+
+    SDL_Event event;
+    int got = done ? SDL_WaitEvent(&event)
+                   : SDL_WaitEventTimeout(&event, VIEWER_FRAME_MS);
+    for (; got; got = SDL_PollEvent(&event)) {
+      if (event.type == SDL_QUIT)
+        return;
+      if (event.type == SDL_WINDOWEVENT)
+        redraw = true;
+    }
+  }
+}
 
-    case 't':
-      for (int i = 0; i < 12; i++) {
-        stream >> val;
-        vtriangles.push_back(val);
+/**
+ * Lets the user move the camera, an InteractiveRenderer previewing every
+ * move and refining once the camera rests. Keys held down move it every
+ * frame; otherwise the loop sleeps until input or a frame comes. Prints
+ * the latency from input to first pixel when the window is closed.
+ **/
+void show_interactive(SDL_Renderer *renderer, SDL_Texture *texture,
+                      float *hdr, Camera camera,
+                      const RenderSettings &settings, const Scene &scene,
+                      DirtyTileQueue *dirty, double budget) {
+  const Camera home = camera;
+  // Scene units per second: the distance to the point looked at
+  float speed = length(load3(camera.look_at) - load3(camera.position));
+  if (speed <= 0)
+    speed = 1;
+
+  InteractiveRenderer live(hdr, camera, settings, scene, dirty, budget);
+  bool redraw = false, quit = false;
+  double last = omp_get_wtime();
+  while (!quit) {
+    // Read before taking frames and tiles: once false, they are all there
+    bool busy = live.busy();
+    int shown = -1, generation;
+    {
+      std::lock_guard<std::mutex> guard(live.frame_lock());
+      if (live.frame_changed(&generation)) {
+        upload_frame(texture, hdr, settings);
+        shown = generation;
       }
-      break;
-
-    case 'l':
-      for (int i = 0; i < 3; i++) {
-        stream >> val;
-        vlights.push_back(val);
+      Tile tile;
+      while (live.next_tile(tile, &generation)) {
+        upload_tile(texture, hdr, settings, tile);
+        shown = std::max(shown, generation);
+      }
+    }
+    if (shown >= 0 || redraw)
+      present(renderer, texture);
+    if (shown >= 0)
+      live.presented(shown);
+    redraw = false;
+
+    const Uint8 *keys = SDL_GetKeyboardState(NULL);
+    float forward = keys[SDL_SCANCODE_W] - keys[SDL_SCANCODE_S];
+    float right = keys[SDL_SCANCODE_D] - keys[SDL_SCANCODE_A];
+    float up = keys[SDL_SCANCODE_E] - keys[SDL_SCANCODE_Q];
+    float yaw = keys[SDL_SCANCODE_RIGHT] - keys[SDL_SCANCODE_LEFT];
+    float pitch = keys[SDL_SCANCODE_UP] - keys[SDL_SCANCODE_DOWN];
+    bool held = forward != 0 || right != 0 || up != 0 || yaw != 0 ||
+                pitch != 0;
+
+    SDL_Event event;
+    int got = busy || held ? SDL_WaitEventTimeout(&event, VIEWER_FRAME_MS)
+                           : SDL_WaitEvent(&event);
+    // Motion from keys held since the last frame, two frames' worth at most
+    double now = omp_get_wtime();
+    float dt = held ? std::min(now - last, VIEWER_FRAME_MS * 2e-3) : 0;
+    last = now;
+
+    bool moved = false;
+    for (; got; got = SDL_PollEvent(&event)) {
+      switch (event.type) {
+      case SDL_QUIT:
+        quit = true;
+        break;
+      case SDL_KEYDOWN:
+        if (event.key.keysym.sym == SDLK_ESCAPE)
+          quit = true;
+        if (event.key.keysym.sym == SDLK_r) {
+          camera = home;
+          moved = true;
+        }
+        break;
+      case SDL_MOUSEMOTION:
+        if (event.motion.state & SDL_BUTTON_LMASK) {
+          turn_camera(&camera, event.motion.xrel * VIEWER_MOUSE_TURN,
+                      -event.motion.yrel * VIEWER_MOUSE_TURN);
+          moved = true;
+        }
+        break;
+      case SDL_MOUSEWHEEL:
+        move_camera(&camera, event.wheel.y * VIEWER_WHEEL_STEP * speed, 0, 0);
+        moved = true;
+        break;
+      case SDL_WINDOWEVENT:
+        redraw = true;
+        break;
       }
-      break;
     }
-  }
-
-  t_size = vtriangles.size() / 12;
-  s_size = vspheres.size() / 7;
-  l_size = vlights.size() / 3;
-
-  (*tris) = new float[t_size * 9];
-  (*t_colors) = new unsigned char[t_size * 3];
-  (*spheres) = new float[s_size * 3];
-  (*radius) = new float[s_size * 1];
-  (*s_colors) = new unsigned char[s_size * 3];
-  (*lights) = new float[l_size * 3];
-
-  for (int i = 0; i < t_size; i++) {
-    (*tris)[i * 9 + 0] = vtriangles[i * 12 + 0];
-    (*tris)[i * 9 + 1] = vtriangles[i * 12 + 1];
-    (*tris)[i * 9 + 2] = vtriangles[i * 12 + 2];
-    (*tris)[i * 9 + 3] = vtriangles[i * 12 + 3];
-    (*tris)[i * 9 + 4] = vtriangles[i * 12 + 4];
-    (*tris)[i * 9 + 5] = vtriangles[i * 12 + 5];
-    (*tris)[i * 9 + 6] = vtriangles[i * 12 + 6];
-    (*tris)[i * 9 + 7] = vtriangles[i * 12 + 7];
-    (*tris)[i * 9 + 8] = vtriangles[i * 12 + 8];
-    (*t_colors)[i * 3 + 0] = (unsigned char)vtriangles[i * 12 + 9];
-    (*t_colors)[i * 3 + 1] = (unsigned char)vtriangles[i * 12 + 10];
-    (*t_colors)[i * 3 + 2] = (unsigned char)vtriangles[i * 12 + 11];
-  }
-
-  for (int i = 0; i < s_size; i++) {
-    (*radius)[i * 1 + 0] = vspheres[i * 7 + 0];
-    (*spheres)[i * 3 + 0] = vspheres[i * 7 + 1];
-    (*spheres)[i * 3 + 1] = vspheres[i * 7 + 2];
-    (*spheres)[i * 3 + 2] = vspheres[i * 7 + 3];
-    (*s_colors)[i * 3 + 0] = (unsigned char)vspheres[i * 7 + 4];
-    (*s_colors)[i * 3 + 1] = (unsigned char)vspheres[i * 7 + 5];
-    (*s_colors)[i * 3 + 2] = (unsigned char)vspheres[i * 7 + 6];
-  }
-
-  for (int i = 0; i < l_size; i++) {
-    (*lights)[i * 3 + 0] = vlights[i * 3 + 0];
-    (*lights)[i * 3 + 1] = vlights[i * 3 + 1];
-    (*lights)[i * 3 + 2] = vlights[i * 3 + 2];
-  }
-}
 
-int init_triangles(float **tris, unsigned char **colors) {
-  int t_size = 2;
-
-  (*tris) = new float[t_size * 9];
-  (*colors) = new unsigned char[t_size];
-
-  float v[2][9] = {{
-                       10.0,
-                       -5.0,
-                       -2.0,
-                       10.0,
-                       -5.0,
-                       -10.0,
-                       -10.0,
-                       -5.0,
-                       -2.0,
-                   },
-                   {
-                       -10.0,
-                       -5.0,
-                       -2.0,
-                       10.0,
-                       -5.0,
-                       -10.0,
-                       -10.0,
-                       -5.0,
-                       -10.0,
-                   }};
-
-  unsigned char c[2][3] = {{255, 125, 125}, {255, 125, 125}};
-
-  for (int i = 0; i < t_size; i++) {
-    (*tris)[i * 9 + 0] = v[i][0];
-    (*tris)[i * 9 + 1] = v[i][1];
-    (*tris)[i * 9 + 2] = v[i][2];
-    (*tris)[i * 9 + 3] = v[i][3];
-    (*tris)[i * 9 + 4] = v[i][4];
-    (*tris)[i * 9 + 5] = v[i][5];
-    (*tris)[i * 9 + 6] = v[i][6];
-    (*tris)[i * 9 + 7] = v[i][7];
-    (*tris)[i * 9 + 8] = v[i][8];
-    (*colors)[i * 3 + 0] = c[i][0];
-    (*colors)[i * 3 + 1] = c[i][1];
-    (*colors)[i * 3 + 2] = c[i][2];
+    if (held && dt > 0) {
+      move_camera(&camera, forward * speed * dt, right * speed * dt,
+                  up * speed * dt);
+      turn_camera(&camera, yaw * VIEWER_TURN_RATE * dt,
+                  pitch * VIEWER_TURN_RATE * dt);
+      moved = true;
+    }
+    if (moved && !quit)
+      live.move(camera, now);
   }
 
-  return t_size;
+  live.report(std::cout);
 }
+#endif // USE_SDL
 
-int init_spheres(float **spheres, float **radius, unsigned char **colors,
-                 int row, int col) {
-  float rad = 1.0f;
-
-#ifdef BENCHMIN
-  row = 30;
-  col = 30;
-#endif
-
-#ifdef BENCHMID
-  row = 70;
-  col = 70;
-#endif
-
-#ifdef BENCHMAX
-  row = 100;
-  col = 100;
-#endif
-
-  (*spheres) = new float[row * col * 3];
-  (*colors) = new unsigned char[row * col * 3];
-  (*radius) = new float[row * col];
-
-  for (int i = 0; i < row; i++) {
-    for (int j = 0; j < col; j++) {
-      (*spheres)[(i * col + j) * 3 + 0] = (j * 2 - col) * rad;
-      (*spheres)[(i * col + j) * 3 + 1] = (i * 2 - row) * rad;
-      (*spheres)[(i * col + j) * 3 + 2] = -50;
-      (*radius)[(i * col + j)] = rad;
-
-      (*colors)[(i * col + j) * 3 + 0] = 0;
-      (*colors)[(i * col + j) * 3 + 1] = 255;
-      (*colors)[(i * col + j) * 3 + 2] = 0;
+/**
+ * Renders the frames of animation one after the other into the same
+ * buffers, on the scene and worker threads already set up, writing each to
+ * output with its number when given. A frame where nothing moved keeps the
+ * previous image. Stops early once closed is set.
+ **/
+void render_animation(const Animation &animation, float *hdr,
+                      unsigned char *frameBuffer, Camera camera,
+                      RenderSettings settings, Scene *scene,
+                      DirtyTileQueue *dirty, const std::string *output,
+                      const std::atomic<bool> &closed) {
+  // As for a still image, a viewer tonemaps the tiles itself
+  unsigned char *tonemapped = dirty != NULL ? NULL : frameBuffer;
+  double update_time = 0, render_time = 0, output_time = 0;
+  int frame = 0, rendered = 0;
+  double start = omp_get_wtime();
+
+  for (; frame < animation.frames && !closed; frame++) {
+    double update_start = omp_get_wtime();
+    int changed = animate(animation, frame, &camera, scene);
+    double update = omp_get_wtime() - update_start;
+    update_time += update;
+
+    std::cout << "Frame " << frame << ": update " << update << " s";
+    if (changed & ANIMATED_CAMERA)
+      std::cout << ", camera";
+    if (changed & ANIMATED_LIGHTS)
+      std::cout << ", lights";
+    if (changed & ANIMATED_INSTANCES)
+      std::cout << ", instances";
+
+    if (changed != 0 || frame == 0) {
+      RenderStats stats =
+          render(hdr, tonemapped, camera, settings, *scene, dirty, NULL,
+                 NULL);
+      render_time += stats.time;
+      rendered++;
+      std::cout << ", render " << stats.time << " s";
+    }
+    std::cout << std::endl;
+
+    if (output != NULL) {
+      double output_start = omp_get_wtime();
+      if (tonemapped == NULL)
+        tonemap_frame(hdr, settings.width, settings.height, frameBuffer,
+                      settings.width * 4, settings.tonemap, settings.exposure);
+      write_image(frame_path(*output, frame), frameBuffer, hdr,
+                  settings.width, settings.height);
+      output_time += omp_get_wtime() - output_start;
     }
   }
 
-  return row * col;
+  double time = omp_get_wtime() - start;
+  std::cout << "Animation: " << frame << " frames (" << rendered
+            << " rendered) in " << time << " s, "
+            << (time > 0 ? frame / time : 0) << " frames/s (update "
+            << update_time << " s, render " << render_time << " s, output "
+            << output_time << " s)" << std::endl;
 }
 
-int init_lights(float **lights) {
-  int l_size = 2;
-
-  (*lights) = new float[l_size * 3];
-
-  float v[2][3] = {{2.0, 5.0, -4.0}, {-2.0, 5.0, -4.0}};
-
-  for (int i = 0; i < l_size; i++) {
-    (*lights)[i * 3 + 0] = v[i][0];
-    (*lights)[i * 3 + 1] = v[i][1];
-    (*lights)[i * 3 + 2] = v[i][2];
-  }
+/**
+ * Inserts the frame number before the extension: image.png, 7 gives
+ * image_0007.png
+ **/
+std::string frame_path(const std::string &path, int frame) {
+  char number[16];
+  snprintf(number, sizeof(number), "_%04d", frame);
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of('/');
+  if (dot == std::string::npos ||
+      (slash != std::string::npos && dot < slash))
+    return path + number;
+  return path.substr(0, dot) + number + path.substr(dot);
+}
 
-  return l_size;
+/**
+ * Parses a comma separated x,y,z triple
+ **/
+bool parse_vec3(const std::string &str, float v[]) {
+  return sscanf(str.c_str(), "%f,%f,%f", &v[0], &v[1], &v[2]) == 3;
 }
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <omp.h>
+
+#include "maths.hpp"
+
+// Every material is reflectivity, transparency and index of refraction
+#define MATERIAL_FLOATS 3
+#define MAX_MATERIALS 256 // indices are stored in a byte
+
+// Primitive colors are r, g, b and the index of their material
+#define COLOR_BYTES 4
+
+#define MAX_RAY_DEPTH 16 // bounces after the camera ray, at most
+#define ROULETTE_WEIGHT 0.5f  // rays weighing less may be dropped
+
+/**
+ * Material 0, which every primitive has unless told otherwise: lit by the
+ * lights alone
+ **/
+static inline void plain_material(float *material) {
+  material[0] = 0; // reflectivity
+  material[1] = 0; // transparency
+  material[2] = 1; // index of refraction
+}
+
+#pragma omp declare target
+/**
+ * Refracts the unit vector dir through a surface of unit normal n facing
+ * it, eta being the ratio of the indices of refraction (from over to).
+ * Returns false on total internal reflection, refr being left alone.
+ **/
+static inline bool refract(vec3 dir, vec3 n, float eta, vec3 *refr) {
+  float c = -dot(dir, n);
+  float k = 1 - eta * eta * (1 - c * c);
+  if (k < 0)
+    return false;
+  float a = eta * c - sqrtf(k);
+  *refr = eta * dir + a * n;
+  return true;
+}
+
+/**
+ * Share of the light a dielectric reflects at cosine c from the normal,
+ * Schlick's approximation of the Fresnel equations
+ **/
+static inline float fresnel(float c, float eta) {
+  float r0 = (1 - eta) / (1 + eta);
+  r0 *= r0;
+  float m = 1 - c;
+  return r0 + (1 - r0) * m * m * m * m * m;
+}
+#pragma omp end declare target
@@ -5,49 +5,169 @@
 #include <omp.h>
 #include <stdio.h>
 
+#include "stats.hpp"
+
 #pragma omp declare target
+/**
+ * Three floats handled by value. Every operation is inline, constexpr when
+ * C++11 allows it, so temporaries stay in registers and calls fold away
+ * across translation units. Arrays of floats (streams, lights, rays in
+ * packets) are read and written with load3 and store3.
+ *
+ * The operations round exactly as the float[] helpers they replaced did,
+ * component by component and in the same order, so images do not change.
+ **/
 struct vec3 {
   float x, y, z;
 };
 
-struct vec4 {
-  float x, y, z, a;
-};
+inline vec3 load3(const float *v) { return vec3{v[0], v[1], v[2]}; }
 
-struct triangle {
-  vec3 p1, p2, p3, color;
-};
+inline void store3(float *to, vec3 v) {
+  to[0] = v.x;
+  to[1] = v.y;
+  to[2] = v.z;
+}
 
-struct sphere {
-  vec3 orig, color;
-  float radius;
-};
+constexpr vec3 operator+(vec3 a, vec3 b) {
+  return vec3{a.x + b.x, a.y + b.y, a.z + b.z};
+}
 
-template <class T> T clamp(T value, T min, T max) {
-  return value < min ? min : (value > max ? max : value);
+constexpr vec3 operator-(vec3 a, vec3 b) {
+  return vec3{a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+constexpr vec3 operator-(vec3 a) { return vec3{-a.x, -a.y, -a.z}; }
+
+constexpr vec3 operator*(vec3 a, float t) {
+  return vec3{a.x * t, a.y * t, a.z * t};
+}
+
+constexpr vec3 operator*(float t, vec3 a) { return a * t; }
+
+// Component by component, for colors and weights
+constexpr vec3 operator*(vec3 a, vec3 b) {
+  return vec3{a.x * b.x, a.y * b.y, a.z * b.z};
+}
+
+constexpr vec3 operator/(vec3 a, float t) {
+  return vec3{a.x / t, a.y / t, a.z / t};
+}
+
+inline vec3 &operator+=(vec3 &a, vec3 b) { return a = a + b; }
+
+constexpr float dot(vec3 a, vec3 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+constexpr vec3 cross(vec3 a, vec3 b) {
+  return vec3{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+              a.x * b.y - a.y * b.x};
 }
 
-void scale_vec(float v[], float t, float res[]);
-void add_vec(float v1[], float v2[], float res[]);
-void sub_vec(float v1[], float v2[], float res[]);
-float length(float v[]);
-void normalize(float v[]);
-void normal(float p1[], float p2[], float p3[], float res[]);
-void cross_product(float v1[], float v2[], float res[]);
-float dot_product(float v1[], float v2[]);
+inline float length(vec3 v) { return sqrt(dot(v, v)); }
 
-int rayTriangleIntersects(float orig[], float dir[], float p1[], float p2[],
-                          float p3[], float P[]);
-int raySphereIntersects(float orig[], float dir[], float s_orig[], float radius,
-                        float P[]);
+// Zero stays zero
+inline vec3 normalize(vec3 v) {
+  float l = length(v);
+  return l == 0.0f ? v : v / l;
+}
+
+// dir mirrored about the plane of normal n
+constexpr vec3 reflect(vec3 dir, vec3 n) {
+  return n * (-2 * dot(dir, n)) + dir;
+}
 
-void reflect(float dir[], float normal[], float refl[]);
+template <class T> T clamp(T value, T min, T max) {
+  return value < min ? min : (value > max ? max : value);
+}
 
 template <class T> void copy_array(T to[], T *from, int size) {
   for (int i = 0; i < size; i++)
     to[i] = from[i];
 }
 
+/**
+ * Möller–Trumbore: solves orig + t * dir = p + u * e1 + v * e2 directly with
+ * the edges precomputed, writing the distance and barycentrics of the hit.
+ **/
+inline int rayTriangleIntersects(vec3 orig, vec3 dir, vec3 p, vec3 e1,
+                                 vec3 e2, float *t, float *u, float *v) {
+  const float kEpsilon = 1e-8f;
+
+  vec3 pvec = cross(dir, e2);
+  float det = dot(e1, pvec);
+
+  // Ray parallel to the plane, or a degenerate triangle
+  if (fabs(det) < kEpsilon) {
+    STAT_ADD(triangle_parallel, 1);
+    return false;
+  }
+  float inv_det = 1.0f / det;
+
+  vec3 tvec = orig - p;
+  *u = dot(tvec, pvec) * inv_det;
+  if (*u < 0 || *u > 1) {
+    STAT_ADD(triangle_outside, 1);
+    return false;
+  }
+
+  vec3 qvec = cross(tvec, e1);
+  *v = dot(dir, qvec) * inv_det;
+  if (*v < 0 || *u + *v > 1) {
+    STAT_ADD(triangle_outside, 1);
+    return false;
+  }
+
+  *t = dot(e2, qvec) * inv_det;
+  if (*t < 0) {
+    STAT_ADD(triangle_behind, 1);
+    return false;
+  }
+
+  return true;
+}
+
+inline int raySphereIntersects(vec3 orig, vec3 dir, vec3 s_orig, float radius,
+                               float *t) {
+  float t0, t1;
+  const float kEpsilon = 0.001f;
+  vec3 L = orig - s_orig;
+  float a = dot(dir, dir);
+  float b = 2 * dot(dir, L);
+  float c = dot(L, L) - radius * radius;
+
+  // Solve quadratic equation
+  float discr = b * b - 4 * a * c;
+  if (discr < 0) {
+    return false;
+  } else if (discr == 0)
+    t0 = t1 = -0.5 * b / a;
+  else {
+    float q =
+        (b > kEpsilon) ? -0.5 * (b + sqrt(discr)) : -0.5 * (b - sqrt(discr));
+    t0 = q / a;
+    t1 = c / q;
+  }
+
+  if (t0 >= t1) {
+    float near = t1;
+    t1 = t0;
+    t0 = near;
+  }
+
+  if (t0 <= kEpsilon) {
+    t0 = t1;
+    if (t0 <= kEpsilon) {
+      return false;
+    }
+  }
+
+  *t = t0;
+
+  return true;
+}
+
 #pragma omp end declare target
 
 //////////////////////////////////////
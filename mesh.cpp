@@ -0,0 +1,675 @@
+#include "mesh.hpp"
+#include "text_parse.hpp"
+
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static bool has_extension(const std::string &path, const char *extension) {
+  size_t size = strlen(extension);
+  return path.size() >= size &&
+         strcasecmp(path.c_str() + path.size() - size, extension) == 0;
+}
+
+static bool read_file(const std::string &path, std::vector<char> &buffer) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    std::cerr << "Could not open file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  // NUL terminated so the text readers may run off a token safely
+  long long size = file.tellg();
+  buffer.resize(size + 1);
+  file.seekg(0);
+  if (!file.read(buffer.data(), size)) {
+    std::cerr << "Could not read file '" << path << "'" << std::endl;
+    return false;
+  }
+  buffer[size] = '\0';
+  buffer.resize(size);
+  return true;
+}
+
+/**
+ * A piece of an OBJ file, parsed on its own into local arrays
+ **/
+struct ObjChunk {
+  const char *begin, *end;
+  long long first_line, lines;
+  long long n_vertices, vertex_first;
+  std::vector<float> vertices;
+  std::vector<unsigned int> indices;
+
+  long long error_line;
+  std::string error;
+};
+
+static void obj_error(ObjChunk *chunk, long long line,
+                      const std::string &error) {
+  if (chunk->error_line == 0) {
+    chunk->error_line = line;
+    chunk->error = error;
+  }
+}
+
+static inline bool obj_record(const char *p, const char *eol, char type) {
+  return p < eol && p[0] == type && (p + 1 == eol || is_blank(p[1]));
+}
+
+/**
+ * First pass: lines and vertices, so every chunk knows the absolute number
+ * of its first vertex, which relative (negative) indices need
+ **/
+static void count_obj_chunk(ObjChunk *chunk) {
+  for (const char *p = chunk->begin; p < chunk->end;) {
+    const char *eol = line_end(p, chunk->end);
+    p = skip_blanks(p, eol);
+    chunk->n_vertices += obj_record(p, eol, 'v');
+    chunk->lines++;
+    p = eol + 1;
+  }
+}
+
+/**
+ * Keeps v and f records, anything else (normals, texture coordinates,
+ * groups, materials) is skipped. Faces with more than three corners are
+ * split into a fan.
+ **/
+static void parse_obj_chunk(ObjChunk *chunk, long long total_vertices) {
+  long long line = chunk->first_line;
+  long long seen = chunk->vertex_first;
+  chunk->vertices.reserve(chunk->n_vertices * 3);
+
+  for (const char *p = chunk->begin; p < chunk->end; line++) {
+    const char *eol = line_end(p, chunk->end);
+    const char *next = eol + 1;
+    p = skip_blanks(p, eol);
+
+    if (obj_record(p, eol, 'v')) {
+      p++;
+      float v[3];
+      for (int k = 0; k < 3; k++) {
+        p = skip_blanks(p, eol);
+        if (!parse_float(p, eol, &v[k])) {
+          obj_error(chunk, line, "expected 3 vertex coordinates");
+          return;
+        }
+      }
+      chunk->vertices.insert(chunk->vertices.end(), v, v + 3);
+      seen++;
+    } else if (obj_record(p, eol, 'f')) {
+      p++;
+      unsigned int corners[3];
+      int n = 0;
+      int corners_seen = 0;
+      for (p = skip_blanks(p, eol); p < eol; p = skip_blanks(p, eol)) {
+        int index;
+        if (!parse_int(p, eol, &index) || index == 0) {
+          obj_error(chunk, line, "bad vertex index");
+          return;
+        }
+        // Texture and normal indices follow the slashes
+        while (p < eol && !is_blank(*p))
+          p++;
+
+        long long absolute = index > 0 ? index - 1LL : seen + index;
+        if (absolute < 0 || absolute >= total_vertices) {
+          std::ostringstream msg;
+          msg << "vertex " << index << " out of range";
+          obj_error(chunk, line, msg.str());
+          return;
+        }
+
+        corners_seen++;
+        if (n < 2) {
+          corners[n++] = absolute;
+          continue;
+        }
+        corners[2] = absolute;
+        chunk->indices.insert(chunk->indices.end(), corners, corners + 3);
+        corners[1] = corners[2];
+      }
+      if (corners_seen < 3) {
+        obj_error(chunk, line, "face with fewer than 3 vertices");
+        return;
+      }
+    }
+    p = next;
+  }
+}
+
+/**
+ * Wavefront OBJ, read in parallel chunks the same way as text scenes
+ **/
+static bool load_obj(const std::string &path, IndexedMesh *mesh) {
+  std::vector<char> buffer;
+  if (!read_file(path, buffer))
+    return false;
+
+  std::vector<const char *> bounds =
+      split_lines(buffer.data(), buffer.size());
+  int n_chunks = bounds.size() - 1;
+  std::vector<ObjChunk> chunks(n_chunks);
+  for (int i = 0; i < n_chunks; i++) {
+    chunks[i].begin = bounds[i];
+    chunks[i].end = bounds[i + 1];
+    chunks[i].lines = chunks[i].n_vertices = 0;
+    chunks[i].error_line = 0;
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n_chunks; i++)
+    count_obj_chunk(&chunks[i]);
+
+  long long line = 1, n_vertices = 0;
+  for (int i = 0; i < n_chunks; i++) {
+    chunks[i].first_line = line;
+    chunks[i].vertex_first = n_vertices;
+    line += chunks[i].lines;
+    n_vertices += chunks[i].n_vertices;
+  }
+  if (n_vertices > UINT_MAX) {
+    std::cerr << path << ": more vertices than 32-bit indices address"
+              << std::endl;
+    return false;
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n_chunks; i++)
+    parse_obj_chunk(&chunks[i], n_vertices);
+
+  size_t n_indices = 0;
+  for (int i = 0; i < n_chunks; i++) {
+    if (chunks[i].error_line != 0) {
+      std::cerr << path << ":" << chunks[i].error_line << ": "
+                << chunks[i].error << std::endl;
+      return false;
+    }
+    n_indices += chunks[i].indices.size();
+  }
+
+  mesh->vertices.reserve(n_vertices * 3);
+  mesh->indices.reserve(n_indices);
+  for (int i = 0; i < n_chunks; i++) {
+    mesh->vertices.insert(mesh->vertices.end(), chunks[i].vertices.begin(),
+                          chunks[i].vertices.end());
+    mesh->indices.insert(mesh->indices.end(), chunks[i].indices.begin(),
+                         chunks[i].indices.end());
+  }
+  return true;
+}
+
+#define PLY_INT8 0
+#define PLY_UINT8 1
+#define PLY_INT16 2
+#define PLY_UINT16 3
+#define PLY_INT32 4
+#define PLY_UINT32 5
+#define PLY_FLOAT32 6
+#define PLY_FLOAT64 7
+
+static const struct {
+  const char *name, *alias;
+  int size;
+} ply_types[] = {{"char", "int8", 1},    {"uchar", "uint8", 1},
+                 {"short", "int16", 2},  {"ushort", "uint16", 2},
+                 {"int", "int32", 4},    {"uint", "uint32", 4},
+                 {"float", "float32", 4}, {"double", "float64", 8}};
+
+struct PlyProperty {
+  std::string name;
+  int type;
+  int count_type; // -1 unless a list
+};
+
+struct PlyElement {
+  std::string name;
+  long long count;
+  std::vector<PlyProperty> properties;
+};
+
+static int ply_type(const std::string &name) {
+  for (int i = 0; i < 8; i++) {
+    if (name == ply_types[i].name || name == ply_types[i].alias)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Reads one value of the given type at p, byte swapped when the file and
+ * the machine disagree.
+ **/
+static double ply_value(const char *p, int type, bool swap) {
+  unsigned char bytes[8];
+  int size = ply_types[type].size;
+  for (int i = 0; i < size; i++)
+    bytes[i] = p[swap ? size - 1 - i : i];
+
+  switch (type) {
+  case PLY_INT8:
+    return (signed char)bytes[0];
+  case PLY_UINT8:
+    return bytes[0];
+  case PLY_INT16: {
+    short v;
+    memcpy(&v, bytes, 2);
+    return v;
+  }
+  case PLY_UINT16: {
+    unsigned short v;
+    memcpy(&v, bytes, 2);
+    return v;
+  }
+  case PLY_INT32: {
+    int v;
+    memcpy(&v, bytes, 4);
+    return v;
+  }
+  case PLY_UINT32: {
+    unsigned int v;
+    memcpy(&v, bytes, 4);
+    return v;
+  }
+  case PLY_FLOAT32: {
+    float v;
+    memcpy(&v, bytes, 4);
+    return v;
+  }
+  }
+  double v;
+  memcpy(&v, bytes, 8);
+  return v;
+}
+
+static bool ply_header(const std::vector<char> &buffer, size_t *body,
+                       bool *big_endian, std::vector<PlyElement> &elements,
+                       std::string &error) {
+  static const char end_header[] = "end_header\n";
+  const char *data = buffer.data();
+  const char *stop = (const char *)memmem(data, buffer.size(), end_header,
+                                          sizeof(end_header) - 1);
+  if (buffer.size() < 4 || memcmp(data, "ply\n", 4) != 0 || stop == NULL) {
+    error = "not a PLY file";
+    return false;
+  }
+  *body = stop - data + sizeof(end_header) - 1;
+
+  std::istringstream header(std::string(data, stop));
+  std::string line, format;
+  while (std::getline(header, line)) {
+    std::istringstream words(line);
+    std::string keyword;
+    words >> keyword;
+    if (keyword == "format") {
+      words >> format;
+    } else if (keyword == "element") {
+      PlyElement element;
+      if (!(words >> element.name >> element.count) || element.count < 0) {
+        error = "bad element line '" + line + "'";
+        return false;
+      }
+      elements.push_back(element);
+    } else if (keyword == "property") {
+      PlyProperty property;
+      std::string type, count_type;
+      words >> type;
+      if (type == "list")
+        words >> count_type >> type;
+      words >> property.name;
+      property.type = ply_type(type);
+      property.count_type = count_type.empty() ? -1 : ply_type(count_type);
+      if (elements.empty() || property.type < 0 || property.name.empty() ||
+          (!count_type.empty() && property.count_type < 0)) {
+        error = "bad property line '" + line + "'";
+        return false;
+      }
+      elements.back().properties.push_back(property);
+    }
+  }
+
+  if (format != "binary_little_endian" && format != "binary_big_endian") {
+    error = "only binary PLY files are supported, found '" + format + "'";
+    return false;
+  }
+  *big_endian = format == "binary_big_endian";
+  return true;
+}
+
+/**
+ * Binary PLY, little or big endian. Vertices take the x, y and z
+ * properties whatever their type, faces the vertex_indices (or
+ * vertex_index) list, split into a fan; other elements are skipped.
+ **/
+static bool load_ply(const std::string &path, IndexedMesh *mesh) {
+  std::vector<char> buffer;
+  if (!read_file(path, buffer))
+    return false;
+
+  size_t body;
+  bool big_endian;
+  std::vector<PlyElement> elements;
+  std::string error;
+  if (!ply_header(buffer, &body, &big_endian, elements, error)) {
+    std::cerr << "Bad PLY file '" << path << "': " << error << std::endl;
+    return false;
+  }
+
+  unsigned int probe = 1;
+  bool swap = (*(unsigned char *)&probe == 1) == big_endian;
+
+  const char *p = buffer.data() + body;
+  const char *end = buffer.data() + buffer.size();
+  long long n_vertices = -1;
+  for (size_t e = 0; e < elements.size() && error.empty(); e++) {
+    const PlyElement &element = elements[e];
+    bool vertex = element.name == "vertex", face = element.name == "face";
+    if (vertex) {
+      n_vertices = element.count;
+      mesh->vertices.resize(n_vertices * 3);
+    }
+
+    for (long long i = 0; i < element.count && error.empty(); i++) {
+      for (size_t k = 0; k < element.properties.size(); k++) {
+        const PlyProperty &property = element.properties[k];
+        int size = ply_types[property.type].size;
+
+        if (property.count_type < 0) {
+          if (p + size > end) {
+            error = "truncated";
+            break;
+          }
+          int axis = property.name == "x"   ? 0
+                     : property.name == "y" ? 1
+                     : property.name == "z" ? 2
+                                            : -1;
+          if (vertex && axis >= 0)
+            mesh->vertices[i * 3 + axis] = ply_value(p, property.type, swap);
+          p += size;
+          continue;
+        }
+
+        int count_size = ply_types[property.count_type].size;
+        if (p + count_size > end) {
+          error = "truncated";
+          break;
+        }
+        long long count = ply_value(p, property.count_type, swap);
+        p += count_size;
+        if (count < 0 || count > (end - p) / size) {
+          error = "truncated";
+          break;
+        }
+
+        bool indices = face && (property.name == "vertex_indices" ||
+                                property.name == "vertex_index");
+        if (indices && n_vertices < 0) {
+          error = "faces before vertices";
+          break;
+        }
+        for (long long c = 0; indices && c < count; c++) {
+          double index = ply_value(p + c * size, property.type, swap);
+          if (!(index >= 0 && index < n_vertices)) {
+            error = "vertex index out of range";
+            break;
+          }
+          // Fan around the first corner
+          if (c >= 2) {
+            mesh->indices.push_back(ply_value(p, property.type, swap));
+            mesh->indices.push_back(
+                ply_value(p + (c - 1) * size, property.type, swap));
+            mesh->indices.push_back(index);
+          }
+        }
+        p += count * size;
+      }
+    }
+  }
+
+  if (error.empty() && n_vertices < 0)
+    error = "no vertex element";
+  if (!error.empty()) {
+    std::cerr << "Bad PLY file '" << path << "': " << error << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool mesh_format_supported(const std::string &path) {
+  return has_extension(path, ".obj") || has_extension(path, ".ply");
+}
+
+/**
+ * Reads an OBJ or binary PLY file, picked by extension, into an indexed
+ * mesh. Prints the reason and returns false when it cannot.
+ **/
+bool load_mesh(const std::string &path, IndexedMesh *mesh) {
+  mesh->path = path;
+  mesh->vertices.clear();
+  mesh->indices.clear();
+
+  bool loaded;
+  if (has_extension(path, ".obj"))
+    loaded = load_obj(path, mesh);
+  else if (has_extension(path, ".ply"))
+    loaded = load_ply(path, mesh);
+  else {
+    std::cerr << "Unknown mesh format '" << path << "', expected .obj or .ply"
+              << std::endl;
+    return false;
+  }
+
+  if (loaded && mesh->indices.empty()) {
+    std::cerr << "Mesh '" << path << "' has no triangles" << std::endl;
+    return false;
+  }
+  return loaded;
+}
+
+static void multiply_affine(const float a[12], const float b[12],
+                            float res[12]) {
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 4; c++) {
+      res[r * 4 + c] = a[r * 4 + 0] * b[0 + c] + a[r * 4 + 1] * b[4 + c] +
+                       a[r * 4 + 2] * b[8 + c] + (c == 3 ? a[r * 4 + 3] : 0);
+    }
+  }
+}
+
+static void invert_affine(const float m[12], float inv[12]) {
+  float a = m[0], b = m[1], c = m[2];
+  float d = m[4], e = m[5], f = m[6];
+  float g = m[8], h = m[9], i = m[10];
+
+  float A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+  float det = a * A + b * B + c * C;
+  float s = det != 0 ? 1.0f / det : 0;
+
+  float linear[9] = {A * s, (c * h - b * i) * s, (b * f - c * e) * s,
+                     B * s, (a * i - c * g) * s, (c * d - a * f) * s,
+                     C * s, (b * g - a * h) * s, (a * e - b * d) * s};
+  for (int r = 0; r < 3; r++) {
+    for (int k = 0; k < 3; k++)
+      inv[r * 4 + k] = linear[r * 3 + k];
+    inv[r * 4 + 3] = -(linear[r * 3 + 0] * m[3] + linear[r * 3 + 1] * m[7] +
+                       linear[r * 3 + 2] * m[11]);
+  }
+}
+
+/**
+ * Places an instance: scaled, then rotated about x, y and z (degrees, in
+ * that order), then translated.
+ **/
+void instance_transform(MeshInstance *instance, const float translate[3],
+                        const float rotate[3], float scale) {
+  float m[12] = {scale, 0, 0, 0, 0, scale, 0, 0, 0, 0, scale, 0};
+  for (int axis = 0; axis < 3; axis++) {
+    float angle = rotate[axis] * (float)M_PI / 180.0f;
+    float cs = cosf(angle), sn = sinf(angle);
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+
+    float r[12] = {0};
+    r[axis * 4 + axis] = 1;
+    r[u * 4 + u] = cs;
+    r[u * 4 + v] = -sn;
+    r[v * 4 + u] = sn;
+    r[v * 4 + v] = cs;
+
+    float tmp[12];
+    multiply_affine(r, m, tmp);
+    copy_array(m, tmp, 12);
+  }
+  for (int k = 0; k < 3; k++)
+    m[k * 4 + 3] = translate[k];
+
+  copy_array(instance->to_world, m, 12);
+  invert_affine(instance->to_world, instance->to_object);
+}
+
+/**
+ * World space box around the eight transformed corners of the mesh box
+ **/
+void instance_bounds(const MeshInstance &instance, const Mesh &mesh,
+                     float bmin[3], float bmax[3]) {
+  for (int k = 0; k < 3; k++) {
+    bmin[k] = FLT_MAX;
+    bmax[k] = -FLT_MAX;
+  }
+  for (int corner = 0; corner < 8; corner++) {
+    float p[3] = {corner & 1 ? mesh.bmax[0] : mesh.bmin[0],
+                  corner & 2 ? mesh.bmax[1] : mesh.bmin[1],
+                  corner & 4 ? mesh.bmax[2] : mesh.bmin[2]};
+    for (int k = 0; k < 3; k++) {
+      const float *row = instance.to_world + k * 4;
+      float w = row[0] * p[0] + row[1] * p[1] + row[2] * p[2] + row[3];
+      bmin[k] = w < bmin[k] ? w : bmin[k];
+      bmax[k] = w > bmax[k] ? w : bmax[k];
+    }
+  }
+}
+
+/**
+ * Expands the indexed mesh into the triangle streams and builds its BVH
+ **/
+void build_mesh(Mesh *mesh, const IndexedMesh &indexed, bool use_bvh) {
+  int t_size = indexed.indices.size() / 3;
+  float *tris = new float[t_size * 9];
+  const float *vertices = indexed.vertices.data();
+  const unsigned int *indices = indexed.indices.data();
+
+#pragma omp parallel for
+  for (int i = 0; i < t_size; i++) {
+    for (int c = 0; c < 3; c++)
+      copy_array(tris + i * 9 + c * 3,
+                 (float *)vertices + indices[i * 3 + c] * 3, 3);
+  }
+
+  for (int k = 0; k < 3; k++) {
+    mesh->bmin[k] = FLT_MAX;
+    mesh->bmax[k] = -FLT_MAX;
+  }
+  for (int i = 0; i < t_size * 3; i++) {
+    for (int k = 0; k < 3; k++) {
+      float v = tris[i * 3 + k];
+      mesh->bmin[k] = v < mesh->bmin[k] ? v : mesh->bmin[k];
+      mesh->bmax[k] = v > mesh->bmax[k] ? v : mesh->bmax[k];
+    }
+  }
+
+  mesh->nodes = NULL;
+  mesh->n_nodes = 0;
+  if (use_bvh)
+    mesh->n_nodes = build_bvh(&mesh->nodes, tris, NULL, t_size, NULL, NULL,
+                              NULL, 0, NULL, 0, NULL);
+  build_triangle_soa(&mesh->tris, tris, t_size);
+  delete[] tris;
+}
+
+void free_mesh(Mesh *mesh) {
+  free_triangle_soa(&mesh->tris);
+  delete[] mesh->nodes;
+  mesh->nodes = NULL;
+  mesh->n_nodes = 0;
+}
+
+long long instanced_triangles(const InstanceSet &set) {
+  long long total = 0;
+  for (int i = 0; i < set.count; i++)
+    total += set.meshes[set.list[i].mesh].tris.count;
+  return total;
+}
+
+#pragma omp declare target
+
+static inline void to_object(const MeshInstance *instance, const float *orig,
+                             const float *dir, float *o, float *d) {
+  const float *m = instance->to_object;
+  vec3 x = load3(m), y = load3(m + 4), z = load3(m + 8);
+  vec3 p = load3(orig), v = load3(dir);
+  store3(o, vec3{dot(x, p) + m[3], dot(y, p) + m[7], dot(z, p) + m[11]});
+  store3(d, vec3{dot(x, v), dot(y, v), dot(z, v)});
+}
+
+/**
+ * Closest hit over instances [first, first + count). Each ray is taken into
+ * the space of the mesh, where distances along it are unchanged since the
+ * direction is transformed without renormalizing. *index becomes the
+ * triangle of the mesh and *instance the instance.
+ **/
+int instances_closest(InstanceSet *set, int first, int count, float *orig,
+                      float *dir, float *t_best, int *index, int *instance) {
+  int hit = false;
+  for (int i = first; i < first + count; i++) {
+    MeshInstance *inst = &set->list[i];
+    Mesh *mesh = &set->meshes[inst->mesh];
+    float o[3], d[3];
+    to_object(inst, orig, dir, o, d);
+
+    int found;
+    if (mesh->nodes != NULL)
+      found = bvh_traverse(mesh->nodes, 0, &mesh->tris, NULL, NULL, index,
+                           NULL, t_best, o, d);
+    else
+      found = triangles_closest(&mesh->tris, 0, mesh->tris.count, o, d,
+                                t_best, index);
+    if (found) {
+      *instance = i;
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+int instances_occluded(InstanceSet *set, int first, int count, float *orig,
+                       float *dir, float tmin, float tmax) {
+  for (int i = first; i < first + count; i++) {
+    MeshInstance *inst = &set->list[i];
+    Mesh *mesh = &set->meshes[inst->mesh];
+    float o[3], d[3];
+    to_object(inst, orig, dir, o, d);
+
+    if (mesh->nodes != NULL
+            ? bvh_occluded(mesh->nodes, &mesh->tris, NULL, NULL, o, d, tmin,
+                           tmax)
+            : triangles_occluded(&mesh->tris, 0, mesh->tris.count, o, d,
+                                 tmin, tmax))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * World space normal of a triangle of an instance, by the inverse
+ * transpose of its transform. Not normalized.
+ **/
+vec3 instance_normal(InstanceSet *set, int instance, int index) {
+  MeshInstance *inst = &set->list[instance];
+  TriangleSoA *tris = &set->meshes[inst->mesh].tris;
+  const float *m = inst->to_object;
+  return load3(m) * tris->nx[index] + load3(m + 4) * tris->ny[index] +
+         load3(m + 8) * tris->nz[index];
+}
+#pragma omp end declare target
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <omp.h>
+#include <string>
+#include <vector>
+
+#include "bvh.hpp"
+#include "simd.hpp"
+
+/**
+ * A triangle mesh as the loaders produce it: one shared vertex buffer
+ * (x, y, z per vertex) and three 32-bit indices per triangle.
+ **/
+struct IndexedMesh {
+  std::string path;
+  std::vector<float> vertices;
+  std::vector<unsigned int> indices;
+};
+
+#pragma omp declare target
+/**
+ * A mesh ready for rendering, in its own space with its own BVH (nodes is
+ * NULL when rendering without one). Stored once however many times it is
+ * instanced.
+ **/
+struct Mesh {
+  TriangleSoA tris;
+  BVHNode *nodes;
+  int n_nodes;
+  float bmin[3], bmax[3];
+};
+
+/**
+ * One placement of a mesh. Transforms are 3x4 row major affine matrices,
+ * to_object taking world space rays into the space of the mesh. id is the
+ * position in the scene file, which the BVH build does not keep.
+ **/
+struct MeshInstance {
+  float to_world[12];
+  float to_object[12];
+  int mesh;
+  int id;
+  unsigned char color[3];
+  unsigned char material;
+};
+
+struct InstanceSet {
+  Mesh *meshes;
+  int n_meshes;
+  MeshInstance *list;
+  int count;
+};
+
+int instances_closest(InstanceSet *set, int first, int count, float *orig,
+                      float *dir, float *t_best, int *index, int *instance);
+int instances_occluded(InstanceSet *set, int first, int count, float *orig,
+                       float *dir, float tmin, float tmax);
+vec3 instance_normal(InstanceSet *set, int instance, int index);
+#pragma omp end declare target
+
+/**
+ * Meshes and instances of a scene before they are prepared
+ **/
+struct SceneMeshes {
+  std::vector<IndexedMesh> meshes;
+  std::vector<MeshInstance> instances;
+};
+
+bool load_mesh(const std::string &path, IndexedMesh *mesh);
+bool mesh_format_supported(const std::string &path);
+
+void instance_transform(MeshInstance *instance, const float translate[3],
+                        const float rotate[3], float scale);
+void instance_bounds(const MeshInstance &instance, const Mesh &mesh,
+                     float bmin[3], float bmax[3]);
+
+void build_mesh(Mesh *mesh, const IndexedMesh &indexed, bool use_bvh);
+void free_mesh(Mesh *mesh);
+long long instanced_triangles(const InstanceSet &set);
@@ -0,0 +1,277 @@
+#include "numa.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/**
+ * CPUs of a list such as "0-3,8-11", as sysfs writes them
+ **/
+static std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    int first, last;
+    if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+      for (int c = first; c <= last; c++)
+        cpus.push_back(c);
+    else if (sscanf(range.c_str(), "%d", &first) == 1)
+      cpus.push_back(first);
+  }
+  return cpus;
+}
+
+/**
+ * The other way round, runs of consecutive CPUs written first-last
+ **/
+static std::string format_cpu_list(const std::vector<int> &cpus) {
+  std::stringstream list;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+      j++;
+    list << (i > 0 ? "," : "") << cpus[i];
+    if (j > i)
+      list << "-" << cpus[j];
+    i = j + 1;
+  }
+  return list.str();
+}
+
+static std::string read_line(const std::string &path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+/**
+ * CPUs the process may run on, in order
+ **/
+static std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    for (int c = 0; c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &set))
+        cpus.push_back(c);
+  if (cpus.empty())
+    cpus.push_back(0);
+  return cpus;
+}
+
+/**
+ * Reads the nodes from sysfs, keeping only the CPUs the process may run
+ * on; false, with a single node holding them all, where the system does
+ * not tell
+ **/
+bool numa_detect(NumaTopology *topology) {
+  std::vector<int> allowed = allowed_cpus();
+  std::vector<int> nodes =
+      parse_cpu_list(read_line("/sys/devices/system/node/online"));
+
+  topology->n_nodes = 0;
+  topology->simulated = false;
+  for (size_t i = 0; i < nodes.size() && topology->n_nodes < NUMA_MAX_NODES;
+       i++) {
+    std::string node = std::to_string(nodes[i]);
+    std::vector<int> cpus = parse_cpu_list(
+        read_line("/sys/devices/system/node/node" + node + "/cpulist"));
+    std::vector<int> &usable = topology->cpus[topology->n_nodes];
+    usable.clear();
+    for (size_t c = 0; c < cpus.size(); c++)
+      if (std::count(allowed.begin(), allowed.end(), cpus[c]) > 0)
+        usable.push_back(cpus[c]);
+    // Nodes of memory alone have no thread to serve
+    if (!usable.empty())
+      topology->n_nodes++;
+  }
+
+  if (topology->n_nodes > 0)
+    return true;
+  topology->n_nodes = 1;
+  topology->cpus[0] = allowed;
+  return false;
+}
+
+/**
+ * Splits the CPUs the process may run on into n_nodes runs, up to
+ * NUMA_MAX_NODES; with fewer CPUs than nodes, nodes share them.
+ **/
+void numa_simulate(NumaTopology *topology, int n_nodes) {
+  std::vector<int> allowed = allowed_cpus();
+  int n = (int)allowed.size();
+  n_nodes = std::max(1, std::min(n_nodes, NUMA_MAX_NODES));
+
+  topology->n_nodes = n_nodes;
+  topology->simulated = true;
+  for (int k = 0; k < n_nodes; k++) {
+    topology->cpus[k].clear();
+    if (n < n_nodes)
+      topology->cpus[k].push_back(allowed[k % n]);
+    else
+      topology->cpus[k].assign(allowed.begin() + (long)n * k / n_nodes,
+                               allowed.begin() +
+                                   (long)n * (k + 1) / n_nodes);
+  }
+}
+
+/**
+ * Topology a -numa option asks for: the nodes of the machine for "auto",
+ * else that many simulated ones
+ **/
+void numa_topology(const std::string &nodes, NumaTopology *topology) {
+  if (nodes != "auto")
+    numa_simulate(topology, std::stoi(nodes));
+  else if (!numa_detect(topology))
+    std::cerr << "No NUMA topology found, rendering on a single node"
+              << std::endl;
+}
+
+/**
+ * Lets the calling thread run on the CPUs of node only
+ **/
+bool numa_pin(const NumaTopology &topology, int node) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  const std::vector<int> &cpus = topology.cpus[node];
+  for (size_t c = 0; c < cpus.size(); c++)
+    CPU_SET(cpus[c], &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+/**
+ * Copies count T into arena, or just adds the room they take to bytes
+ * when arena is NULL. The copy is serial: it runs on a thread pinned to
+ * the node, which an OpenMP team would not be.
+ **/
+template <class T>
+static T *place(Arena *arena, size_t *bytes, const T *from, size_t count) {
+  if (arena == NULL) {
+    *bytes += arena_size(count * sizeof(T));
+    return NULL;
+  }
+  T *to = arena_array<T>(arena, count);
+  if (to != NULL)
+    memcpy(to, from, count * sizeof(T));
+  return to;
+}
+
+/**
+ * Copies every array the renderer reads from src into arena, pointing
+ * scene at the copies; with a NULL arena only adds up their size.
+ **/
+static void copy_scene(const Scene &src, Scene *scene, Arena *arena,
+                       size_t *bytes) {
+  *scene = src;
+  const TriangleSoA &tris = src.tris;
+  const SphereSoA &spheres = src.spheres;
+  float *block = place(arena, bytes, tris.px,
+                       (size_t)TRIANGLE_STREAMS * tris.padded);
+  if (arena != NULL)
+    attach_triangle_soa(&scene->tris, block, tris.count, tris.padded);
+  block = place(arena, bytes, spheres.x, (size_t)4 * spheres.padded);
+  if (arena != NULL)
+    attach_sphere_soa(&scene->spheres, block, spheres.count,
+                      spheres.padded);
+  scene->t_colors =
+      place(arena, bytes, src.t_colors, (size_t)tris.count * COLOR_BYTES);
+  scene->s_colors =
+      place(arena, bytes, src.s_colors, (size_t)spheres.count * COLOR_BYTES);
+  scene->lights =
+      place(arena, bytes, src.lights, (size_t)LIGHT_FLOATS * src.l_size);
+  scene->materials = place(arena, bytes, src.materials,
+                           (size_t)MATERIAL_FLOATS * src.n_materials);
+
+  const InstanceSet &set = src.instances;
+  scene->instances.meshes = place(arena, bytes, set.meshes, set.n_meshes);
+  for (int i = 0; i < set.n_meshes; i++) {
+    const Mesh &mesh = set.meshes[i];
+    block = place(arena, bytes, mesh.tris.px,
+                  (size_t)TRIANGLE_STREAMS * mesh.tris.padded);
+    BVHNode *nodes = place(arena, bytes, mesh.nodes, mesh.n_nodes);
+    if (arena == NULL)
+      continue;
+    Mesh &copy = scene->instances.meshes[i];
+    attach_triangle_soa(&copy.tris, block, mesh.tris.count,
+                        mesh.tris.padded);
+    copy.nodes = nodes;
+  }
+  scene->instances.list = place(arena, bytes, set.list, set.count);
+  scene->nodes = place(arena, bytes, src.nodes, src.n_nodes);
+
+  const UniformGrid &grid = src.grid;
+  if (grid.first != NULL) {
+    long long cells = grid_cells(grid);
+    scene->grid.first = place(arena, bytes, grid.first, cells + 1);
+    scene->grid.refs = place(arena, bytes, grid.refs, grid.first[cells]);
+    scene->grid.global = place(arena, bytes, grid.global, grid.n_global);
+  }
+
+  const LightGrid &lights = src.light_grid;
+  if (lights.first != NULL) {
+    int cells = lights.dims[0] * lights.dims[1] * lights.dims[2];
+    scene->light_grid.first = place(arena, bytes, lights.first, cells + 1);
+    scene->light_grid.lights =
+        place(arena, bytes, lights.lights, lights.first[cells]);
+  }
+  scene->light_grid.global =
+      place(arena, bytes, lights.global, lights.n_global);
+
+  if (arena != NULL)
+    scene->arena = *arena;
+}
+
+/**
+ * Copies scene once per node of numa->topology, each copy made by a
+ * thread of its own pinned to the node. The replicas share nothing with
+ * scene, which may be freed first; numa_free releases them.
+ **/
+void numa_replicate(NumaScenes *numa, const Scene &scene) {
+  double start = omp_get_wtime();
+  size_t bytes = 0;
+  Scene sizing;
+  copy_scene(scene, &sizing, NULL, &bytes);
+
+  std::vector<std::thread> threads;
+  for (int k = 0; k < numa->topology.n_nodes; k++)
+    threads.push_back(std::thread([numa, &scene, bytes, k]() {
+      numa_pin(numa->topology, k);
+      Arena arena;
+      arena_init(&arena, bytes);
+      size_t unused = 0;
+      copy_scene(scene, &numa->replicas[k], &arena, &unused);
+    }));
+  for (size_t k = 0; k < threads.size(); k++)
+    threads[k].join();
+  numa->time = omp_get_wtime() - start;
+}
+
+/**
+ * Frees the replicas, the topology is kept for the next ones
+ **/
+void numa_free(NumaScenes *numa) {
+  for (int k = 0; k < numa->topology.n_nodes; k++)
+    arena_free(&numa->replicas[k].arena);
+}
+
+void print_numa_topology(const NumaScenes &numa, std::ostream &out) {
+  const NumaTopology &topology = numa.topology;
+  out << "NUMA: " << topology.n_nodes << " nodes"
+      << (topology.simulated ? " (simulated)" : "") << ", replicas of "
+      << numa.replicas[0].arena.size * 1e-6 << " MB copied in " << numa.time
+      << " s" << std::endl;
+  for (int k = 0; k < topology.n_nodes; k++) {
+    out << "  node " << k << ": cpus " << format_cpu_list(topology.cpus[k])
+        << ", replica on "
+        << arena_backing_name(numa.replicas[k].arena.backing) << std::endl;
+  }
+}
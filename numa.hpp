@@ -0,0 +1,52 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "scene.hpp"
+
+#define NUMA_MAX_NODES 16
+
+/**
+ * Memory nodes of the machine and the CPUs on each, numbered from 0 in the
+ * order of the system. A simulated topology splits the CPUs the process
+ * may run on into that many nodes, so that NUMA mode can be tried on a
+ * machine with a single one; memory is then not actually apart.
+ **/
+struct NumaTopology {
+  int n_nodes;
+  bool simulated;
+  std::vector<int> cpus[NUMA_MAX_NODES];
+};
+
+/**
+ * A copy of the scene per node, for the threads of that node to read.
+ * Each replica lives in an arena of its own, allocated and first touched
+ * by a thread pinned to the node so that its pages are local to it.
+ **/
+struct NumaScenes {
+  NumaTopology topology;
+  Scene replicas[NUMA_MAX_NODES];
+  double time; // taken to copy every replica
+};
+
+/**
+ * Per node counters of a frame, over all its passes
+ **/
+struct NumaNodeStats {
+  int threads;
+  int tiles;
+  int remote; // tiles taken from the threads of another node
+  long long rays;
+  double busy; // seconds, summed over the threads of the node
+};
+
+bool numa_detect(NumaTopology *topology);
+void numa_simulate(NumaTopology *topology, int n_nodes);
+void numa_topology(const std::string &nodes, NumaTopology *topology);
+bool numa_pin(const NumaTopology &topology, int node);
+
+void numa_replicate(NumaScenes *numa, const Scene &scene);
+void numa_free(NumaScenes *numa);
+void print_numa_topology(const NumaScenes &numa, std::ostream &out);
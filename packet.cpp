@@ -0,0 +1,158 @@
+#include "packet.hpp"
+#include "mesh.hpp"
+#include "stats.hpp"
+
+#pragma omp declare target
+
+/**
+ * Interval arithmetic version of the slab test: with every inverse
+ * direction component inside [imin, imax], true only when the box is
+ * missed by all the rays of the packet or lies beyond t_max.
+ **/
+static bool packet_misses(const BVHNode *node, const float orig[],
+                          const float imin[], const float imax[],
+                          float t_max) {
+  float t0 = 0, t1 = t_max;
+  for (int k = 0; k < 3; k++) {
+    float lo = node->bmin[k] - orig[k], hi = node->bmax[k] - orig[k];
+    float a = lo * imin[k], b = lo * imax[k];
+    float c = hi * imin[k], d = hi * imax[k];
+    float near = a < b ? a : b, far = a > b ? a : b;
+    near = c < near ? c : near;
+    near = d < near ? d : near;
+    far = c > far ? c : far;
+    far = d > far ? d : far;
+    t0 = near > t0 ? near : t0;
+    t1 = far < t1 ? far : t1;
+  }
+  return t0 > t1;
+}
+
+static void single_rays(BVHNode *nodes, int root, TriangleSoA *tris,
+                        SphereSoA *spheres, InstanceSet *instances,
+                        RayPacket *packet, int *rays, int n) {
+  for (int k = 0; k < n; k++) {
+    int r = rays[k];
+    int hit = bvh_traverse(nodes, root, tris, spheres, instances,
+                           &packet->index[r], &packet->instance[r],
+                           &packet->t[r], packet->orig, packet->dir[r]);
+    if (hit != 0)
+      packet->hit[r] = hit;
+  }
+}
+
+/**
+ * Closest hit for every ray of the packet. Nodes are first culled for the
+ * whole packet with one interval test, then per ray; leaves are tested
+ * for the rays that reached them. Packets whose directions change sign
+ * on some axis have no useful interval and are traced as single rays.
+ **/
+void packet_intersect(BVHNode *nodes, TriangleSoA *tris, SphereSoA *spheres,
+                      InstanceSet *instances, RayPacket *packet) {
+  int n = packet->size;
+  int all[PACKET_MAX_RAYS];
+  float inv_dir[PACKET_MAX_RAYS][3];
+  float dmin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  float dmax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+  for (int r = 0; r < n; r++) {
+    packet->t[r] = FLT_MAX;
+    packet->hit[r] = 0;
+    all[r] = r;
+    for (int k = 0; k < 3; k++) {
+      float d = packet->dir[r][k];
+      inv_dir[r][k] = 1.0f / d;
+      dmin[k] = d < dmin[k] ? d : dmin[k];
+      dmax[k] = d > dmax[k] ? d : dmax[k];
+    }
+  }
+
+  bool coherent = true;
+  for (int k = 0; k < 3; k++)
+    coherent &= dmin[k] > 0 || dmax[k] < 0;
+
+  if (!coherent) {
+    single_rays(nodes, 0, tris, spheres, instances, packet, all, n);
+    return;
+  }
+
+  float imin[3], imax[3];
+  for (int k = 0; k < 3; k++) {
+    imin[k] = 1.0f / dmax[k];
+    imax[k] = 1.0f / dmin[k];
+  }
+
+  int stack[BVH_STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while (sp > 0) {
+    int node_id = stack[--sp];
+    STAT_ADD(node_visits, 1);
+    BVHNode *node = &nodes[node_id];
+
+    float t_max = 0;
+    for (int r = 0; r < n; r++)
+      t_max = packet->t[r] > t_max ? packet->t[r] : t_max;
+
+    if (packet_misses(node, packet->orig, imin, imax, t_max))
+      continue;
+
+    int active[PACKET_MAX_RAYS];
+    int n_active = 0;
+    for (int r = 0; r < n; r++) {
+      if (ray_box(node, packet->orig, inv_dir[r], packet->t[r]) != FLT_MAX)
+        active[n_active++] = r;
+    }
+
+    if (n_active == 0)
+      continue;
+
+    if (n_active < PACKET_MIN_ACTIVE * n) {
+      single_rays(nodes, node_id, tris, spheres, instances, packet, active,
+                  n_active);
+      continue;
+    }
+
+    if (node->count > 0) {
+      for (int k = 0; k < n_active; k++) {
+        int r = active[k];
+        if (node->type == BVH_TRIANGLE) {
+          if (triangles_closest(tris, node->first, node->count, packet->orig,
+                                packet->dir[r], &packet->t[r],
+                                &packet->index[r]))
+            packet->hit[r] = BVH_TRIANGLE;
+        } else if (node->type == BVH_SPHERE) {
+          if (spheres_closest(spheres, node->first, node->count, packet->orig,
+                              packet->dir[r], &packet->t[r],
+                              &packet->index[r]))
+            packet->hit[r] = BVH_SPHERE;
+        } else {
+          if (instances_closest(instances, node->first, node->count,
+                                packet->orig, packet->dir[r], &packet->t[r],
+                                &packet->index[r], &packet->instance[r]))
+            packet->hit[r] = BVH_INSTANCE;
+        }
+      }
+      continue;
+    }
+
+    // Visit first the child whose center is nearer to the shared origin
+    float dl = 0, dr = 0;
+    for (int k = 0; k < 3; k++) {
+      BVHNode *l = &nodes[node->first], *rn = &nodes[node->first + 1];
+      float cl = (l->bmin[k] + l->bmax[k]) * 0.5f - packet->orig[k];
+      float cr = (rn->bmin[k] + rn->bmax[k]) * 0.5f - packet->orig[k];
+      dl += cl * cl;
+      dr += cr * cr;
+    }
+    if (dl <= dr) {
+      stack[sp++] = node->first + 1;
+      stack[sp++] = node->first;
+    } else {
+      stack[sp++] = node->first;
+      stack[sp++] = node->first + 1;
+    }
+  }
+}
+#pragma omp end declare target
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <omp.h>
+
+#include "bvh.hpp"
+#include "simd.hpp"
+
+#define PACKET_MAX_SIZE 8
+#define PACKET_MAX_RAYS (PACKET_MAX_SIZE * PACKET_MAX_SIZE)
+
+// Once fewer than this share of the rays still hit a node, the survivors
+// finish the subtree one at a time
+#define PACKET_MIN_ACTIVE 0.25f
+
+#pragma omp declare target
+/**
+ * A tile of primary rays sharing the camera origin. Results are written
+ * back per ray, hit being 0 or the BVH_* type of what was hit as returned
+ * by check_intersection, instance only meaningful for BVH_INSTANCE.
+ **/
+struct RayPacket {
+  int size;
+  float orig[3];
+  float dir[PACKET_MAX_RAYS][3];
+  float t[PACKET_MAX_RAYS];
+  int index[PACKET_MAX_RAYS];
+  int instance[PACKET_MAX_RAYS];
+  int hit[PACKET_MAX_RAYS];
+};
+
+void packet_intersect(BVHNode *nodes, TriangleSoA *tris, SphereSoA *spheres,
+                      InstanceSet *instances, RayPacket *packet);
+#pragma omp end declare target
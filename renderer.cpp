@@ -1,194 +1,884 @@
 #include "renderer.hpp"
 
-#define KS 0.3
-#define KD 0.7
+#include <cstring>
+#include <vector>
+
+#define KS 0.3f
+#define KD 0.7f
 #define SPEC_HIGHLIGHT 20 // the bigger, the smaller the highlight will be
 
-void render(unsigned char *frameBuffer, int fov, float *tris,
-            unsigned char *color_tri, int t_size, float *spheres, float *radius,
-            unsigned char *color_sphere, int s_size, float *lights,
-            int l_size) {
-  float aspectRatio = (float)CANVAS_WIDTH / (float)CANVAS_HEIGHT;
-
-#pragma omp target map(                                                        \
-    to : fov, aspectRatio,                                                     \
-    tris[ : t_size * 9],                                                       \
-          color_tri[ : t_size * 3],                                            \
-                     spheres[ : s_size * 3],                                   \
-                              radius[ : s_size],                               \
-                                      color_sphere[ : s_size * 3],             \
-                                                    lights[ : l_size *         \
-                                                            3]) map(           \
-                                                        from : frameBuffer     \
-                                                        [ : 4 *                \
-                                                          CANVAS_HEIGHT        \
-                                                              *CANVAS_WIDTH])  \
-                                                            device(0)
-#pragma omp parallel for collapse(1) schedule(dynamic) shared(frameBuffer)
-  for (int i = 0; i < CANVAS_HEIGHT; i++) {
-#pragma omp target data map(from : frameBuffer[CANVAS_WIDTH *i *               \
-                                               4 : CANVAS_WIDTH *(i + 1) * 4])
-    for (int j = 0; j < CANVAS_WIDTH; j++) {
-
-      // Canvas to world transformation
-      float px = (2 * ((j + 0.5) / (float)CANVAS_WIDTH) - 1) *
-                 tan(fov * 0.5 * M_PI / 180) * aspectRatio;
-      float py = (1 - 2 * ((i + 0.5) / (float)CANVAS_HEIGHT)) *
-                 tan(fov * 0.5 * M_PI / 180);
-      float rayP[3] = {px, py, -1.0};
-      float orig[3] = {0.0, 0.0, 1.0};
-
-      // Ray direction
-      float dir[3];
-      sub_vec(rayP, orig, dir);
-      normalize(dir);
+#pragma omp declare target
 
-      // Get transformed framebuffer index
-      int fb_offset = CANVAS_WIDTH * i * 4 + j * 4;
-
-      // Initialize framebuffer pixel color
-      frameBuffer[fb_offset + 0] = 0;
-      frameBuffer[fb_offset + 1] = 0;
-      frameBuffer[fb_offset + 2] = 0;
-      frameBuffer[fb_offset + 3] = -1;
-
-      float P[3];
-      int index;
-
-      // Check to see if there is an intersection between the camera ray and
-      // all the objects
-      int check = check_intersection(tris, t_size, spheres, radius, s_size, P,
-                                     &index, orig, dir);
-      if (check != 0) {
-        float n[3];
-        unsigned char color[3];
-        switch (check) {
-        case 1:
-          normal(tris + index * 9, tris + index * 9 + 3, tris + index * 9 + 6,
-                 n);
-          copy_array<unsigned char>(color, color_tri + index * 3, 3);
-          break;
-        case 2:
-          sub_vec(P, spheres + index * 3, n);
-          copy_array<unsigned char>(color, color_sphere + index * 3, 3);
-          break;
-        }
-        normalize(n);
+/**
+ * Offset in [0, 1) of sample n inside its cell of pixel (x, y). It only
+ * depends on those, so a still frame renders the same every time and on
+ * any cluster worker. shade hashes hit points with it the same way.
+ **/
+static float sample_jitter(int x, int y, int n) {
+  unsigned int h = x * 0x8da6b343u ^ y * 0xd8163841u ^ n * 0xcb1ab31fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return (h >> 8) * (1.0f / (1 << 24));
+}
+
+/**
+ * The same for a point in space, from the bits of its coordinates
+ **/
+static float point_jitter(const float *P, int n) {
+  unsigned int bits[3];
+  memcpy(bits, P, sizeof(bits));
+  return sample_jitter(bits[0], bits[1], bits[2] ^ n);
+}
+
+/**
+ * Closest hit of any ray: returns its type (0 for none) and writes the
+ * point hit to P
+ **/
+static int closest_hit(Scene *scene, vec3 *P, int *index, int *instance,
+                       float *orig, float *dir) {
+  TriangleSoA *tris = &scene->tris;
+  SphereSoA *spheres = &scene->spheres;
+  int hit = 0;
+  float t_best = FLT_MAX;
+
+  if (scene->nodes != NULL) {
+    hit = bvh_intersect(scene->nodes, tris, spheres, &scene->instances, index,
+                        instance, &t_best, orig, dir);
+  } else if (scene->grid.first != NULL) {
+    hit = grid_intersect(&scene->grid, tris, spheres, &scene->instances,
+                         index, instance, &t_best, orig, dir);
+  } else {
+    if (triangles_closest(tris, 0, tris->count, orig, dir, &t_best, index))
+      hit = BVH_TRIANGLE;
+    if (spheres_closest(spheres, 0, spheres->count, orig, dir, &t_best, index))
+      hit = BVH_SPHERE;
+    if (instances_closest(&scene->instances, 0, scene->instances.count, orig,
+                          dir, &t_best, index, instance))
+      hit = BVH_INSTANCE;
+  }
+
+  if (hit != 0)
+    *P = load3(orig) + load3(dir) * t_best;
+
+  return hit;
+}
+
+/**
+ * Direction from P to light l, its distance and how much of the light
+ * reaches that far
+ **/
+static float light_direction(Scene *scene, int l, vec3 P, vec3 *rayDir,
+                             float *dist) {
+  const float *light = scene->lights + l * LIGHT_FLOATS;
+  vec3 d = load3(light) - P;
+  *dist = length(d);
+  *rayDir = normalize(d);
+  return light_falloff(*dist, light[3]);
+}
+
+/**
+ * What light l could at most give to a point of normal n at P, shadows
+ * left out, as a fraction of its color
+ **/
+static float light_weight(Scene *scene, int l, vec3 P, vec3 n) {
+  // Called on every candidate, so out of reach and facing away bail out
+  // before any square root
+  const float *light = scene->lights + l * LIGHT_FLOATS;
+  vec3 d = load3(light) - P;
+  float dist2 = dot(d, d);
+  if (light[3] > 0 && dist2 >= light[3] * light[3])
+    return 0;
+  float facing = dot(n, d);
+  if (facing <= 0)
+    return 0;
+  float dist = sqrtf(dist2);
+  return light_falloff(dist, light[3]) * facing / dist;
+}
+
+/**
+ * Adds weight times what light l gives to a point of normal n and the given
+ * color at P, seen along dir: nothing when it is out of reach or blocked.
+ **/
+static void add_light(vec3 *pixel, Scene *scene, int l, vec3 P, vec3 n,
+                      vec3 dir, vec3 color, float weight) {
+  // Ray from point to light
+  vec3 rayDir;
+  float lightDist;
+  float falloff = light_direction(scene, l, P, &rayDir, &lightDist);
+  if (falloff <= 0)
+    return;
+
+  // Calculate angle between the normal and the ray
+  // so we can calculate brightness
+  float angle = dot(n, rayDir);
+  angle = angle < 0 ? 0 : angle;
+
+  float lang = dot(reflect(-rayDir, n), -dir);
+  lang = lang < 0 ? 0 : lang;
+  float s = powf(lang, SPEC_HIGHLIGHT);
+
+  vec3 specular = color * s;
+  vec3 fColor = specular * KS + color * KD;
+
+  // If there are no objects between the point and the light, the point
+  // is lit by it
+  float orig[3], toward[3];
+  store3(orig, P);
+  store3(toward, rayDir);
+  if (!occluded(scene, orig, toward, lightDist))
+    *pixel += fColor * (angle * falloff * weight);
+}
+
+/**
+ * Normal, color and material index of what a ray along dir hit at P. The
+ * normal of a mesh faces the ray, as mesh winding is arbitrary; front
+ * tells whether the ray came from the side the normal points to before
+ * that, glass telling entering from leaving by it.
+ **/
+static int surface(int check, int index, int instance, vec3 P, vec3 dir,
+                   Scene *scene, vec3 *n, vec3 *color, bool *front) {
+  const unsigned char *bytes = NULL;
+  switch (check) {
+  case BVH_TRIANGLE: {
+    TriangleSoA *tris = &scene->tris;
+    *n = vec3{tris->nx[index], tris->ny[index], tris->nz[index]};
+    bytes = scene->t_colors + index * COLOR_BYTES;
+    break;
+  }
+  case BVH_SPHERE: {
+    SphereSoA *spheres = &scene->spheres;
+    *n = P - vec3{spheres->x[index], spheres->y[index], spheres->z[index]};
+    bytes = scene->s_colors + index * COLOR_BYTES;
+    break;
+  }
+  case BVH_INSTANCE: {
+    *n = instance_normal(&scene->instances, instance, index);
+    bytes = scene->instances.list[instance].color;
+    break;
+  }
+  }
+  *front = dot(*n, dir) < 0;
+  if (check == BVH_INSTANCE && !*front)
+    *n = -*n;
+  *n = normalize(*n);
+
+  *color = vec3{bytes[0] / 255.0f, bytes[1] / 255.0f, bytes[2] / 255.0f};
+  // An instance keeps its material right after its color
+  return bytes[3];
+}
+
+/**
+ * Adds what the lights give to a point of normal n and the given color at
+ * P, seen along dir
+ **/
+static void shade_lights(vec3 *pixel, vec3 P, vec3 n, vec3 dir, vec3 color,
+                         Scene *scene) {
+  // The grid lists every light, l_size alone tells when they are left out
+  if (scene->l_size <= 0)
+    return;
+  const LightGrid *grid = &scene->light_grid;
+  float p[3];
+  store3(p, P);
+  int cell = light_cell(grid, p);
+  int first = cell < 0 ? 0 : grid->first[cell];
+  int n_lights = grid->n_global;
+  if (cell >= 0)
+    n_lights += grid->first[cell + 1] - first;
+
+  // Lights without a radius come first, in scene order, then those of the
+  // cell of P
+  if (scene->light_samples <= 0 || n_lights <= scene->light_samples) {
+    for (int k = 0; k < n_lights; k++)
+      add_light(pixel, scene, light_candidate(grid, first, k), P, n, dir,
+                color, 1);
+    return;
+  }
+
+  // Too many: light_samples picks, systematic over the lights weighted by
+  // light_weight, with one jitter for all of them hashed from P
+  float total = 0;
+  for (int k = 0; k < n_lights; k++)
+    total += light_weight(scene, light_candidate(grid, first, k), P, n);
+  if (total <= 0)
+    return;
+
+  int picks = scene->light_samples;
+  float step = total / picks;
+  float next = point_jitter(p, 0) * step;
+  float sum = 0;
+  for (int k = 0; k < n_lights && next < total; k++) {
+    int l = light_candidate(grid, first, k);
+    float w = light_weight(scene, l, P, n);
+    sum += w;
+    int count = 0;
+    for (; next < sum; next += step)
+      count++;
+    // Each pick stands for step worth of weight
+    if (count > 0)
+      add_light(pixel, scene, l, P, n, dir, color, count * step / w);
+  }
+}
+
+/**
+ * A ray still to trace for a pixel, its color counting weight times. The
+ * ray itself is kept as the intersectors take it.
+ **/
+struct PendingRay {
+  float orig[3], dir[3];
+  vec3 weight;
+  int depth;
+};
+
+/**
+ * Pushes ray unless Russian roulette drops it: from scene->roulette bounces
+ * on, a ray whose largest weight w is under ROULETTE_WEIGHT goes on with a
+ * probability of w / ROULETTE_WEIGHT, weighing ROULETTE_WEIGHT when it does.
+ * Faint paths end early at the cost of some noise, on average the image is
+ * the same.
+ **/
+static int push_ray(PendingRay *stack, int top, PendingRay *ray, int branch,
+                    Scene *scene) {
+  vec3 w = ray->weight;
+  float p = fmaxf(w.x, fmaxf(w.y, w.z));
+  if (p <= 0 || top > MAX_RAY_DEPTH)
+    return top;
+  if (scene->roulette > 0 && ray->depth >= scene->roulette &&
+      p < ROULETTE_WEIGHT) {
+    float survive = p / ROULETTE_WEIGHT;
+    if (point_jitter(ray->orig, 2 * ray->depth + branch) >= survive) {
+      STAT_ADD(roulette_stopped, 1);
+      return top;
+    }
+    ray->weight = w * (1 / survive);
+  }
+  stack[top] = *ray;
+  return top + 1;
+}
+
+/**
+ * Pushes the mirror and glass rays leaving a hit at P of normal n, front
+ * and material as surface gave them, the hit weighing weight.
+ * Reflectivity goes to the mirror ray; transparency is split between the
+ * two by the Fresnel term, all of it reflected past the critical angle.
+ * Light through glass takes its color.
+ **/
+static int push_bounces(PendingRay *stack, int top, vec3 P, vec3 n, vec3 dir,
+                        vec3 color, bool front, const float *material,
+                        vec3 weight, int depth, Scene *scene) {
+  float reflectivity = material[0], transparency = material[1];
 
+  // Normal on the side the ray came from
+  float c = -dot(n, dir);
+  vec3 facing = n * (c < 0 ? -1 : 1);
+  c = fabsf(c);
+
+  PendingRay refracted;
+  float through = 0;
+  if (transparency > 0) {
+    float eta = front ? 1 / material[2] : material[2];
+    vec3 refr;
+    if (refract(dir, facing, eta, &refr)) {
+      // Schlick wants the angle on the side of the lower index
+      float c_out = -dot(refr, facing);
+      through = transparency * (1 - fresnel(eta > 1 ? c_out : c, eta));
+      store3(refracted.dir, refr);
+    }
+  }
+
+  PendingRay reflected;
+  store3(reflected.dir, reflect(dir, facing));
+  float mirror = reflectivity + transparency - through;
+  store3(reflected.orig, P + facing * SHADOW_EPSILON);
+  reflected.weight = weight * mirror;
+  store3(refracted.orig, P - facing * SHADOW_EPSILON);
+  refracted.weight = weight * through * color;
+  reflected.depth = refracted.depth = depth + 1;
+
+  top = push_ray(stack, top, &reflected, 0, scene);
+  if (through > 0)
+    top = push_ray(stack, top, &refracted, 1, scene);
+  return top;
+}
+
+/**
+ * Writes the color of one pixel given what its camera ray hit, as float
+ * RGBA where 1 is the full intensity of a scene color. Lights add up
+ * without clamping, tonemap decides what to do with the excess.
+ *
+ * Mirror and glass hits spawn more rays, up to scene->max_depth bounces.
+ * They are traced from a stack of fixed size rather than by recursion,
+ * which keeps the function fit for offloading; every hit adds what the
+ * lights give it, times its weight and the share of its material that is
+ * neither reflective nor transparent.
+ **/
+static void shade(float *pixel, int check, int index, int instance, vec3 P,
+                  vec3 dir, Scene *scene) {
+  // Initialize framebuffer pixel color
+  vec3 sum = {0, 0, 0};
+  pixel[3] = 1;
+
+  STAT_ADD(primary_hits, check != 0);
+  PendingRay stack[MAX_RAY_DEPTH + 2];
+  int top = 0;
+  vec3 weight = {1, 1, 1};
+  int depth = 0;
+
+  while (check != 0) {
+    vec3 n, color;
+    bool front;
+    int m = surface(check, index, instance, P, dir, scene, &n, &color, &front);
+    const float *material = scene->materials + m * MATERIAL_FLOATS;
+
+    float diffuse = 1 - material[0] - material[1];
+    if (diffuse > 0) {
+      vec3 lit = {0, 0, 0};
 #if !UNLIT
+      shade_lights(&lit, P, n, dir, color, scene);
+#else
+      lit = color;
+#endif
+      sum += weight * diffuse * lit;
+    }
+
+    if (depth < scene->max_depth && diffuse < 1)
+      top = push_bounces(stack, top, P, n, dir, color, front, material,
+                         weight, depth, scene);
 
-        // For all the lights in the world, check to see if
-        // the intersection point is lit by any of them
-        for (int l = 0; l < l_size; l++) {
-
-          // Ray from point to light
-          float rayDir[3];
-          sub_vec(lights + l * 3, P, rayDir);
-          normalize(rayDir);
-
-          // std::cout << (n)[0] << " " << (n)[1] << " " << (n)[2] << std::endl;
-
-          // Calculate angle between the normal and the ray
-          // so we can calculate brightness
-          float angle = dot_product(n, rayDir);
-          angle = angle < 0 ? 0 : angle;
-          unsigned char specular[3] = {0, 0, 0};
-
-          float zero[3] = {0, 0, 0};
-          float ml[3];
-          sub_vec(zero, rayDir, ml);
-          float r[3];
-          reflect(ml, n, r);
-          float ndir[3];
-          sub_vec(zero, dir, ndir);
-          float lang = dot_product(r, ndir);
-          lang = lang < 0 ? 0 : lang;
-          float s = pow(lang, SPEC_HIGHLIGHT);
-
-          specular[0] = color[0] * s;
-          specular[1] = color[1] * s;
-          specular[2] = color[2] * s;
-
-          float P1[3];
-          float fColor[3] = {specular[0] * KS + color[0] * KD,
-                             specular[1] * KS + color[1] * KD,
-                             specular[2] * KS + color[2] * KD};
-
-          // If there are no objects in the way of the ray, the point is lit by
-          // the light
-          if (check_intersection(tris, t_size, spheres, radius, s_size, P1,
-                                 &index, P, rayDir) == 0) {
-            frameBuffer[fb_offset + 0] = clamp<uint16_t>(
-                frameBuffer[fb_offset + 0] + fColor[0] * angle, 0, 255);
-            frameBuffer[fb_offset + 1] = clamp<uint16_t>(
-                frameBuffer[fb_offset + 1] + fColor[1] * angle, 0, 255);
-            frameBuffer[fb_offset + 2] = clamp<uint16_t>(
-                frameBuffer[fb_offset + 2] + fColor[2] * angle, 0, 255);
+    // Next ray that hits something, those that miss see black
+    check = 0;
+    while (top > 0 && check == 0) {
+      PendingRay &ray = stack[--top];
+      STAT_ADD(secondary_rays, 1);
+      check = closest_hit(scene, &P, &index, &instance, ray.orig, ray.dir);
+      dir = load3(ray.dir);
+      weight = ray.weight;
+      depth = ray.depth;
+    }
+  }
+  store3(pixel, sum);
+}
+#pragma omp end declare target
+
+/**
+ * Renders the pixels of one tile, in packet x packet blocks of primary
+ * rays when packet > 0.
+ **/
+static void render_tile(float *hdr, int width, Tile tile, CameraFrame *frame,
+                        int packet, Scene *scene) {
+  if (packet > 0) {
+    for (int i0 = tile.y0; i0 < tile.y1; i0 += packet) {
+      for (int j0 = tile.x0; j0 < tile.x1; j0 += packet) {
+        RayPacket rays;
+        int pixels[PACKET_MAX_RAYS][2];
+        rays.size = 0;
+        for (int i = i0; i < i0 + packet && i < tile.y1; i++) {
+          for (int j = j0; j < j0 + packet && j < tile.x1; j++) {
+            camera_ray(frame, j + 0.5f, i + 0.5f, rays.orig,
+                       rays.dir[rays.size]);
+            pixels[rays.size][0] = i;
+            pixels[rays.size][1] = j;
+            rays.size++;
           }
         }
 
-#else
-        frameBuffer[fb_offset + 0] =
-            clamp<int>(frameBuffer[fb_offset + 0] + color[0], 0, 255);
-        frameBuffer[fb_offset + 1] =
-            clamp<int>(frameBuffer[fb_offset + 1] + color[1], 0, 255);
-        frameBuffer[fb_offset + 2] =
-            clamp<int>(frameBuffer[fb_offset + 2] + color[2], 0, 255);
+        STAT_COST(traced);
+        packet_intersect(scene->nodes, &scene->tris, &scene->spheres,
+                         &scene->instances, &rays);
+        STAT_ADD(primary_rays, rays.size);
+#ifdef USE_STATS
+        // Traversal is shared, each pixel gets an even part of it
+        long long share = (stats_cost() - traced) / rays.size;
 #endif
+
+        for (int r = 0; r < rays.size; r++) {
+          STAT_COST(shaded);
+          vec3 P, dir = load3(rays.dir[r]);
+          if (rays.hit[r] != 0)
+            P = load3(rays.orig) + dir * rays.t[r];
+
+          int fb_offset = width * pixels[r][0] * 4 + pixels[r][1] * 4;
+          shade(hdr + fb_offset, rays.hit[r], rays.index[r],
+                rays.instance[r], P, dir, scene);
+          STAT_PIXEL(pixels[r][1], pixels[r][0], shaded - share);
+        }
+      }
+    }
+    return;
+  }
+
+  for (int i = tile.y0; i < tile.y1; i++) {
+    for (int j = tile.x0; j < tile.x1; j++) {
+      STAT_COST(traced);
+      float orig[3], dir[3];
+      camera_ray(frame, j + 0.5f, i + 0.5f, orig, dir);
+
+      vec3 P;
+      int index, instance;
+
+      // Check to see if there is an intersection between the camera ray
+      // and all the objects
+      int check = check_intersection(scene, &P, &index, &instance, orig, dir);
+
+      // Get transformed framebuffer index
+      int fb_offset = width * i * 4 + j * 4;
+      shade(hdr + fb_offset, check, index, instance, P, load3(dir), scene);
+      STAT_PIXEL(j, i, traced);
+    }
+  }
+}
+
+/**
+ * One progressive pass over a tile: traces the pixels on a stride grid,
+ * skipping those already traced on the coarser skip grid, and paints each
+ * sample over its stride x stride block. Returns the pixels traced.
+ **/
+static int render_tile_strided(float *hdr, int width, Tile tile,
+                               CameraFrame *frame, int stride, int skip,
+                               Scene *scene) {
+  int traced_pixels = 0;
+  for (int i = tile.y0; i < tile.y1; i += stride) {
+    for (int j = tile.x0; j < tile.x1; j += stride) {
+      if (skip > 0 && i % skip == 0 && j % skip == 0)
+        continue;
+
+      STAT_COST(traced);
+      float orig[3], dir[3];
+      camera_ray(frame, j + 0.5f, i + 0.5f, orig, dir);
+
+      vec3 P;
+      int index, instance;
+      int check = check_intersection(scene, &P, &index, &instance, orig, dir);
+
+      float *pixel = hdr + width * i * 4 + j * 4;
+      shade(pixel, check, index, instance, P, load3(dir), scene);
+      STAT_PIXEL(j, i, traced);
+      traced_pixels++;
+
+      for (int bi = i; bi < i + stride && bi < tile.y1; bi++) {
+        for (int bj = j; bj < j + stride && bj < tile.x1; bj++) {
+          if (bi != i || bj != j)
+            copy_array(hdr + width * bi * 4 + bj * 4, pixel, 4);
+        }
       }
     }
   }
+  return traced_pixels;
 }
 
-#pragma omp declare target
+/**
+ * Replaces pixel (x, y) by the average of grid x grid samples, one
+ * jittered in each cell of the pixel (stratified sampling), traced as a
+ * single packet when packets is set.
+ **/
+static void supersample_pixel(float *pixel, int x, int y, int grid,
+                              CameraFrame *frame, bool packets,
+                              Scene *scene) {
+  RayPacket rays;
+  rays.size = grid * grid;
+  float cell = 1.0f / grid;
+  for (int s = 0; s < rays.size; s++)
+    camera_ray(frame, x + (s % grid + sample_jitter(x, y, 2 * s)) * cell,
+               y + (s / grid + sample_jitter(x, y, 2 * s + 1)) * cell,
+               rays.orig, rays.dir[s]);
 
-int check_intersection(float *tris, int t_size, float *spheres, float *radius,
-                       int s_size, float *P, int *index, float *orig,
-                       float *dir) {
-  int i, index_tri, index_s;
+  vec3 P[PACKET_MAX_RAYS];
+  if (packets) {
+    packet_intersect(scene->nodes, &scene->tris, &scene->spheres,
+                     &scene->instances, &rays);
+    STAT_ADD(primary_rays, rays.size);
+    for (int s = 0; s < rays.size; s++)
+      if (rays.hit[s] != 0)
+        P[s] = load3(rays.orig) + load3(rays.dir[s]) * rays.t[s];
+  } else {
+    for (int s = 0; s < rays.size; s++)
+      rays.hit[s] = check_intersection(scene, &P[s], &rays.index[s],
+                                       &rays.instance[s], rays.orig,
+                                       rays.dir[s]);
+  }
 
-  int t_has_intersected = false;
-  int s_has_intersected = false;
+  vec3 sum = {0, 0, 0};
+  for (int s = 0; s < rays.size; s++) {
+    float sample[4];
+    shade(sample, rays.hit[s], rays.index[s], rays.instance[s], P[s],
+          load3(rays.dir[s]), scene);
+    sum += load3(sample);
+  }
 
-  float p_triangle[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
-  float p_sphere[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  store3(pixel, sum / (float)rays.size);
+  pixel[3] = 1;
+}
 
-  for (i = 0; i < t_size; i++) {
-    if (rayTriangleIntersects(orig, dir, tris + i * 9, tris + i * 9 + 3,
-                              tris + i * 9 + 6, P)) {
-      if (length(p_triangle) > length(P)) {
-        index_tri = i;
-        t_has_intersected = true;
+/**
+ * Anti-aliases one tile with grid x grid samples per pixel. Adaptive, with
+ * a threshold, a pixel keeps its centre sample unless some channel of its
+ * 3 x 3 neighbourhood spans more than threshold, which catches silhouettes
+ * and shadow borders and leaves flat areas alone. Neighbours across the
+ * tile border are traced again here so tiles stay independent. With
+ * traced, the centre samples are already in hdr. Returns the pixels
+ * supersampled and adds the primary rays traced to rays.
+ **/
+static int supersample_tile(float *hdr, int width, int height, Tile tile,
+                            CameraFrame *frame, int grid, int threshold,
+                            int packet, bool traced, Scene *scene,
+                            long long *rays) {
+  int tile_pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+  bool packets = packet > 0;
 
-        copy_array(p_triangle, P, 3);
+  if (threshold <= 0) {
+    for (int i = tile.y0; i < tile.y1; i++) {
+      for (int j = tile.x0; j < tile.x1; j++) {
+        STAT_COST(traced_cost);
+        supersample_pixel(hdr + width * i * 4 + j * 4, j, i, grid,
+                          frame, packets, scene);
+        STAT_PIXEL(j, i, traced_cost);
       }
     }
+    *rays += (long long)tile_pixels * grid * grid;
+    return tile_pixels;
   }
 
-  for (i = 0; i < s_size; i++) {
-    if (raySphereIntersects(orig, dir, spheres + i * 3, radius[i], P)) {
-      if (length(p_sphere) > length(P)) {
-        index_s = i;
-        s_has_intersected = true;
+  if (!traced) {
+    render_tile(hdr, width, tile, frame, packet, scene);
+    *rays += tile_pixels;
+  }
 
-        copy_array(p_sphere, P, 3);
+  // The centre samples of the tile and of the pixels around it
+  int w = tile.x1 - tile.x0 + 2, h = tile.y1 - tile.y0 + 2;
+  std::vector<float> around((size_t)w * h * 4);
+  for (int i = 0; i < h; i++) {
+    for (int j = 0; j < w; j++) {
+      int y = tile.y0 - 1 + i, x = tile.x0 - 1 + j;
+      float *p = &around[(i * w + j) * 4];
+      int cy = clamp(y, tile.y0, tile.y1 - 1);
+      int cx = clamp(x, tile.x0, tile.x1 - 1);
+      if ((cx == x && cy == y) || x < 0 || y < 0 || x >= width ||
+          y >= height) {
+        copy_array(p, hdr + width * cy * 4 + cx * 4, 4);
+        continue;
       }
+
+      // Charged to the pixel of this tile that needed it
+      STAT_COST(traced_cost);
+      float orig[3], dir[3];
+      vec3 P;
+      int index, instance;
+      camera_ray(frame, x + 0.5f, y + 0.5f, orig, dir);
+      int check = check_intersection(scene, &P, &index, &instance, orig, dir);
+      shade(p, check, index, instance, P, load3(dir), scene);
+      STAT_PIXEL(cx, cy, traced_cost);
+      (*rays)++;
     }
   }
 
-  if (!t_has_intersected && !s_has_intersected)
-    return 0;
-  if (length(p_triangle) <= length(p_sphere)) {
-    copy_array(P, p_triangle, 3);
-    *index = index_tri;
-    return 1;
+  int refined = 0;
+  for (int i = 1; i < h - 1; i++) {
+    for (int j = 1; j < w - 1; j++) {
+      // Contrast as it would show on screen, before exposure
+      float lo[3] = {1, 1, 1}, hi[3] = {0, 0, 0};
+      for (int di = -1; di <= 1; di++) {
+        for (int dj = -1; dj <= 1; dj++) {
+          const float *p = &around[((i + di) * w + j + dj) * 4];
+          for (int c = 0; c < 3; c++) {
+            float v = clamp(p[c], 0.0f, 1.0f);
+            lo[c] = std::min(lo[c], v);
+            hi[c] = std::max(hi[c], v);
+          }
+        }
+      }
+      float limit = threshold / 255.0f;
+      if (hi[0] - lo[0] <= limit && hi[1] - lo[1] <= limit &&
+          hi[2] - lo[2] <= limit)
+        continue;
+
+      int y = tile.y0 - 1 + i, x = tile.x0 - 1 + j;
+      STAT_COST(traced_cost);
+      supersample_pixel(hdr + width * y * 4 + x * 4, x, y, grid,
+                        frame, packets, scene);
+      STAT_PIXEL(x, y, traced_cost);
+      refined++;
+    }
+  }
+  *rays += (long long)refined * grid * grid;
+  return refined;
+}
+
+/**
+ * Side of the sample grid of settings.samples, rounded down to a square
+ **/
+static int aa_grid(const RenderSettings &settings) {
+  int grid = 1;
+  while (grid < AA_MAX_GRID && (grid + 1) * (grid + 1) <= settings.samples)
+    grid++;
+  return grid;
+}
+
+/**
+ * Renders the scene into hdr, a settings.width x settings.height float RGBA
+ * image, and tonemaps every finished tile into the ARGB8888 frameBuffer
+ * unless it is NULL. The frame is cut into tiles handed out by a work
+ * stealing TileScheduler; with a packet size and a BVH, primary rays are
+ * traced together in packet x packet blocks inside each tile.
+ *
+ * With settings.progressive > 1 the frame is first traced on a grid of
+ * that stride, then on grids half as coarse down to single pixels, every
+ * pixel being traced exactly once over all passes. Finished tiles are
+ * published to dirty when given, so a viewer can upload just those.
+ *
+ * With settings.samples > 1 every finished tile is anti-aliased by
+ * supersample_tile, on all its pixels or, with settings.aa_threshold, on
+ * those at an edge only.
+ *
+ * With settings.light_samples, hit points reached by more lights than that
+ * shade just that many of them, picked in proportion to what they could
+ * give.
+ *
+ * Setting cancel, when given, makes the workers stop after their current
+ * tile; the frame is then left unfinished and marked cancelled.
+ *
+ * With numa, the threads are split over its nodes and pinned to them,
+ * each reading the replica of the scene of its node, and the frame is cut
+ * into a band of rows per node: the threads of a node write theirs, which
+ * they first touch, and only take tiles of another band once theirs is
+ * done.
+ *
+ * Returns the timings, print_render_stats formats them.
+ **/
+RenderStats render(float *hdr, unsigned char *frameBuffer, Camera camera,
+                   RenderSettings settings, Scene scene,
+                   DirtyTileQueue *dirty, const std::atomic<bool> *cancel,
+                   const NumaScenes *numa) {
+  int width = settings.width, height = settings.height;
+  int packet = settings.packet;
+
+  CameraFrame frame;
+  camera_frame(camera, width, height, &frame);
+  scene.light_samples = settings.light_samples;
+  scene.max_depth = clamp(settings.max_depth, 0, MAX_RAY_DEPTH);
+  scene.roulette = settings.roulette;
+
+  if (scene.nodes == NULL || packet > PACKET_MAX_SIZE)
+    packet = 0;
+
+  int stride = 1;
+  while (stride * 2 <= settings.progressive)
+    stride *= 2;
+
+  // Tiles are made of whole packets and whole coarse blocks
+  int tile_size = settings.tile_size > 0 ? settings.tile_size : 1;
+  int unit = packet > stride ? packet : stride;
+  tile_size = (tile_size + unit - 1) / unit * unit;
+
+  int grid = aa_grid(settings);
+  int threshold = grid > 1 ? settings.aa_threshold : 0;
+
+  RenderStats stats = RenderStats();
+  stats.pixels = (long long)width * height;
+  stats.tile_size = tile_size;
+  stats.tile_order = settings.tile_order;
+  stats.samples = grid * grid;
+  stats.aa_threshold = threshold;
+  long long rays = 0, supersampled = 0;
+  int n_nodes = numa != NULL ? numa->topology.n_nodes : 1;
+
+#ifdef USE_STATS
+  stats_begin_frame(width, height);
+#endif
+  double start = omp_get_wtime();
+
+  for (int skip = 0; stride >= 1; skip = stride, stride /= 2) {
+    TileScheduler scheduler(width, height, tile_size, settings.tile_order,
+                            omp_get_max_threads(), n_nodes);
+
+#pragma omp parallel shared(hdr, frameBuffer, scheduler, scene, frame)       \
+    reduction(+ : rays, supersampled)
+    {
+      int worker = omp_get_thread_num();
+      int node = scheduler.group(worker);
+      Scene *view = &scene;
+      Scene local;
+      if (numa != NULL) {
+        numa_pin(numa->topology, node);
+        local = numa->replicas[node];
+        local.light_samples = scene.light_samples;
+        local.max_depth = scene.max_depth;
+        local.roulette = scene.roulette;
+        view = &local;
+      }
+
+      Tile tile;
+      while (!(cancel != NULL && *cancel) && scheduler.next(worker, tile)) {
+        double tile_start = omp_get_wtime();
+        if (stride > 1 || skip > 0)
+          rays += render_tile_strided(hdr, width, tile, &frame, stride, skip,
+                                      view);
+
+        // Supersampling refines a tile once all its centres are traced
+        if (stride == 1 && grid > 1)
+          supersampled += supersample_tile(hdr, width, height, tile, &frame,
+                                           grid, threshold, packet, skip > 0,
+                                           view, &rays);
+        else if (stride == 1 && skip == 0) {
+          render_tile(hdr, width, tile, &frame, packet, view);
+          rays += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        }
+
+        if (frameBuffer != NULL)
+          tonemap(hdr, width, tile,
+                  frameBuffer + ((size_t)tile.y0 * width + tile.x0) * 4,
+                  width * 4, settings.tonemap, settings.exposure);
+        scheduler.add_busy(worker, omp_get_wtime() - tile_start);
+        STAT_TILE(tile, omp_get_wtime() - tile_start);
+
+        if (dirty != NULL)
+          dirty->push(tile);
+      }
+
+      // This thread's share of the reductions so far in the pass
+      if (numa != NULL) {
+#pragma omp atomic
+        stats.nodes[node].rays += rays;
+      }
+    }
+
+    for (int w = 0; numa != NULL && w < omp_get_max_threads(); w++) {
+      NumaNodeStats &node = stats.nodes[scheduler.group(w)];
+      int done, remote;
+      double busy;
+      scheduler.totals(w, &done, &remote, &busy);
+      node.threads += skip == 0;
+      node.tiles += done;
+      node.remote += remote;
+      node.busy += busy;
+    }
+
+    stats.time = omp_get_wtime() - start;
+    if (cancel != NULL && *cancel) {
+      stats.cancelled = true;
+      break;
+    }
+    if (skip == 0 && stride > 1) {
+      stats.first_pass = stats.time;
+      stats.first_stride = stride;
+    }
+
+    if (stride == 1) {
+      stats.packets = packet > 0 && skip == 0;
+      stats.tiles = scheduler.size();
+      if (settings.thread_report)
+        scheduler.report(stats.time, std::cout);
+    }
   }
-  if (length(p_triangle) > length(p_sphere)) {
-    copy_array(P, p_sphere, 3);
-    *index = index_s;
-    return 2;
+  stats.rays = rays;
+  stats.supersampled = supersampled;
+  stats.numa_nodes = numa != NULL ? n_nodes : 0;
+#ifdef USE_STATS
+  stats_end_frame(stats.time);
+#endif
+  return stats;
+}
+
+/**
+ * Renders just the given tiles of the frame into hdr, spread over the
+ * threads, for callers that hand out tiles themselves.
+ **/
+void render_tiles(float *hdr, const Tile *tiles, int n_tiles,
+                  Camera camera, RenderSettings settings, Scene scene) {
+  CameraFrame frame;
+  camera_frame(camera, settings.width, settings.height, &frame);
+  scene.light_samples = settings.light_samples;
+  scene.max_depth = clamp(settings.max_depth, 0, MAX_RAY_DEPTH);
+  scene.roulette = settings.roulette;
+
+  int packet = settings.packet;
+  if (scene.nodes == NULL || packet > PACKET_MAX_SIZE)
+    packet = 0;
+
+  int grid = aa_grid(settings);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < n_tiles; i++) {
+    if (grid > 1) {
+      long long rays = 0;
+      supersample_tile(hdr, settings.width, settings.height, tiles[i], &frame,
+                       grid, settings.aa_threshold, packet, false, &scene,
+                       &rays);
+    } else
+      render_tile(hdr, settings.width, tiles[i], &frame, packet, &scene);
+  }
+}
+
+void print_render_stats(const RenderStats &stats, std::ostream &out) {
+  if (stats.first_stride > 1)
+    out << "First Pass Time: " << stats.first_pass << " s (1/"
+        << stats.first_stride * stats.first_stride << " of the pixels)"
+        << std::endl;
+
+  out << "Render Time: " << stats.time << " s ("
+      << stats.rays / stats.time * 1e-6 << " Mrays/s primary, "
+      << (stats.packets ? "packets" : "single rays") << ", " << stats.tiles
+      << " " << stats.tile_size << "x" << stats.tile_size << " "
+      << tile_order_name(stats.tile_order) << " tiles)" << std::endl;
+
+  if (stats.samples > 1) {
+    out << "Anti-aliasing: " << stats.samples << " samples on ";
+    if (stats.aa_threshold > 0)
+      out << 100.0 * stats.supersampled / stats.pixels
+          << "% of the pixels (adaptive, contrast above "
+          << stats.aa_threshold << ")";
+    else
+      out << "every pixel";
+    out << ", " << (double)stats.rays / stats.pixels << " rays per pixel"
+        << std::endl;
   }
 
-  return 0;
+  for (int k = 0; k < stats.numa_nodes; k++) {
+    const NumaNodeStats &n = stats.nodes[k];
+    out << "  node " << k << ": " << n.threads << " threads, " << n.tiles
+        << " tiles (" << n.remote << " from other nodes), "
+        << n.rays / stats.time * 1e-6 << " Mrays/s primary, busy "
+        << (n.threads > 0 ? 100 * n.busy / (n.threads * stats.time) : 0)
+        << "%" << std::endl;
+  }
+}
+
+#pragma omp declare target
+
+/**
+ * Closest hit along a camera ray
+ **/
+int check_intersection(Scene *scene, vec3 *P, int *index, int *instance,
+                       float *orig, float *dir) {
+  STAT_ADD(primary_rays, 1);
+  return closest_hit(scene, P, index, instance, orig, dir);
+}
+
+
+/**
+ * Any-hit query for shadow rays: returns as soon as anything is found
+ * between SHADOW_EPSILON and tmax along dir.
+ **/
+int occluded(Scene *scene, float *orig, float *dir, float tmax) {
+  TriangleSoA *tris = &scene->tris;
+  SphereSoA *spheres = &scene->spheres;
+  int blocked;
+
+  STAT_ADD(shadow_rays, 1);
+  if (scene->nodes != NULL)
+    blocked = bvh_occluded(scene->nodes, tris, spheres, &scene->instances,
+                           orig, dir, SHADOW_EPSILON, tmax);
+  else if (scene->grid.first != NULL)
+    blocked = grid_occluded(&scene->grid, tris, spheres, &scene->instances,
+                            orig, dir, SHADOW_EPSILON, tmax);
+  else
+    blocked = triangles_occluded(tris, 0, tris->count, orig, dir,
+                                 SHADOW_EPSILON, tmax) ||
+              spheres_occluded(spheres, 0, spheres->count, orig, dir,
+                               SHADOW_EPSILON, tmax) ||
+              instances_occluded(&scene->instances, 0, scene->instances.count,
+                                 orig, dir, SHADOW_EPSILON, tmax);
+  STAT_ADD(shadow_occluded, blocked);
+  return blocked;
 }
 #pragma omp end declare target
@@ -1,24 +1,53 @@
 #pragma once
 
+#include <atomic>
 #include <cfloat>
 #include <iostream>
 #include <limits.h>
 #include <omp.h>
 
+#include "bvh.hpp"
+#include "camera.hpp"
 #include "maths.hpp"
+#include "numa.hpp"
+#include "packet.hpp"
+#include "scene.hpp"
+#include "scheduler.hpp"
+#include "tile_queue.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
 
-#define CANVAS_HEIGHT 1440
-#define CANVAS_WIDTH 2560
-#define NUM_TRIANGLES 2
-#define NUM_LIGHTS 1
-#define NUM_SPHERES 900
+#define SHADOW_EPSILON 0.001f
 
-void render(unsigned char *frameBuffer, int fov, float *tris,
-            unsigned char *color_tri, int t_size, float *spheres, float *radius,
-            unsigned char *color_sphere, int s_size, float *lights, int l_size);
+// Samples of a supersampled pixel are traced as one packet
+#define AA_MAX_GRID PACKET_MAX_SIZE
+
+struct RenderStats {
+  double time;       // whole frame, every pass included
+  double first_pass; // time to the first coarse image when progressive
+  int first_stride;  // 0 unless progressive
+  long long pixels;
+  long long rays;         // primary, more than pixels when supersampling
+  long long supersampled; // pixels that got more than their centre sample
+  int samples;            // per supersampled pixel, 1 without anti-aliasing
+  int aa_threshold;
+  bool packets; // whether primary rays went in packets
+  int tiles, tile_size, tile_order;
+  bool cancelled; // stopped early, part of the frame is left as it was
+  int numa_nodes;  // 0 unless rendered NUMA aware, else per node:
+  NumaNodeStats nodes[NUMA_MAX_NODES];
+};
+
+RenderStats render(float *hdr, unsigned char *frameBuffer, Camera camera,
+                   RenderSettings settings, Scene scene,
+                   DirtyTileQueue *dirty, const std::atomic<bool> *cancel,
+                   const NumaScenes *numa);
+void render_tiles(float *hdr, const Tile *tiles, int n_tiles, Camera camera,
+                  RenderSettings settings, Scene scene);
+void print_render_stats(const RenderStats &stats, std::ostream &out);
 
 #pragma omp declare target
-int check_intersection(float *tris, int t_size, float *spheres, float *radius,
-                       int s_size, float *P, int *index, float *orig,
-                       float *dir);
+int check_intersection(Scene *scene, vec3 *P, int *index, int *instance,
+                       float *orig, float *dir);
+int occluded(Scene *scene, float *orig, float *dir, float tmax);
 #pragma omp end declare target
@@ -0,0 +1,144 @@
+#include "scene.hpp"
+
+#include <cstring>
+#include <vector>
+
+/**
+ * Builds the BVH when asked, which reorders the arrays, and moves the
+ * primitives into the SoA streams the renderer reads, over which the grid
+ * is built when asked instead. Every mesh is built once, with its own BVH
+ * unless accel is ACCEL_NONE, before the scene BVH or grid goes over its
+ * instances.
+ *
+ * The streams, colors, lights, materials, meshes, instances and BVHs then
+ * go to a single arena in that order, the busiest first; only the grids,
+ * rebuilt as things move, are allocated on their own. Every array given is
+ * freed once copied, so that the scene is not held twice, and meshes,
+ * which may be NULL, is emptied.
+ **/
+void prepare_scene(Scene *scene, float *tris, unsigned char *t_colors,
+                   int t_size, float *spheres, float *radius,
+                   unsigned char *s_colors, int s_size, float *lights,
+                   int l_size, float *materials, int n_materials,
+                   SceneMeshes *meshes, int accel) {
+  std::vector<Mesh> built;
+  std::vector<MeshInstance> list;
+  if (meshes != NULL) {
+    built.resize(meshes->meshes.size());
+    for (size_t i = 0; i < built.size(); i++) {
+      build_mesh(&built[i], meshes->meshes[i], accel != ACCEL_NONE);
+      std::vector<float>().swap(meshes->meshes[i].vertices);
+      std::vector<unsigned int>().swap(meshes->meshes[i].indices);
+    }
+    list.swap(meshes->instances);
+    meshes->meshes.clear();
+  }
+
+  BVHNode *nodes = NULL;
+  int n_nodes = 0;
+  if (accel == ACCEL_BVH)
+    n_nodes = build_bvh(&nodes, tris, t_colors, t_size, spheres, radius,
+                        s_colors, s_size, list.data(), list.size(),
+                        built.data());
+
+  int t_padded = soa_padded(t_size), s_padded = soa_padded(s_size);
+  size_t bytes =
+      arena_size(sizeof(float) * TRIANGLE_STREAMS * t_padded) +
+      arena_size(sizeof(float) * 4 * s_padded) +
+      arena_size((size_t)t_size * COLOR_BYTES) +
+      arena_size((size_t)s_size * COLOR_BYTES) +
+      arena_size(sizeof(float) * LIGHT_FLOATS * l_size) +
+      arena_size(sizeof(float) * MATERIAL_FLOATS * n_materials) +
+      arena_size(sizeof(Mesh) * built.size()) +
+      arena_size(sizeof(MeshInstance) * list.size()) +
+      arena_size(sizeof(BVHNode) * n_nodes);
+  for (size_t i = 0; i < built.size(); i++)
+    bytes += arena_size(sizeof(float) * TRIANGLE_STREAMS *
+                        built[i].tris.padded) +
+             arena_size(sizeof(BVHNode) * built[i].n_nodes);
+  Arena *arena = &scene->arena;
+  arena_init(arena, bytes);
+
+  fill_triangle_soa(&scene->tris,
+                    arena_array<float>(arena, TRIANGLE_STREAMS * t_padded),
+                    tris, t_size);
+  delete[] tris;
+  fill_sphere_soa(&scene->spheres, arena_array<float>(arena, 4 * s_padded),
+                  spheres, radius, s_size);
+  delete[] spheres;
+  delete[] radius;
+  scene->t_colors =
+      arena_copy(arena, t_colors, (size_t)t_size * COLOR_BYTES);
+  delete[] t_colors;
+  scene->s_colors =
+      arena_copy(arena, s_colors, (size_t)s_size * COLOR_BYTES);
+  delete[] s_colors;
+  scene->lights = arena_copy(arena, lights, LIGHT_FLOATS * l_size);
+  scene->l_size = l_size;
+  delete[] lights;
+  scene->materials =
+      arena_copy(arena, materials, MATERIAL_FLOATS * n_materials);
+  scene->n_materials = n_materials;
+  delete[] materials;
+
+  InstanceSet &set = scene->instances;
+  set.n_meshes = built.size();
+  set.meshes = arena_copy(arena, built.data(), built.size());
+  for (int i = 0; i < set.n_meshes; i++) {
+    Mesh &mesh = set.meshes[i];
+    float *block = arena_copy(arena, built[i].tris.px,
+                              TRIANGLE_STREAMS * mesh.tris.padded);
+    attach_triangle_soa(&mesh.tris, block, mesh.tris.count,
+                        mesh.tris.padded);
+    mesh.nodes = arena_copy(arena, built[i].nodes, mesh.n_nodes);
+    free_mesh(&built[i]);
+  }
+  set.count = list.size();
+  set.list = arena_copy(arena, list.data(), list.size());
+
+  scene->nodes = arena_copy(arena, nodes, n_nodes);
+  scene->n_nodes = n_nodes;
+  delete[] nodes;
+
+  scene->grid.first = scene->grid.refs = scene->grid.global = NULL;
+  if (accel == ACCEL_GRID)
+    build_grid(&scene->grid, &scene->tris, &scene->spheres, &set);
+  build_light_grid(&scene->light_grid, scene->lights, l_size);
+  scene->light_samples = 0;
+  scene->max_depth = scene->roulette = 0;
+}
+
+/**
+ * Frees a scene prepare_scene built, not one mapped from a file
+ **/
+void free_scene(Scene *scene) {
+  free_light_grid(&scene->light_grid);
+  free_grid(&scene->grid);
+  arena_free(&scene->arena);
+  memset(&scene->tris, 0, sizeof(scene->tris));
+  memset(&scene->spheres, 0, sizeof(scene->spheres));
+  memset(&scene->instances, 0, sizeof(scene->instances));
+  scene->t_colors = scene->s_colors = NULL;
+  scene->lights = scene->materials = NULL;
+  scene->l_size = scene->n_materials = 0;
+  scene->nodes = NULL;
+  scene->n_nodes = 0;
+}
+
+int accel_type(const std::string &name) {
+  if (name == "grid")
+    return ACCEL_GRID;
+  if (name == "none")
+    return ACCEL_NONE;
+  return ACCEL_BVH;
+}
+
+const char *accel_name(int accel) {
+  switch (accel) {
+  case ACCEL_NONE:
+    return "none";
+  case ACCEL_GRID:
+    return "grid";
+  }
+  return "bvh";
+}
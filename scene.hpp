@@ -0,0 +1,58 @@
+#pragma once
+
+#include <omp.h>
+#include <string>
+
+#include "arena.hpp"
+#include "bvh.hpp"
+#include "grid.hpp"
+#include "lights.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "simd.hpp"
+
+// Acceleration structures over the primitives, meshes keep their BVH but
+// with ACCEL_NONE
+#define ACCEL_NONE 0
+#define ACCEL_BVH 1
+#define ACCEL_GRID 2
+
+#pragma omp declare target
+/**
+ * What the renderer reads: primitives, colors, lights, mesh instances and
+ * either the BVH or the uniform grid over them. nodes is NULL without a
+ * BVH, grid.first without a grid; rays are tested against every primitive
+ * when there is neither.
+ * Lights hold LIGHT_FLOATS values each, light_grid tells which of them
+ * reach a point. Colors hold COLOR_BYTES, the last one indexing materials.
+ **/
+struct Scene {
+  TriangleSoA tris;
+  unsigned char *t_colors;
+  SphereSoA spheres;
+  unsigned char *s_colors;
+  InstanceSet instances;
+  float *lights;
+  int l_size;
+  LightGrid light_grid;
+  int light_samples; // lights sampled per hit point, 0 for all; per frame
+  float *materials;
+  int n_materials;
+  int max_depth; // bounces traced, per frame like roulette
+  int roulette;  // bounce from which paths may be cut short, 0 for never
+  BVHNode *nodes;
+  int n_nodes;
+  UniformGrid grid;
+  Arena arena; // what prepare_scene allocated, empty for mapped files
+};
+#pragma omp end declare target
+
+void prepare_scene(Scene *scene, float *tris, unsigned char *t_colors,
+                   int t_size, float *spheres, float *radius,
+                   unsigned char *s_colors, int s_size, float *lights,
+                   int l_size, float *materials, int n_materials,
+                   SceneMeshes *meshes, int accel);
+void free_scene(Scene *scene);
+
+int accel_type(const std::string &name);
+const char *accel_name(int accel);
@@ -0,0 +1,393 @@
+#include "scene_file.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static long long align_up(long long offset) {
+  return (offset + SCENE_ALIGN - 1) / SCENE_ALIGN * SCENE_ALIGN;
+}
+
+/**
+ * Byte size of every section for the counts in header
+ **/
+static void section_sizes(const SceneFileHeader &header,
+                          long long size[SCENE_SECTIONS]) {
+  size[SECTION_TRIANGLES] =
+      (long long)TRIANGLE_STREAMS * header.t_padded * sizeof(float);
+  size[SECTION_T_COLORS] = (long long)COLOR_BYTES * header.t_size;
+  size[SECTION_SPHERES] = 4LL * header.s_padded * sizeof(float);
+  size[SECTION_S_COLORS] = (long long)COLOR_BYTES * header.s_size;
+  size[SECTION_LIGHTS] =
+      (long long)LIGHT_FLOATS * header.l_size * sizeof(float);
+  size[SECTION_NODES] = (long long)header.n_nodes * sizeof(BVHNode);
+  size[SECTION_INSTANCES] = (long long)header.i_size * sizeof(MeshInstance);
+  size[SECTION_MESHES] = (long long)header.n_meshes * sizeof(SceneFileMesh);
+  size[SECTION_MATERIALS] =
+      (long long)MATERIAL_FLOATS * header.n_materials * sizeof(float);
+}
+
+static long long mesh_tris_size(const SceneFileMesh &mesh) {
+  return (long long)TRIANGLE_STREAMS * mesh.t_padded * sizeof(float);
+}
+
+static long long mesh_nodes_size(const SceneFileMesh &mesh) {
+  return (long long)mesh.n_nodes * sizeof(BVHNode);
+}
+
+bool is_scene_binary(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(SCENE_MAGIC)];
+  if (!file.read(magic, sizeof(magic)))
+    return false;
+  return memcmp(magic, SCENE_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Writes the scene file to out, which may as well be a socket buffer as a
+ * file. Returns whether out took it all.
+ **/
+bool write_scene_stream(std::ostream &out, const Scene &scene,
+                        const Camera &camera, const RenderSettings &settings) {
+  SceneFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+  header.version = SCENE_VERSION;
+  header.byte_order = SCENE_BYTE_ORDER;
+  header.t_size = scene.tris.count;
+  header.t_padded = scene.tris.padded;
+  header.s_size = scene.spheres.count;
+  header.s_padded = scene.spheres.padded;
+  header.l_size = scene.l_size;
+  header.n_nodes = scene.nodes != NULL ? scene.n_nodes : 0;
+  header.i_size = scene.instances.count;
+  header.n_meshes = scene.instances.n_meshes;
+  header.n_materials = scene.n_materials;
+  copy_array(header.position, (float *)camera.position, 3);
+  copy_array(header.look_at, (float *)camera.look_at, 3);
+  copy_array(header.up, (float *)camera.up, 3);
+  header.fov = camera.fov;
+  header.width = settings.width;
+  header.height = settings.height;
+
+  long long size[SCENE_SECTIONS];
+  section_sizes(header, size);
+  long long offset = sizeof(header);
+  for (int i = 0; i < SCENE_SECTIONS; i++) {
+    header.offset[i] = offset = align_up(offset);
+    offset += size[i];
+  }
+
+  std::vector<SceneFileMesh> meshes(header.n_meshes);
+  for (int i = 0; i < header.n_meshes; i++) {
+    const Mesh &mesh = scene.instances.meshes[i];
+    SceneFileMesh &entry = meshes[i];
+    memset(&entry, 0, sizeof(entry));
+    entry.t_size = mesh.tris.count;
+    entry.t_padded = mesh.tris.padded;
+    entry.n_nodes = mesh.nodes != NULL ? mesh.n_nodes : 0;
+    copy_array(entry.bmin, (float *)mesh.bmin, 3);
+    copy_array(entry.bmax, (float *)mesh.bmax, 3);
+    entry.tris_offset = offset = align_up(offset);
+    offset += mesh_tris_size(entry);
+    entry.nodes_offset = offset = align_up(offset);
+    offset += mesh_nodes_size(entry);
+  }
+  header.file_size = offset;
+
+  // Everything to write, in file order
+  std::vector<const char *> data(SCENE_SECTIONS);
+  std::vector<long long> at(header.offset, header.offset + SCENE_SECTIONS);
+  std::vector<long long> bytes(size, size + SCENE_SECTIONS);
+  data[SECTION_TRIANGLES] = (const char *)scene.tris.px;
+  data[SECTION_T_COLORS] = (const char *)scene.t_colors;
+  data[SECTION_SPHERES] = (const char *)scene.spheres.x;
+  data[SECTION_S_COLORS] = (const char *)scene.s_colors;
+  data[SECTION_LIGHTS] = (const char *)scene.lights;
+  data[SECTION_NODES] = (const char *)scene.nodes;
+  data[SECTION_INSTANCES] = (const char *)scene.instances.list;
+  data[SECTION_MESHES] = (const char *)meshes.data();
+  data[SECTION_MATERIALS] = (const char *)scene.materials;
+  for (int i = 0; i < header.n_meshes; i++) {
+    const Mesh &mesh = scene.instances.meshes[i];
+    data.push_back((const char *)mesh.tris.px);
+    at.push_back(meshes[i].tris_offset);
+    bytes.push_back(mesh_tris_size(meshes[i]));
+    data.push_back((const char *)mesh.nodes);
+    at.push_back(meshes[i].nodes_offset);
+    bytes.push_back(mesh_nodes_size(meshes[i]));
+  }
+
+  static const char zeros[SCENE_ALIGN] = {0};
+  out.write((const char *)&header, sizeof(header));
+  long long written = sizeof(header);
+  for (size_t i = 0; i < data.size(); i++) {
+    out.write(zeros, at[i] - written);
+    out.write(data[i], bytes[i]);
+    written = at[i] + bytes[i];
+  }
+  return out.good();
+}
+
+bool write_scene_binary(const std::string &path, const Scene &scene,
+                        const Camera &camera, const RenderSettings &settings) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "Could not create file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  if (!write_scene_stream(file, scene, camera, settings)) {
+    std::cerr << "Could not write file '" << path << "'" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool padded_count(int size, int padded) {
+  return size >= 0 && padded % SIMD_WIDTH == 0 &&
+         padded >= size + SIMD_WIDTH - 1;
+}
+
+static bool in_file(long long offset, long long size, long long file_size) {
+  return offset % SCENE_ALIGN == 0 &&
+         offset >= (long long)sizeof(SceneFileHeader) && size >= 0 &&
+         offset + size <= file_size;
+}
+
+/**
+ * Traversal follows node indices blindly: children must exist and come
+ * after their parent, which rules out cycles, and leaves stay within the
+ * array of their type.
+ **/
+static bool valid_nodes(const BVHNode *nodes, int n_nodes, int t_size,
+                        int s_size, int i_size) {
+  for (int i = 0; i < n_nodes; i++) {
+    const BVHNode &node = nodes[i];
+    long long end = (long long)node.first + (node.count == 0 ? 2 : node.count);
+    long long limit = node.count == 0                ? n_nodes
+                      : node.type == BVH_TRIANGLE ? t_size
+                      : node.type == BVH_SPHERE   ? s_size
+                      : node.type == BVH_INSTANCE ? i_size
+                                                  : -1;
+    if (node.first < 0 || end > limit || (node.count == 0 && node.first <= i))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Checks everything the renderer relies on before trusting the offsets
+ **/
+static bool valid_header(const SceneFileHeader &header, size_t file_size,
+                         const std::string &path) {
+  const char *error = NULL;
+  const char *base = (const char *)&header;
+  long long size[SCENE_SECTIONS];
+  section_sizes(header, size);
+
+  if (memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0)
+    error = "not a binary scene";
+  else if (header.byte_order != SCENE_BYTE_ORDER)
+    error = "written on a machine of different byte order";
+  else if (header.version != SCENE_VERSION)
+    error = "unsupported version, convert it again";
+  else if (header.file_size != (long long)file_size)
+    error = "truncated";
+  else if (!padded_count(header.t_size, header.t_padded) ||
+           !padded_count(header.s_size, header.s_padded) ||
+           header.l_size < 0 || header.n_nodes < 0 || header.i_size < 0 ||
+           header.n_meshes < 0 || header.n_materials < 1 ||
+           header.n_materials > MAX_MATERIALS)
+    error = "inconsistent counts";
+
+  for (int i = 0; i < SCENE_SECTIONS && error == NULL; i++) {
+    if (!in_file(header.offset[i], size[i], header.file_size))
+      error = "section out of bounds";
+  }
+
+  if (error == NULL &&
+      !valid_nodes((const BVHNode *)(base + header.offset[SECTION_NODES]),
+                   header.n_nodes, header.t_size, header.s_size,
+                   header.i_size))
+    error = "corrupt BVH";
+
+  const SceneFileMesh *meshes =
+      (const SceneFileMesh *)(base + header.offset[SECTION_MESHES]);
+  for (int i = 0; i < header.n_meshes && error == NULL; i++) {
+    const SceneFileMesh &mesh = meshes[i];
+    if (!padded_count(mesh.t_size, mesh.t_padded) || mesh.n_nodes < 0 ||
+        !in_file(mesh.tris_offset, mesh_tris_size(mesh), header.file_size) ||
+        !in_file(mesh.nodes_offset, mesh_nodes_size(mesh), header.file_size))
+      error = "mesh out of bounds";
+    else if (!valid_nodes((const BVHNode *)(base + mesh.nodes_offset),
+                          mesh.n_nodes, mesh.t_size, 0, 0))
+      error = "corrupt mesh BVH";
+  }
+
+  const MeshInstance *instances =
+      (const MeshInstance *)(base + header.offset[SECTION_INSTANCES]);
+  for (int i = 0; i < header.i_size && error == NULL; i++) {
+    if (instances[i].mesh < 0 || instances[i].mesh >= header.n_meshes)
+      error = "instance of a missing mesh";
+    else if (instances[i].id < 0 || instances[i].id >= header.i_size)
+      error = "bad instance id";
+    else if (instances[i].material >= header.n_materials)
+      error = "missing material";
+  }
+
+  // Shading indexes the materials with the last byte of every color
+  const unsigned char *colors[2] = {
+      (const unsigned char *)(base + header.offset[SECTION_T_COLORS]),
+      (const unsigned char *)(base + header.offset[SECTION_S_COLORS])};
+  int counts[2] = {header.t_size, header.s_size};
+  for (int k = 0; k < 2 && error == NULL; k++) {
+    for (int i = 0; i < counts[k]; i++) {
+      if (colors[k][i * COLOR_BYTES + 3] >= header.n_materials) {
+        error = "missing material";
+        break;
+      }
+    }
+  }
+
+  if (error != NULL)
+    std::cerr << "Bad scene file '" << path << "': " << error << std::endl;
+  return error == NULL;
+}
+
+/**
+ * Maps the file copy-on-write and points scene into it, so an animation
+ * can move lights and instances without touching the file. Pages are
+ * prefaulted where the system allows it, so the load time includes reading
+ * the file rather than deferring it to the first frame.
+ **/
+bool map_scene_binary(const std::string &path, SceneMapping *mapping,
+                      Scene *scene, Camera *camera, RenderSettings *settings) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Could not open file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SceneFileHeader)) {
+    std::cerr << "Bad scene file '" << path << "': truncated" << std::endl;
+    close(fd);
+    return false;
+  }
+
+  int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE;
+#endif
+  void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Could not map file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  return attach_scene_binary(data, st.st_size, path, mapping, scene, camera,
+                             settings);
+}
+
+/**
+ * Points scene into a scene file already in memory, checked first. The
+ * memory must come from mmap: mapping takes it over, or it is unmapped
+ * right away when the file is bad. name only goes in error messages.
+ **/
+bool attach_scene_binary(void *data, size_t size, const std::string &name,
+                         SceneMapping *mapping, Scene *scene, Camera *camera,
+                         RenderSettings *settings) {
+  if (size < sizeof(SceneFileHeader)) {
+    std::cerr << "Bad scene file '" << name << "': truncated" << std::endl;
+    munmap(data, size);
+    return false;
+  }
+  const SceneFileHeader &header = *(const SceneFileHeader *)data;
+  if (!valid_header(header, size, name)) {
+    munmap(data, size);
+    return false;
+  }
+
+  char *base = (char *)data;
+  attach_triangle_soa(&scene->tris,
+                      (float *)(base + header.offset[SECTION_TRIANGLES]),
+                      header.t_size, header.t_padded);
+  attach_sphere_soa(&scene->spheres,
+                    (float *)(base + header.offset[SECTION_SPHERES]),
+                    header.s_size, header.s_padded);
+  scene->t_colors = (unsigned char *)(base + header.offset[SECTION_T_COLORS]);
+  scene->s_colors = (unsigned char *)(base + header.offset[SECTION_S_COLORS]);
+  scene->lights = (float *)(base + header.offset[SECTION_LIGHTS]);
+  scene->l_size = header.l_size;
+  build_light_grid(&scene->light_grid, scene->lights, scene->l_size);
+  scene->light_samples = 0;
+  scene->materials = (float *)(base + header.offset[SECTION_MATERIALS]);
+  scene->n_materials = header.n_materials;
+  scene->max_depth = scene->roulette = 0;
+  scene->n_nodes = header.n_nodes;
+  scene->nodes = header.n_nodes > 0
+                     ? (BVHNode *)(base + header.offset[SECTION_NODES])
+                     : NULL;
+  scene->grid.first = scene->grid.refs = scene->grid.global = NULL;
+  scene->arena.base = NULL; // the mapping owns the arrays
+  scene->arena.size = scene->arena.used = 0;
+
+  const SceneFileMesh *entries =
+      (const SceneFileMesh *)(base + header.offset[SECTION_MESHES]);
+  InstanceSet &set = scene->instances;
+  set.n_meshes = header.n_meshes;
+  set.meshes = new Mesh[set.n_meshes];
+  for (int i = 0; i < set.n_meshes; i++) {
+    const SceneFileMesh &entry = entries[i];
+    Mesh &mesh = set.meshes[i];
+    attach_triangle_soa(&mesh.tris, (float *)(base + entry.tris_offset),
+                        entry.t_size, entry.t_padded);
+    mesh.n_nodes = entry.n_nodes;
+    mesh.nodes =
+        entry.n_nodes > 0 ? (BVHNode *)(base + entry.nodes_offset) : NULL;
+    copy_array(mesh.bmin, (float *)entry.bmin, 3);
+    copy_array(mesh.bmax, (float *)entry.bmax, 3);
+  }
+  set.count = header.i_size;
+  set.list = (MeshInstance *)(base + header.offset[SECTION_INSTANCES]);
+
+  copy_array(camera->position, (float *)header.position, 3);
+  copy_array(camera->look_at, (float *)header.look_at, 3);
+  copy_array(camera->up, (float *)header.up, 3);
+  camera->fov = header.fov;
+  settings->width = header.width;
+  settings->height = header.height;
+
+  mapping->data = data;
+  mapping->size = size;
+  mapping->meshes = set.meshes;
+  return true;
+}
+
+/**
+ * Unmaps the file scene was attached to and frees what was built for it
+ **/
+void unmap_scene_binary(SceneMapping *mapping, Scene *scene) {
+  free_light_grid(&scene->light_grid);
+  free_grid(&scene->grid);
+  if (mapping->data != NULL)
+    munmap(mapping->data, mapping->size);
+  delete[] mapping->meshes;
+  mapping->data = NULL;
+  mapping->size = 0;
+  mapping->meshes = NULL;
+}
+
+SceneRelease::~SceneRelease() {
+  if (mapping->data != NULL)
+    unmap_scene_binary(mapping, scene);
+  else
+    free_scene(scene);
+}
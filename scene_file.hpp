@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#include "camera.hpp"
+#include "scene.hpp"
+
+#define SCENE_MAGIC "RTSCENE"
+#define SCENE_VERSION 6
+#define SCENE_BYTE_ORDER 0x01020304u
+#define SCENE_ALIGN 64
+
+#define SECTION_TRIANGLES 0 // TriangleSoA block, 12 * t_padded floats
+#define SECTION_T_COLORS 1  // COLOR_BYTES * t_size bytes
+#define SECTION_SPHERES 2   // SphereSoA block, 4 * s_padded floats
+#define SECTION_S_COLORS 3  // COLOR_BYTES * s_size bytes
+#define SECTION_LIGHTS 4    // LIGHT_FLOATS * l_size floats
+#define SECTION_NODES 5     // n_nodes BVHNode, none without a BVH
+#define SECTION_INSTANCES 6 // i_size MeshInstance
+#define SECTION_MESHES 7    // n_meshes SceneFileMesh
+#define SECTION_MATERIALS 8 // MATERIAL_FLOATS * n_materials floats
+#define SCENE_SECTIONS 9
+
+/**
+ * Binary scene file: this header followed by the sections, each starting
+ * on a SCENE_ALIGN boundary. Sections hold the arrays exactly as the
+ * renderer reads them (streams already padded and in BVH leaf order), so
+ * loading is a single mmap and the Scene points straight into it.
+ *
+ * The data of every mesh follows the sections, at the offsets its
+ * SceneFileMesh gives. The camera and resolution in effect at conversion
+ * time come along.
+ **/
+struct SceneFileHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int byte_order; // SCENE_BYTE_ORDER as seen by the writer
+  int t_size, t_padded;
+  int s_size, s_padded;
+  int l_size, n_nodes;
+  int i_size, n_meshes;
+  int n_materials, pad;
+  float position[3], look_at[3], up[3], fov;
+  int width, height;
+  long long offset[SCENE_SECTIONS]; // from the start of the file
+  long long file_size;
+};
+
+/**
+ * Where the triangle streams (TRIANGLE_STREAMS * t_padded floats) and the
+ * BVH of one mesh lie in the file
+ **/
+struct SceneFileMesh {
+  int t_size, t_padded;
+  int n_nodes, pad;
+  float bmin[3], bmax[3];
+  long long tris_offset, nodes_offset;
+};
+
+/**
+ * A scene file mapped in memory, everything in a Scene loaded from it
+ * points inside but the Mesh array, allocated on its own.
+ **/
+struct SceneMapping {
+  void *data;
+  size_t size;
+  Mesh *meshes;
+};
+
+/**
+ * Releases a scene when it goes out of scope: unmaps it when mapping holds
+ * a file, else frees what prepare_scene built
+ **/
+class SceneRelease {
+public:
+  SceneRelease(Scene *scene, SceneMapping *mapping)
+      : scene(scene), mapping(mapping) {}
+  ~SceneRelease();
+  SceneRelease(const SceneRelease &) = delete;
+  SceneRelease &operator=(const SceneRelease &) = delete;
+
+private:
+  Scene *scene;
+  SceneMapping *mapping;
+};
+
+bool is_scene_binary(const std::string &path);
+bool write_scene_stream(std::ostream &out, const Scene &scene,
+                        const Camera &camera, const RenderSettings &settings);
+bool write_scene_binary(const std::string &path, const Scene &scene,
+                        const Camera &camera, const RenderSettings &settings);
+bool map_scene_binary(const std::string &path, SceneMapping *mapping,
+                      Scene *scene, Camera *camera, RenderSettings *settings);
+bool attach_scene_binary(void *data, size_t size, const std::string &name,
+                         SceneMapping *mapping, Scene *scene, Camera *camera,
+                         RenderSettings *settings);
+void unmap_scene_binary(SceneMapping *mapping, Scene *scene);
@@ -0,0 +1,185 @@
+#include "scene_gen.hpp"
+
+// Small LCG, identical on every platform unlike rand()
+static float random_unit(unsigned int &state) {
+  state = state * 1664525u + 1013904223u;
+  return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+int init_triangles(float **tris, unsigned char **colors) {
+  int t_size = 2;
+
+  (*tris) = new float[t_size * 9];
+  (*colors) = new unsigned char[t_size * COLOR_BYTES];
+
+  float v[2][9] = {{
+                       10.0,
+                       -5.0,
+                       -2.0,
+                       10.0,
+                       -5.0,
+                       -10.0,
+                       -10.0,
+                       -5.0,
+                       -2.0,
+                   },
+                   {
+                       -10.0,
+                       -5.0,
+                       -2.0,
+                       10.0,
+                       -5.0,
+                       -10.0,
+                       -10.0,
+                       -5.0,
+                       -10.0,
+                   }};
+
+  unsigned char c[2][3] = {{255, 125, 125}, {255, 125, 125}};
+
+  for (int i = 0; i < t_size; i++) {
+    (*tris)[i * 9 + 0] = v[i][0];
+    (*tris)[i * 9 + 1] = v[i][1];
+    (*tris)[i * 9 + 2] = v[i][2];
+    (*tris)[i * 9 + 3] = v[i][3];
+    (*tris)[i * 9 + 4] = v[i][4];
+    (*tris)[i * 9 + 5] = v[i][5];
+    (*tris)[i * 9 + 6] = v[i][6];
+    (*tris)[i * 9 + 7] = v[i][7];
+    (*tris)[i * 9 + 8] = v[i][8];
+    (*colors)[i * COLOR_BYTES + 0] = c[i][0];
+    (*colors)[i * COLOR_BYTES + 1] = c[i][1];
+    (*colors)[i * COLOR_BYTES + 2] = c[i][2];
+    (*colors)[i * COLOR_BYTES + 3] = 0;
+  }
+
+  return t_size;
+}
+
+int init_spheres(float **spheres, float **radius, unsigned char **colors,
+                 int row, int col) {
+  float rad = 1.0f;
+
+  (*spheres) = new float[row * col * 3];
+  (*colors) = new unsigned char[row * col * COLOR_BYTES];
+  (*radius) = new float[row * col];
+
+  for (int i = 0; i < row; i++) {
+    for (int j = 0; j < col; j++) {
+      (*spheres)[(i * col + j) * 3 + 0] = (j * 2 - col) * rad;
+      (*spheres)[(i * col + j) * 3 + 1] = (i * 2 - row) * rad;
+      (*spheres)[(i * col + j) * 3 + 2] = -50;
+      (*radius)[(i * col + j)] = rad;
+
+      (*colors)[(i * col + j) * COLOR_BYTES + 0] = 0;
+      (*colors)[(i * col + j) * COLOR_BYTES + 1] = 255;
+      (*colors)[(i * col + j) * COLOR_BYTES + 2] = 0;
+      (*colors)[(i * col + j) * COLOR_BYTES + 3] = 0;
+    }
+  }
+
+  return row * col;
+}
+
+int init_lights(float **lights) {
+  int l_size = 2;
+
+  (*lights) = new float[l_size * LIGHT_FLOATS];
+
+  float v[2][3] = {{2.0, 5.0, -4.0}, {-2.0, 5.0, -4.0}};
+
+  for (int i = 0; i < l_size; i++) {
+    (*lights)[i * LIGHT_FLOATS + 0] = v[i][0];
+    (*lights)[i * LIGHT_FLOATS + 1] = v[i][1];
+    (*lights)[i * LIGHT_FLOATS + 2] = v[i][2];
+    (*lights)[i * LIGHT_FLOATS + 3] = 0; // reaches everywhere
+  }
+
+  return l_size;
+}
+
+int init_materials(float **materials) {
+  (*materials) = new float[MATERIAL_FLOATS];
+  plain_material(*materials);
+  return 1;
+}
+
+/**
+ * count small triangles scattered at random in front of the default camera,
+ * the same seed always giving the same scene.
+ **/
+int triangle_soup(float **tris, unsigned char **colors, int count,
+                  unsigned int seed) {
+  (*tris) = new float[count * 9];
+  (*colors) = new unsigned char[count * COLOR_BYTES];
+
+  unsigned int state = seed;
+  for (int i = 0; i < count; i++) {
+    float c[3] = {-40.0f + 80.0f * random_unit(state),
+                  -22.0f + 44.0f * random_unit(state),
+                  -80.0f + 25.0f * random_unit(state)};
+    for (int v = 0; v < 3; v++) {
+      for (int k = 0; k < 3; k++)
+        (*tris)[i * 9 + v * 3 + k] = c[k] + 0.8f * (random_unit(state) - 0.5f);
+    }
+    for (int k = 0; k < 3; k++)
+      (*colors)[i * COLOR_BYTES + k] =
+          64 + (unsigned char)(191 * random_unit(state));
+    (*colors)[i * COLOR_BYTES + 3] = 0;
+  }
+
+  return count;
+}
+
+/**
+ * Indexed torus around the z axis, rings segments along the tube and sides
+ * around it, sharing every vertex between its six triangles.
+ **/
+void torus_mesh(IndexedMesh *mesh, int rings, int sides, float radius,
+                float tube) {
+  mesh->path = "torus";
+  mesh->vertices.resize(rings * sides * 3);
+  mesh->indices.resize(rings * sides * 6);
+
+  for (int i = 0; i < rings; i++) {
+    float u = 2.0f * (float)M_PI * i / rings;
+    for (int j = 0; j < sides; j++) {
+      float v = 2.0f * (float)M_PI * j / sides;
+      float *p = &mesh->vertices[(i * sides + j) * 3];
+      p[0] = (radius + tube * cosf(v)) * cosf(u);
+      p[1] = (radius + tube * cosf(v)) * sinf(u);
+      p[2] = tube * sinf(v);
+
+      unsigned int a = i * sides + j, b = ((i + 1) % rings) * sides + j;
+      unsigned int c = ((i + 1) % rings) * sides + (j + 1) % sides;
+      unsigned int d = i * sides + (j + 1) % sides;
+      unsigned int quad[6] = {a, b, c, a, c, d};
+      copy_array(&mesh->indices[(i * sides + j) * 6], quad, 6);
+    }
+  }
+}
+
+/**
+ * count instances of mesh 0 spread over the same volume as the triangle
+ * soup, randomly turned and colored.
+ **/
+void instance_grid(SceneMeshes *meshes, int count, unsigned int seed) {
+  unsigned int state = seed;
+  int side = (int)ceilf(sqrtf((float)count));
+  meshes->instances.resize(count);
+  for (int i = 0; i < count; i++) {
+    MeshInstance &instance = meshes->instances[i];
+    float translate[3] = {-36.0f + 72.0f * ((i % side) + 0.5f) / side,
+                          -20.0f + 40.0f * ((i / side) + 0.5f) / side,
+                          -75.0f + 15.0f * random_unit(state)};
+    float rotate[3] = {360.0f * random_unit(state),
+                       360.0f * random_unit(state), 0};
+    instance.mesh = 0;
+    instance.id = i;
+    instance_transform(&instance, translate, rotate,
+                       0.6f + 0.4f * random_unit(state));
+    for (int k = 0; k < 3; k++)
+      instance.color[k] = 64 + (unsigned char)(191 * random_unit(state));
+    instance.material = 0;
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "lights.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+
+/**
+ * Procedural scenes, each allocating its arrays with new[] and returning
+ * the number of primitives.
+ **/
+int init_triangles(float **tris, unsigned char **colors);
+int init_spheres(float **spheres, float **radius, unsigned char **colors,
+                 int row, int col);
+int init_lights(float **lights);
+int init_materials(float **materials);
+int triangle_soup(float **tris, unsigned char **colors, int count,
+                  unsigned int seed);
+
+void torus_mesh(IndexedMesh *mesh, int rings, int sides, float radius,
+                float tube);
+void instance_grid(SceneMeshes *meshes, int count, unsigned int seed);
@@ -0,0 +1,432 @@
+#include "scene_text.hpp"
+#include "text_parse.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/**
+ * A piece of the file starting at a line boundary, with what the counting
+ * pass found in it and where its records go in the final arrays.
+ **/
+struct Chunk {
+  const char *begin, *end;
+  long long first_line; // number of the line at begin, from 1
+  long long lines;
+  int t_size, s_size, l_size, m_size, i_size, x_size;
+  int t_first, s_first, l_first, i_first, x_first;
+  std::vector<std::string> meshes; // paths, in file order
+
+  // Last camera and resolution lines of the chunk, the last one wins
+  bool has_camera, has_resolution;
+  float camera[7];
+  int resolution[2];
+
+  long long error_line; // 0 when the chunk parsed cleanly
+  std::string error;
+};
+
+static void set_error(Chunk *chunk, long long line, const std::string &error) {
+  if (chunk->error_line == 0) {
+    chunk->error_line = line;
+    chunk->error = error;
+  }
+}
+
+static inline bool parse_number(const char *&p, const char *end,
+                                float *value) {
+  return parse_float(p, end, value);
+}
+
+static inline bool parse_number(const char *&p, const char *end, int *value) {
+  return parse_int(p, end, value);
+}
+
+/**
+ * Parses count blank separated numbers from p to eol, which must hold
+ * exactly that many (a trailing // comment is allowed).
+ **/
+template <class T>
+static bool parse_record(const char *p, const char *eol, T *values, int count,
+                         char type, Chunk *chunk, long long line) {
+  for (int i = 0; i < count; i++) {
+    p = skip_blanks(p, eol);
+    if (p == eol) {
+      std::ostringstream msg;
+      msg << "expected " << count << " numbers after '" << type
+          << "', found " << i;
+      set_error(chunk, line, msg.str());
+      return false;
+    }
+
+    const char *start = p;
+    if (!parse_number(p, eol, &values[i]) || (p < eol && !is_blank(*p))) {
+      const char *token_end = start;
+      while (token_end < eol && !is_blank(*token_end))
+        token_end++;
+      set_error(chunk, line,
+                "bad number '" + std::string(start, token_end) + "'");
+      return false;
+    }
+  }
+
+  p = skip_blanks(p, eol);
+  if (p < eol && !(eol - p >= 2 && p[0] == '/' && p[1] == '/')) {
+    std::ostringstream msg;
+    msg << "more than " << count << " numbers after '" << type << "'";
+    set_error(chunk, line, msg.str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * count, or count + 1 when the record has one more value: the optional
+ * last one was given
+ **/
+static int optional_count(const char *p, const char *eol, int count) {
+  int found = 0;
+  for (p = skip_blanks(p, eol); p < eol; p = skip_blanks(p, eol)) {
+    if (eol - p >= 2 && p[0] == '/' && p[1] == '/')
+      break;
+    while (p < eol && !is_blank(*p))
+      p++;
+    found++;
+  }
+  return found == count + 1 ? count + 1 : count;
+}
+
+static bool check_color(const float color[3], Chunk *chunk, long long line) {
+  for (int k = 0; k < 3; k++) {
+    if (!(color[k] >= 0 && color[k] <= 255)) {
+      set_error(chunk, line, "color components must be within 0 and 255");
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Material index closing a record, 0 (plain) when not given
+ **/
+static bool check_material(float material, int n_materials, Chunk *chunk,
+                           long long line) {
+  if (!(material >= 0 && material < n_materials &&
+        material == (int)material)) {
+    std::ostringstream msg;
+    msg << "no material " << material << ", the scene has " << n_materials;
+    set_error(chunk, line, msg.str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * First pass, only looks at the first character of every line
+ **/
+static void count_chunk(Chunk *chunk) {
+  for (const char *p = chunk->begin; p < chunk->end;) {
+    const char *eol = line_end(p, chunk->end);
+    p = skip_blanks(p, eol);
+    if (p < eol) {
+      chunk->t_size += *p == 't';
+      chunk->s_size += *p == 's';
+      chunk->l_size += *p == 'l';
+      chunk->m_size += *p == 'm';
+      chunk->i_size += *p == 'i';
+      chunk->x_size += *p == 'M';
+    }
+    chunk->lines++;
+    p = eol + 1;
+  }
+}
+
+/**
+ * Mesh records hold a single path, without blanks
+ **/
+static bool parse_path(const char *p, const char *eol, std::string *path,
+                       Chunk *chunk, long long line) {
+  p = skip_blanks(p, eol);
+  const char *start = p;
+  while (p < eol && !is_blank(*p))
+    p++;
+  if (p == start) {
+    set_error(chunk, line, "expected a mesh file after 'm'");
+    return false;
+  }
+  *path = std::string(start, p);
+
+  p = skip_blanks(p, eol);
+  if (p < eol && !(eol - p >= 2 && p[0] == '/' && p[1] == '/')) {
+    set_error(chunk, line, "more than a path after 'm'");
+    return false;
+  }
+  return true;
+}
+
+static void parse_chunk(Chunk *chunk, float *tris, unsigned char *t_colors,
+                        float *spheres, float *radius,
+                        unsigned char *s_colors, float *lights,
+                        float *materials, int n_materials,
+                        MeshInstance *instances, int n_meshes) {
+  int t = chunk->t_first, s = chunk->s_first, l = chunk->l_first;
+  int in = chunk->i_first, x = chunk->x_first;
+  long long line = chunk->first_line;
+
+  for (const char *p = chunk->begin; p < chunk->end; line++) {
+    const char *eol = line_end(p, chunk->end);
+    const char *next = eol + 1;
+    p = skip_blanks(p, eol);
+    if (p == eol || *p == '/') {
+      p = next;
+      continue;
+    }
+
+    char type = *p++;
+    float v[13];
+    switch (type) {
+    case 's':
+      v[7] = 0;
+      if (!parse_record(p, eol, v, optional_count(p, eol, 7), type, chunk,
+                        line) ||
+          !check_color(v + 4, chunk, line) ||
+          !check_material(v[7], n_materials, chunk, line))
+        return;
+      radius[s] = v[0];
+      copy_array(spheres + s * 3, v + 1, 3);
+      for (int k = 0; k < 3; k++)
+        s_colors[s * COLOR_BYTES + k] = (unsigned char)v[4 + k];
+      s_colors[s * COLOR_BYTES + 3] = (unsigned char)v[7];
+      s++;
+      break;
+
+    case 't':
+      v[12] = 0;
+      if (!parse_record(p, eol, v, optional_count(p, eol, 12), type, chunk,
+                        line) ||
+          !check_color(v + 9, chunk, line) ||
+          !check_material(v[12], n_materials, chunk, line))
+        return;
+      copy_array(tris + t * 9, v, 9);
+      for (int k = 0; k < 3; k++)
+        t_colors[t * COLOR_BYTES + k] = (unsigned char)v[9 + k];
+      t_colors[t * COLOR_BYTES + 3] = (unsigned char)v[12];
+      t++;
+      break;
+
+    case 'l':
+      // The radius is optional, without it the light reaches everywhere
+      v[3] = 0;
+      if (!parse_record(p, eol, v, optional_count(p, eol, 3), type, chunk,
+                        line))
+        return;
+      if (!(v[3] >= 0)) {
+        set_error(chunk, line, "light radius must not be negative");
+        return;
+      }
+      copy_array(lights + l * LIGHT_FLOATS, v, LIGHT_FLOATS);
+      l++;
+      break;
+
+    case 'm': {
+      std::string path;
+      if (!parse_path(p, eol, &path, chunk, line))
+        return;
+      chunk->meshes.push_back(path);
+      break;
+    }
+
+    case 'M':
+      if (!parse_record(p, eol, v, MATERIAL_FLOATS, type, chunk, line))
+        return;
+      if (!(v[0] >= 0 && v[1] >= 0 && v[0] + v[1] <= 1)) {
+        set_error(chunk, line,
+                  "reflectivity and transparency must be at least 0 and add "
+                  "up to 1 at most");
+        return;
+      }
+      if (!(v[2] > 0)) {
+        set_error(chunk, line, "index of refraction must be positive");
+        return;
+      }
+      copy_array(materials + x * MATERIAL_FLOATS, v, MATERIAL_FLOATS);
+      x++;
+      break;
+
+    case 'i': {
+      v[11] = 0;
+      if (!parse_record(p, eol, v, optional_count(p, eol, 11), type, chunk,
+                        line) ||
+          !check_color(v + 8, chunk, line) ||
+          !check_material(v[11], n_materials, chunk, line))
+        return;
+      if (!(v[0] >= 0 && v[0] < n_meshes && v[0] == (int)v[0])) {
+        std::ostringstream msg;
+        msg << "no mesh " << v[0] << ", the scene has " << n_meshes;
+        set_error(chunk, line, msg.str());
+        return;
+      }
+      MeshInstance &instance = instances[in];
+      instance.mesh = (int)v[0];
+      instance.id = in++;
+      instance_transform(&instance, v + 1, v + 4, v[7]);
+      for (int k = 0; k < 3; k++)
+        instance.color[k] = (unsigned char)v[8 + k];
+      instance.material = (unsigned char)v[11];
+      break;
+    }
+
+    case 'c':
+      if (!parse_record(p, eol, chunk->camera, 7, type, chunk, line))
+        return;
+      chunk->has_camera = true;
+      break;
+
+    case 'r':
+      if (!parse_record(p, eol, chunk->resolution, 2, type, chunk, line))
+        return;
+      chunk->has_resolution = true;
+      break;
+
+    default:
+      set_error(chunk, line,
+                std::string("unknown record type '") + type + "'");
+      return;
+    }
+    p = next;
+  }
+}
+
+bool ReadSceneFile(std::string path, float **tris, unsigned char **t_colors,
+                   float **spheres, float **radius, unsigned char **s_colors,
+                   float **lights, float **materials, int &t_size,
+                   int &s_size, int &l_size, int &n_materials,
+                   SceneMeshes &meshes, Camera &camera,
+                   RenderSettings &settings) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    std::cerr << "Could not open file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  // One NUL terminated buffer for the whole file
+  long long size = file.tellg();
+  std::vector<char> buffer(size + 1);
+  file.seekg(0);
+  if (!file.read(buffer.data(), size)) {
+    std::cerr << "Could not read file '" << path << "'" << std::endl;
+    return false;
+  }
+  buffer[size] = '\0';
+  const char *data = buffer.data();
+
+  std::vector<const char *> bounds = split_lines(data, size);
+  int n_chunks = bounds.size() - 1;
+  std::vector<Chunk> chunks(n_chunks);
+  for (int i = 0; i < n_chunks; i++) {
+    Chunk &chunk = chunks[i];
+    chunk.begin = bounds[i];
+    chunk.end = bounds[i + 1];
+    chunk.lines = 0;
+    chunk.t_size = chunk.s_size = chunk.l_size = 0;
+    chunk.m_size = chunk.i_size = chunk.x_size = 0;
+    chunk.has_camera = chunk.has_resolution = false;
+    chunk.error_line = 0;
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n_chunks; i++)
+    count_chunk(&chunks[i]);
+
+  t_size = s_size = l_size = 0;
+  int m_size = 0, i_size = 0;
+  n_materials = 1; // material 0 is the plain one
+  long long line = 1;
+  for (int i = 0; i < n_chunks; i++) {
+    chunks[i].first_line = line;
+    chunks[i].t_first = t_size;
+    chunks[i].s_first = s_size;
+    chunks[i].l_first = l_size;
+    chunks[i].i_first = i_size;
+    chunks[i].x_first = n_materials;
+    line += chunks[i].lines;
+    t_size += chunks[i].t_size;
+    s_size += chunks[i].s_size;
+    l_size += chunks[i].l_size;
+    m_size += chunks[i].m_size;
+    i_size += chunks[i].i_size;
+    n_materials += chunks[i].x_size;
+  }
+  if (n_materials > MAX_MATERIALS) {
+    std::cerr << path << ": " << n_materials - 1 << " materials, at most "
+              << MAX_MATERIALS - 1 << " are supported" << std::endl;
+    return false;
+  }
+  meshes.meshes.clear();
+  meshes.instances.resize(i_size);
+
+  (*tris) = new float[t_size * 9];
+  (*t_colors) = new unsigned char[t_size * COLOR_BYTES];
+  (*spheres) = new float[s_size * 3];
+  (*radius) = new float[s_size * 1];
+  (*s_colors) = new unsigned char[s_size * COLOR_BYTES];
+  (*lights) = new float[l_size * LIGHT_FLOATS];
+  (*materials) = new float[n_materials * MATERIAL_FLOATS];
+  plain_material(*materials);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n_chunks; i++)
+    parse_chunk(&chunks[i], *tris, *t_colors, *spheres, *radius, *s_colors,
+                *lights, *materials, n_materials, meshes.instances.data(),
+                m_size);
+
+  std::vector<std::string> paths;
+  std::string dir = path.substr(0, path.find_last_of('/') + 1);
+
+  bool ok = true;
+  for (int i = 0; i < n_chunks; i++) {
+    const Chunk &chunk = chunks[i];
+    if (chunk.error_line != 0) {
+      std::cerr << path << ":" << chunk.error_line << ": " << chunk.error
+                << std::endl;
+      ok = false;
+      break;
+    }
+
+    if (chunk.has_camera) {
+      copy_array(camera.position, (float *)chunk.camera, 3);
+      copy_array(camera.look_at, (float *)chunk.camera + 3, 3);
+      camera.fov = chunk.camera[6];
+    }
+    if (chunk.has_resolution) {
+      settings.width = chunk.resolution[0];
+      settings.height = chunk.resolution[1];
+    }
+    for (size_t k = 0; k < chunk.meshes.size(); k++)
+      paths.push_back(chunk.meshes[k][0] == '/' ? chunk.meshes[k]
+                                                : dir + chunk.meshes[k]);
+  }
+
+  // Each mesh reader is parallel on its own
+  meshes.meshes.resize(ok ? paths.size() : 0);
+  for (size_t k = 0; k < paths.size() && ok; k++)
+    ok = load_mesh(paths[k], &meshes.meshes[k]);
+
+  if (!ok) {
+    delete[] *tris;
+    delete[] *t_colors;
+    delete[] *spheres;
+    delete[] *radius;
+    delete[] *s_colors;
+    delete[] *lights;
+    delete[] *materials;
+    meshes.meshes.clear();
+    meshes.instances.clear();
+  }
+  return ok;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+
+#include "camera.hpp"
+#include "lights.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+
+/**
+ * Reads a text scene (see scene.txt for the format) into freshly allocated
+ * arrays. The file is read in one go, cut into chunks at line boundaries
+ * and the chunks are parsed in parallel straight into the final arrays,
+ * sized by a first counting pass. Meshes the scene refers to are loaded
+ * into meshes along with its instances, mesh paths being relative to the
+ * scene file.
+ *
+ * Returns false after printing the first error with its line number.
+ **/
+bool ReadSceneFile(std::string path, float **tris, unsigned char **t_colors,
+                   float **spheres, float **radius, unsigned char **s_colors,
+                   float **lights, float **materials, int &t_size,
+                   int &s_size, int &l_size, int &n_materials,
+                   SceneMeshes &meshes, Camera &camera,
+                   RenderSettings &settings);
@@ -0,0 +1,201 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+int tile_order(const std::string &name) {
+  if (name == "scanline")
+    return TILE_SCANLINE;
+  if (name == "spiral")
+    return TILE_SPIRAL;
+  return TILE_MORTON;
+}
+
+const char *tile_order_name(int order) {
+  switch (order) {
+  case TILE_SCANLINE:
+    return "scanline";
+  case TILE_SPIRAL:
+    return "spiral";
+  }
+  return "morton";
+}
+
+static unsigned int morton_code(unsigned int x, unsigned int y) {
+  unsigned int code = 0;
+  for (int b = 0; b < 16; b++) {
+    code |= ((x >> b) & 1) << (2 * b);
+    code |= ((y >> b) & 1) << (2 * b + 1);
+  }
+  return code;
+}
+
+struct TileKey {
+  int band;
+  float key;
+  int index;
+  bool operator<(const TileKey &o) const {
+    if (band != o.band)
+      return band < o.band;
+    return key < o.key || (key == o.key && index < o.index);
+  }
+};
+
+TileScheduler::TileScheduler(int width, int height, int tile_size, int order,
+                             int n_workers)
+    : TileScheduler(width, height, tile_size, order, n_workers, 1) {}
+
+/**
+ * Groups are capped to the workers, so that every band has some
+ **/
+TileScheduler::TileScheduler(int width, int height, int tile_size, int order,
+                             int n_workers, int n_groups)
+    : deques(n_workers > 0 ? n_workers : 1),
+      n_groups(std::max(1, std::min(n_groups, (int)deques.size()))) {
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+
+  std::vector<TileKey> keys(tiles_x * tiles_y);
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      TileKey &k = keys[ty * tiles_x + tx];
+      k.band = (int)((long)ty * this->n_groups / tiles_y);
+      k.index = ty * tiles_x + tx;
+
+      if (order == TILE_MORTON) {
+        k.key = morton_code(tx, ty);
+      } else if (order == TILE_SPIRAL) {
+        // Rings around the center, walked by angle within a ring
+        float dx = tx - (tiles_x - 1) * 0.5f, dy = ty - (tiles_y - 1) * 0.5f;
+        float ring = std::max(std::fabs(dx), std::fabs(dy));
+        float angle = std::atan2(dy, dx) + (float)M_PI;
+        k.key = std::floor(ring) * 8.0f + angle;
+      } else {
+        k.key = k.index;
+      }
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+
+  tiles.resize(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    int tx = keys[i].index % tiles_x, ty = keys[i].index / tiles_x;
+    Tile &t = tiles[i];
+    t.x0 = tx * tile_size;
+    t.y0 = ty * tile_size;
+    t.x1 = std::min(t.x0 + tile_size, width);
+    t.y1 = std::min(t.y0 + tile_size, height);
+  }
+
+  // Runs of tiles and of workers of every group, dealt to each other
+  int n = (int)deques.size();
+  std::vector<int> first_tile(this->n_groups + 1, 0);
+  std::vector<int> first_worker(this->n_groups + 1, 0);
+  for (size_t i = 0; i < keys.size(); i++)
+    first_tile[keys[i].band + 1]++;
+  for (int w = 0; w < n; w++)
+    first_worker[group(w) + 1]++;
+  for (int g = 0; g < this->n_groups; g++) {
+    first_tile[g + 1] += first_tile[g];
+    first_worker[g + 1] += first_worker[g];
+  }
+
+  for (int g = 0; g < this->n_groups; g++) {
+    int t0 = first_tile[g], n_tiles = first_tile[g + 1] - t0;
+    int w0 = first_worker[g], n_workers = first_worker[g + 1] - w0;
+    for (int i = 0; i < n_workers; i++) {
+      Deque &d = deques[w0 + i];
+      d.head = t0 + (int)((long)n_tiles * i / n_workers);
+      d.tail = t0 + (int)((long)n_tiles * (i + 1) / n_workers);
+      d.busy = 0;
+      d.done = 0;
+      d.stolen = 0;
+      d.remote = 0;
+    }
+  }
+}
+
+int TileScheduler::group(int worker) const {
+  int n = (int)deques.size();
+  return (int)((long)(worker % n) * n_groups / n);
+}
+
+/**
+ * Next tile for worker, false once every deque is empty
+ **/
+bool TileScheduler::next(int worker, Tile &tile) {
+  int n = (int)deques.size();
+  worker %= n;
+
+  {
+    Deque &own = deques[worker];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (own.head < own.tail) {
+      tile = tiles[own.head++];
+      own.done++;
+      return true;
+    }
+  }
+
+  // Workers of the same group first, then the others
+  int own = group(worker);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int k = 1; k < n; k++) {
+      int v = (worker + k) % n;
+      if ((group(v) == own) != (pass == 0))
+        continue;
+      Deque &victim = deques[v];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (victim.head < victim.tail) {
+        tile = tiles[--victim.tail];
+        deques[worker].done++;
+        deques[worker].stolen++;
+        deques[worker].remote += pass;
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void TileScheduler::add_busy(int worker, double seconds) {
+  deques[worker % deques.size()].busy += seconds;
+}
+
+void TileScheduler::totals(int worker, int *done, int *remote,
+                           double *busy) const {
+  const Deque &d = deques[worker % deques.size()];
+  *done = d.done;
+  *remote = d.remote;
+  *busy = d.busy;
+}
+
+void TileScheduler::report(double frame_time, std::ostream &out) const {
+  double total = 0;
+  for (size_t w = 0; w < deques.size(); w++)
+    total += deques[w].busy;
+
+  out << "Tiles: " << tiles.size() << ", " << deques.size()
+      << " workers, parallel efficiency "
+      << (frame_time > 0 ? 100.0 * total / (frame_time * deques.size()) : 0)
+      << "%" << std::endl;
+
+  // Timings in ms precision, the caller's format given back after
+  std::ios_base::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  for (size_t w = 0; w < deques.size(); w++) {
+    const Deque &d = deques[w];
+    out << "  worker " << std::setw(3) << w << ": busy " << std::fixed
+        << std::setprecision(3) << d.busy << " s, idle "
+        << std::max(0.0, frame_time - d.busy) << " s, " << d.done
+        << " tiles (" << d.stolen << " stolen";
+    if (n_groups > 1)
+      out << ", " << d.remote << " from another group, in group "
+          << group(w);
+    out << ")" << std::endl;
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define TILE_SCANLINE 0
+#define TILE_MORTON 1
+#define TILE_SPIRAL 2
+
+#define DEFAULT_TILE_SIZE 32
+
+/**
+ * Pixel rectangle [x0, x1) x [y0, y1)
+ **/
+struct Tile {
+  int x0, y0, x1, y1;
+};
+
+/**
+ * Splits a frame into tiles and hands them out to a fixed number of
+ * workers. The tiles, sorted in the requested order, are dealt to the
+ * workers in contiguous runs so each one starts on a compact region; a
+ * worker takes from the front of its own run and, once it is empty,
+ * steals from the back of somebody else's.
+ *
+ * Workers may also be split into groups, such as the threads of each NUMA
+ * node: the frame is then cut into as many bands of rows, each dealt to
+ * the workers of one group only, and workers steal within their group
+ * before they steal from another.
+ **/
+class TileScheduler {
+public:
+  TileScheduler(int width, int height, int tile_size, int order,
+                int n_workers);
+  TileScheduler(int width, int height, int tile_size, int order,
+                int n_workers, int n_groups);
+
+  bool next(int worker, Tile &tile);
+
+  // Group of worker, from 0 in order of the workers and of the bands
+  int group(int worker) const;
+
+  // Per worker accounting, filled in by the workers themselves
+  void add_busy(int worker, double seconds);
+  void totals(int worker, int *done, int *remote, double *busy) const;
+  void report(double frame_time, std::ostream &out) const;
+
+  int size() const { return (int)tiles.size(); }
+
+private:
+  struct Deque {
+    std::mutex lock;
+    int head, tail;
+    double busy;
+    int done, stolen;
+    int remote; // stolen from another group
+    char pad[64]; // keep neighbouring deques off each other's cache line
+  };
+
+  std::vector<Tile> tiles;
+  std::vector<Deque> deques;
+  int n_groups;
+};
+
+int tile_order(const std::string &name);
+const char *tile_order_name(int order);
@@ -0,0 +1,497 @@
+#include "simd.hpp"
+#include "stats.hpp"
+
+#include <cfloat>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Both must match the epsilons of raySphereIntersects/rayTriangleIntersects,
+// the vector kernels reproduce their arithmetic operation by operation so
+// the closest hit is bit for bit the one of the scalar path
+#define SPHERE_EPSILON 0.001f
+#define TRIANGLE_EPSILON 1e-8f
+
+int simd_level = SIMD_SCALAR;
+
+const char *simd_name(int level) {
+  switch (level) {
+  case SIMD_AVX512:
+    return "avx512";
+  case SIMD_AVX2:
+    return "avx2";
+  }
+  return "scalar";
+}
+
+/**
+ * Picks the widest kernels both the CPU and the request allow.
+ * request is one of auto, scalar, avx2 or avx512.
+ **/
+int simd_init(const std::string &request) {
+  int supported = SIMD_SCALAR;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    supported = SIMD_AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    supported = SIMD_AVX512;
+#endif
+
+  int wanted = SIMD_AVX512;
+  if (request == "scalar")
+    wanted = SIMD_SCALAR;
+  else if (request == "avx2")
+    wanted = SIMD_AVX2;
+
+  simd_level = wanted < supported ? wanted : supported;
+  return simd_level;
+}
+
+/**
+ * Padding makes room for a full vector load starting at any primitive,
+ * lanes past the end of a range are masked out by the kernels.
+ **/
+int soa_padded(int size) {
+  return (size + 2 * SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+}
+
+/**
+ * Points the streams into an existing block of 4 * padded floats, laid
+ * out as x, y, z then r; triangles take TRIANGLE_STREAMS * padded floats in
+ * the order of the TriangleSoA members.
+ **/
+void attach_sphere_soa(SphereSoA *s, float *block, int size, int padded) {
+  s->x = block;
+  s->y = block + padded;
+  s->z = block + 2 * padded;
+  s->r = block + 3 * padded;
+  s->count = size;
+  s->padded = padded;
+}
+
+void attach_triangle_soa(TriangleSoA *tr, float *block, int size,
+                         int padded) {
+  float **streams[TRIANGLE_STREAMS] = {
+      &tr->px,  &tr->py,  &tr->pz,  &tr->e1x, &tr->e1y, &tr->e1z,
+      &tr->e2x, &tr->e2y, &tr->e2z, &tr->nx,  &tr->ny,  &tr->nz};
+  for (int k = 0; k < TRIANGLE_STREAMS; k++)
+    *streams[k] = block + k * padded;
+  tr->count = size;
+  tr->padded = padded;
+}
+
+/**
+ * Fills a block of 4 * soa_padded(size) floats, padding included, the
+ * streams being written in parallel
+ **/
+void fill_sphere_soa(SphereSoA *s, float *block, float *spheres,
+                     float *radius, int size) {
+  int padded = soa_padded(size);
+  attach_sphere_soa(s, block, size, padded);
+  for (int k = 0; k < 4; k++)
+    memset(block + k * padded + size, 0, (padded - size) * sizeof(float));
+
+#pragma omp parallel for
+  for (int i = 0; i < size; i++) {
+    s->x[i] = spheres[i * 3 + 0];
+    s->y[i] = spheres[i * 3 + 1];
+    s->z[i] = spheres[i * 3 + 2];
+    s->r[i] = radius[i];
+  }
+}
+
+/**
+ * Fills a block of TRIANGLE_STREAMS * soa_padded(size) floats. Everything
+ * the intersection and shading need that only depends on the triangle is
+ * computed once here rather than on every test.
+ **/
+void fill_triangle_soa(TriangleSoA *tr, float *block, float *tris,
+                       int size) {
+  int padded = soa_padded(size);
+  attach_triangle_soa(tr, block, size, padded);
+  for (int k = 0; k < TRIANGLE_STREAMS; k++)
+    memset(block + k * padded + size, 0, (padded - size) * sizeof(float));
+
+#pragma omp parallel for
+  for (int i = 0; i < size; i++) {
+    vec3 p = load3(tris + i * 9);
+    vec3 e1 = load3(tris + i * 9 + 3) - p;
+    vec3 e2 = load3(tris + i * 9 + 6) - p;
+    vec3 n = normalize(cross(e1, e2));
+
+    tr->px[i] = p.x;
+    tr->py[i] = p.y;
+    tr->pz[i] = p.z;
+    tr->e1x[i] = e1.x;
+    tr->e1y[i] = e1.y;
+    tr->e1z[i] = e1.z;
+    tr->e2x[i] = e2.x;
+    tr->e2y[i] = e2.y;
+    tr->e2z[i] = e2.z;
+    tr->nx[i] = n.x;
+    tr->ny[i] = n.y;
+    tr->nz[i] = n.z;
+  }
+}
+
+void build_triangle_soa(TriangleSoA *tr, float *tris, int size) {
+  fill_triangle_soa(tr, new float[TRIANGLE_STREAMS * soa_padded(size)], tris,
+                    size);
+}
+
+void free_triangle_soa(TriangleSoA *tr) {
+  delete[] tr->px;
+  memset(tr, 0, sizeof(TriangleSoA));
+  tr->count = tr->padded = 0;
+}
+
+#pragma omp declare target
+
+#ifdef SIMD_X86
+
+/**
+ * Every lanes function writes the hit distance of W consecutive primitives
+ * starting at i, or +inf for a miss. A NaN distance means the scalar
+ * intersector reports a hit no distance comparison will ever accept.
+ **/
+
+__attribute__((target("avx2"))) static void
+sphere_lanes_avx2(SphereSoA *s, int i, float *orig, float *dir, float *t) {
+  __m256 dx = _mm256_set1_ps(dir[0]), dy = _mm256_set1_ps(dir[1]),
+         dz = _mm256_set1_ps(dir[2]);
+
+  __m256 Lx = _mm256_sub_ps(_mm256_set1_ps(orig[0]), _mm256_loadu_ps(s->x + i));
+  __m256 Ly = _mm256_sub_ps(_mm256_set1_ps(orig[1]), _mm256_loadu_ps(s->y + i));
+  __m256 Lz = _mm256_sub_ps(_mm256_set1_ps(orig[2]), _mm256_loadu_ps(s->z + i));
+  __m256 r = _mm256_loadu_ps(s->r + i);
+
+  float sa = dot(load3(dir), load3(dir));
+  __m256 a = _mm256_set1_ps(sa);
+  __m256 b = _mm256_mul_ps(
+      _mm256_set1_ps(2.0f),
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, Lx), _mm256_mul_ps(dy, Ly)),
+                    _mm256_mul_ps(dz, Lz)));
+  __m256 c = _mm256_sub_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lx, Lx), _mm256_mul_ps(Ly, Ly)),
+                    _mm256_mul_ps(Lz, Lz)),
+      _mm256_mul_ps(r, r));
+  __m256 discr = _mm256_sub_ps(_mm256_mul_ps(b, b),
+                               _mm256_mul_ps(_mm256_set1_ps(4 * sa), c));
+
+  __m256 zero = _mm256_setzero_ps();
+  __m256 eps = _mm256_set1_ps(SPHERE_EPSILON);
+  __m256 half = _mm256_set1_ps(-0.5f);
+
+  __m256 sq = _mm256_sqrt_ps(discr);
+  __m256 q = _mm256_mul_ps(
+      half, _mm256_blendv_ps(_mm256_sub_ps(b, sq), _mm256_add_ps(b, sq),
+                             _mm256_cmp_ps(b, eps, _CMP_GT_OQ)));
+  __m256 t0 = _mm256_div_ps(q, a);
+  __m256 t1 = _mm256_div_ps(c, q);
+
+  __m256 single = _mm256_cmp_ps(discr, zero, _CMP_EQ_OQ);
+  __m256 ts = _mm256_div_ps(_mm256_mul_ps(half, b), a);
+  t0 = _mm256_blendv_ps(t0, ts, single);
+  t1 = _mm256_blendv_ps(t1, ts, single);
+
+  __m256 swap = _mm256_cmp_ps(t0, t1, _CMP_GE_OQ);
+  __m256 tn = _mm256_blendv_ps(t0, t1, swap);
+  __m256 tf = _mm256_blendv_ps(t1, t0, swap);
+  tn = _mm256_blendv_ps(tn, tf, _mm256_cmp_ps(tn, eps, _CMP_LE_OQ));
+
+  __m256 miss = _mm256_or_ps(_mm256_cmp_ps(discr, zero, _CMP_LT_OQ),
+                             _mm256_cmp_ps(tn, eps, _CMP_LE_OQ));
+  _mm256_storeu_ps(t, _mm256_blendv_ps(tn, _mm256_set1_ps(INFINITY), miss));
+}
+
+__attribute__((target("avx512f"))) static void
+sphere_lanes_avx512(SphereSoA *s, int i, float *orig, float *dir, float *t) {
+  __m512 dx = _mm512_set1_ps(dir[0]), dy = _mm512_set1_ps(dir[1]),
+         dz = _mm512_set1_ps(dir[2]);
+
+  __m512 Lx = _mm512_sub_ps(_mm512_set1_ps(orig[0]), _mm512_loadu_ps(s->x + i));
+  __m512 Ly = _mm512_sub_ps(_mm512_set1_ps(orig[1]), _mm512_loadu_ps(s->y + i));
+  __m512 Lz = _mm512_sub_ps(_mm512_set1_ps(orig[2]), _mm512_loadu_ps(s->z + i));
+  __m512 r = _mm512_loadu_ps(s->r + i);
+
+  float sa = dot(load3(dir), load3(dir));
+  __m512 a = _mm512_set1_ps(sa);
+  __m512 b = _mm512_mul_ps(
+      _mm512_set1_ps(2.0f),
+      _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, Lx), _mm512_mul_ps(dy, Ly)),
+                    _mm512_mul_ps(dz, Lz)));
+  __m512 c = _mm512_sub_ps(
+      _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(Lx, Lx), _mm512_mul_ps(Ly, Ly)),
+                    _mm512_mul_ps(Lz, Lz)),
+      _mm512_mul_ps(r, r));
+  __m512 discr = _mm512_sub_ps(_mm512_mul_ps(b, b),
+                               _mm512_mul_ps(_mm512_set1_ps(4 * sa), c));
+
+  __m512 zero = _mm512_setzero_ps();
+  __m512 eps = _mm512_set1_ps(SPHERE_EPSILON);
+  __m512 half = _mm512_set1_ps(-0.5f);
+
+  __m512 sq = _mm512_sqrt_ps(discr);
+  __m512 q = _mm512_mul_ps(
+      half, _mm512_mask_blend_ps(_mm512_cmp_ps_mask(b, eps, _CMP_GT_OQ),
+                                 _mm512_sub_ps(b, sq), _mm512_add_ps(b, sq)));
+  __m512 t0 = _mm512_div_ps(q, a);
+  __m512 t1 = _mm512_div_ps(c, q);
+
+  __mmask16 single = _mm512_cmp_ps_mask(discr, zero, _CMP_EQ_OQ);
+  __m512 ts = _mm512_div_ps(_mm512_mul_ps(half, b), a);
+  t0 = _mm512_mask_blend_ps(single, t0, ts);
+  t1 = _mm512_mask_blend_ps(single, t1, ts);
+
+  __mmask16 swap = _mm512_cmp_ps_mask(t0, t1, _CMP_GE_OQ);
+  __m512 tn = _mm512_mask_blend_ps(swap, t0, t1);
+  __m512 tf = _mm512_mask_blend_ps(swap, t1, t0);
+  tn = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(tn, eps, _CMP_LE_OQ), tn, tf);
+
+  __mmask16 miss = _mm512_cmp_ps_mask(discr, zero, _CMP_LT_OQ) |
+                   _mm512_cmp_ps_mask(tn, eps, _CMP_LE_OQ);
+  _mm512_storeu_ps(t, _mm512_mask_blend_ps(miss, tn, _mm512_set1_ps(INFINITY)));
+}
+
+__attribute__((target("avx2"))) static __m256
+dot_avx2(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz) {
+  return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)),
+                       _mm256_mul_ps(az, bz));
+}
+
+__attribute__((target("avx2"))) static void
+triangle_lanes_avx2(TriangleSoA *tr, int i, float *orig, float *dir,
+                    float *t) {
+  __m256 e1x = _mm256_loadu_ps(tr->e1x + i), e1y = _mm256_loadu_ps(tr->e1y + i),
+         e1z = _mm256_loadu_ps(tr->e1z + i);
+  __m256 e2x = _mm256_loadu_ps(tr->e2x + i), e2y = _mm256_loadu_ps(tr->e2y + i),
+         e2z = _mm256_loadu_ps(tr->e2z + i);
+  __m256 dx = _mm256_set1_ps(dir[0]), dy = _mm256_set1_ps(dir[1]),
+         dz = _mm256_set1_ps(dir[2]);
+  __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+
+  // pvec = dir x e2
+  __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+  __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+  __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+  __m256 det = dot_avx2(e1x, e1y, e1z, px, py, pz);
+  __m256 absdet = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+  __m256 miss =
+      _mm256_cmp_ps(absdet, _mm256_set1_ps(TRIANGLE_EPSILON), _CMP_LT_OQ);
+  __m256 inv = _mm256_div_ps(one, det);
+
+  __m256 tx = _mm256_sub_ps(_mm256_set1_ps(orig[0]), _mm256_loadu_ps(tr->px + i));
+  __m256 ty = _mm256_sub_ps(_mm256_set1_ps(orig[1]), _mm256_loadu_ps(tr->py + i));
+  __m256 tz = _mm256_sub_ps(_mm256_set1_ps(orig[2]), _mm256_loadu_ps(tr->pz + i));
+  __m256 u = _mm256_mul_ps(dot_avx2(tx, ty, tz, px, py, pz), inv);
+  miss = _mm256_or_ps(miss, _mm256_cmp_ps(u, zero, _CMP_LT_OQ));
+  miss = _mm256_or_ps(miss, _mm256_cmp_ps(u, one, _CMP_GT_OQ));
+
+  // qvec = tvec x e1
+  __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+  __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+  __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+  __m256 v = _mm256_mul_ps(dot_avx2(dx, dy, dz, qx, qy, qz), inv);
+  miss = _mm256_or_ps(miss, _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+  miss = _mm256_or_ps(miss,
+                      _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ));
+
+  __m256 th = _mm256_mul_ps(dot_avx2(e2x, e2y, e2z, qx, qy, qz), inv);
+  miss = _mm256_or_ps(miss, _mm256_cmp_ps(th, zero, _CMP_LT_OQ));
+
+  _mm256_storeu_ps(t, _mm256_blendv_ps(th, _mm256_set1_ps(INFINITY), miss));
+}
+
+__attribute__((target("avx512f"))) static __m512
+dot_avx512(__m512 ax, __m512 ay, __m512 az, __m512 bx, __m512 by, __m512 bz) {
+  return _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ax, bx), _mm512_mul_ps(ay, by)),
+                       _mm512_mul_ps(az, bz));
+}
+
+__attribute__((target("avx512f"))) static void
+triangle_lanes_avx512(TriangleSoA *tr, int i, float *orig, float *dir,
+                      float *t) {
+  __m512 e1x = _mm512_loadu_ps(tr->e1x + i), e1y = _mm512_loadu_ps(tr->e1y + i),
+         e1z = _mm512_loadu_ps(tr->e1z + i);
+  __m512 e2x = _mm512_loadu_ps(tr->e2x + i), e2y = _mm512_loadu_ps(tr->e2y + i),
+         e2z = _mm512_loadu_ps(tr->e2z + i);
+  __m512 dx = _mm512_set1_ps(dir[0]), dy = _mm512_set1_ps(dir[1]),
+         dz = _mm512_set1_ps(dir[2]);
+  __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+
+  __m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+  __m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+  __m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+  __m512 det = dot_avx512(e1x, e1y, e1z, px, py, pz);
+  __mmask16 miss = _mm512_cmp_ps_mask(
+      _mm512_abs_ps(det), _mm512_set1_ps(TRIANGLE_EPSILON), _CMP_LT_OQ);
+  __m512 inv = _mm512_div_ps(one, det);
+
+  __m512 tx = _mm512_sub_ps(_mm512_set1_ps(orig[0]), _mm512_loadu_ps(tr->px + i));
+  __m512 ty = _mm512_sub_ps(_mm512_set1_ps(orig[1]), _mm512_loadu_ps(tr->py + i));
+  __m512 tz = _mm512_sub_ps(_mm512_set1_ps(orig[2]), _mm512_loadu_ps(tr->pz + i));
+  __m512 u = _mm512_mul_ps(dot_avx512(tx, ty, tz, px, py, pz), inv);
+  miss |= _mm512_cmp_ps_mask(u, zero, _CMP_LT_OQ) |
+          _mm512_cmp_ps_mask(u, one, _CMP_GT_OQ);
+
+  __m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+  __m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+  __m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+  __m512 v = _mm512_mul_ps(dot_avx512(dx, dy, dz, qx, qy, qz), inv);
+  miss |= _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ) |
+          _mm512_cmp_ps_mask(_mm512_add_ps(u, v), one, _CMP_GT_OQ);
+
+  __m512 th = _mm512_mul_ps(dot_avx512(e2x, e2y, e2z, qx, qy, qz), inv);
+  miss |= _mm512_cmp_ps_mask(th, zero, _CMP_LT_OQ);
+
+  _mm512_storeu_ps(t, _mm512_mask_blend_ps(miss, th, _mm512_set1_ps(INFINITY)));
+}
+
+/**
+ * Walks [first, first + count) W lanes at a time and keeps the first
+ * primitive with the smallest distance, the same one the scalar loop picks.
+ **/
+template <class P, int W, void (*lanes)(P *, int, float *, float *, float *)>
+static int closest_lanes(P *prims, int first, int count, float *orig,
+                         float *dir, float *t_best, int *index) {
+  float t[W];
+  int hit = false;
+  for (int i = first; i < first + count; i += W) {
+    lanes(prims, i, orig, dir, t);
+    int n = first + count - i < W ? first + count - i : W;
+    for (int k = 0; k < n; k++) {
+      if (t[k] < *t_best) {
+        *t_best = t[k];
+        *index = i + k;
+        hit = true;
+      }
+    }
+  }
+  return hit;
+}
+
+template <class P, int W, void (*lanes)(P *, int, float *, float *, float *)>
+static int occluded_lanes(P *prims, int first, int count, float *orig,
+                          float *dir, float tmin, float tmax) {
+  float t[W];
+  for (int i = first; i < first + count; i += W) {
+    lanes(prims, i, orig, dir, t);
+    int n = first + count - i < W ? first + count - i : W;
+    for (int k = 0; k < n; k++) {
+      if (t[k] > tmin && t[k] < tmax)
+        return true;
+    }
+  }
+  return false;
+}
+
+#endif // SIMD_X86
+
+int spheres_closest(SphereSoA *s, int first, int count, float *orig,
+                    float *dir, float *t_best, int *index) {
+  STAT_ADD(sphere_tests, count);
+#ifdef SIMD_X86
+  if (simd_level == SIMD_AVX512)
+    return closest_lanes<SphereSoA, 16, sphere_lanes_avx512>(
+        s, first, count, orig, dir, t_best, index);
+  if (simd_level == SIMD_AVX2)
+    return closest_lanes<SphereSoA, 8, sphere_lanes_avx2>(s, first, count,
+                                                          orig, dir, t_best,
+                                                          index);
+#endif
+
+  int hit = false;
+  float t;
+  vec3 o = load3(orig), d = load3(dir);
+  for (int i = first; i < first + count; i++) {
+    vec3 c = {s->x[i], s->y[i], s->z[i]};
+    if (raySphereIntersects(o, d, c, s->r[i], &t) && t < *t_best) {
+      *t_best = t;
+      *index = i;
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+int spheres_occluded(SphereSoA *s, int first, int count, float *orig,
+                     float *dir, float tmin, float tmax) {
+  STAT_ADD(sphere_tests, count);
+#ifdef SIMD_X86
+  if (simd_level == SIMD_AVX512)
+    return occluded_lanes<SphereSoA, 16, sphere_lanes_avx512>(
+        s, first, count, orig, dir, tmin, tmax);
+  if (simd_level == SIMD_AVX2)
+    return occluded_lanes<SphereSoA, 8, sphere_lanes_avx2>(s, first, count,
+                                                           orig, dir, tmin,
+                                                           tmax);
+#endif
+
+  float t;
+  vec3 o = load3(orig), d = load3(dir);
+  for (int i = first; i < first + count; i++) {
+    vec3 c = {s->x[i], s->y[i], s->z[i]};
+    if (raySphereIntersects(o, d, c, s->r[i], &t) && t > tmin &&
+        t < tmax)
+      return true;
+  }
+  return false;
+}
+
+int triangles_closest(TriangleSoA *tr, int first, int count, float *orig,
+                      float *dir, float *t_best, int *index) {
+  STAT_ADD(triangle_tests, count);
+#ifdef SIMD_X86
+  if (simd_level == SIMD_AVX512)
+    return closest_lanes<TriangleSoA, 16, triangle_lanes_avx512>(
+        tr, first, count, orig, dir, t_best, index);
+  if (simd_level == SIMD_AVX2)
+    return closest_lanes<TriangleSoA, 8, triangle_lanes_avx2>(
+        tr, first, count, orig, dir, t_best, index);
+#endif
+
+  int hit = false;
+  float t, u, v;
+  vec3 o = load3(orig), d = load3(dir);
+  for (int i = first; i < first + count; i++) {
+    vec3 p = {tr->px[i], tr->py[i], tr->pz[i]};
+    vec3 e1 = {tr->e1x[i], tr->e1y[i], tr->e1z[i]};
+    vec3 e2 = {tr->e2x[i], tr->e2y[i], tr->e2z[i]};
+    if (rayTriangleIntersects(o, d, p, e1, e2, &t, &u, &v) && t < *t_best) {
+      *t_best = t;
+      *index = i;
+      hit = true;
+    }
+  }
+  return hit;
+}
+
+int triangles_occluded(TriangleSoA *tr, int first, int count, float *orig,
+                       float *dir, float tmin, float tmax) {
+  STAT_ADD(triangle_tests, count);
+#ifdef SIMD_X86
+  if (simd_level == SIMD_AVX512)
+    return occluded_lanes<TriangleSoA, 16, triangle_lanes_avx512>(
+        tr, first, count, orig, dir, tmin, tmax);
+  if (simd_level == SIMD_AVX2)
+    return occluded_lanes<TriangleSoA, 8, triangle_lanes_avx2>(
+        tr, first, count, orig, dir, tmin, tmax);
+#endif
+
+  float t, u, v;
+  vec3 o = load3(orig), d = load3(dir);
+  for (int i = first; i < first + count; i++) {
+    vec3 p = {tr->px[i], tr->py[i], tr->pz[i]};
+    vec3 e1 = {tr->e1x[i], tr->e1y[i], tr->e1z[i]};
+    vec3 e2 = {tr->e2x[i], tr->e2y[i], tr->e2z[i]};
+    if (rayTriangleIntersects(o, d, p, e1, e2, &t, &u, &v) && t > tmin &&
+        t < tmax)
+      return true;
+  }
+  return false;
+}
+#pragma omp end declare target
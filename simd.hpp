@@ -0,0 +1,62 @@
+#pragma once
+
+#include <omp.h>
+#include <string>
+
+#include "maths.hpp"
+
+// Streams are padded to a multiple of the widest vector (AVX-512, 16 floats)
+#define SIMD_WIDTH 16
+
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+
+#pragma omp declare target
+/**
+ * Spheres as separate x/y/z/r streams carved out of a single allocation
+ **/
+struct SphereSoA {
+  float *x, *y, *z, *r;
+  int count, padded;
+};
+
+/**
+ * Triangles prepared for the Möller–Trumbore test, one stream per
+ * coordinate of the first vertex p, the edges e1 = p2 - p and e2 = p3 - p
+ * and the unit normal n used for shading.
+ **/
+struct TriangleSoA {
+  float *px, *py, *pz;
+  float *e1x, *e1y, *e1z;
+  float *e2x, *e2y, *e2z;
+  float *nx, *ny, *nz;
+  int count, padded;
+};
+
+#define TRIANGLE_STREAMS 12
+
+extern int simd_level;
+
+int spheres_closest(SphereSoA *s, int first, int count, float *orig,
+                    float *dir, float *t_best, int *index);
+int spheres_occluded(SphereSoA *s, int first, int count, float *orig,
+                     float *dir, float tmin, float tmax);
+int triangles_closest(TriangleSoA *tr, int first, int count, float *orig,
+                      float *dir, float *t_best, int *index);
+int triangles_occluded(TriangleSoA *tr, int first, int count, float *orig,
+                       float *dir, float tmin, float tmax);
+#pragma omp end declare target
+
+int simd_init(const std::string &request);
+const char *simd_name(int level);
+
+int soa_padded(int size);
+void fill_sphere_soa(SphereSoA *s, float *block, float *spheres,
+                     float *radius, int size);
+void fill_triangle_soa(TriangleSoA *tr, float *block, float *tris, int size);
+void build_triangle_soa(TriangleSoA *tr, float *tris, int size);
+void free_triangle_soa(TriangleSoA *tr);
+
+void attach_sphere_soa(SphereSoA *s, float *block, int size, int padded);
+void attach_triangle_soa(TriangleSoA *tr, float *block, int size, int padded);
@@ -0,0 +1,186 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "image.hpp"
+
+#ifdef USE_STATS
+
+struct TileTime {
+  int x0, y0, x1, y1;
+  double seconds;
+};
+
+// Keeps every thread's counters on their own cache lines
+struct PaddedStats {
+  RayStats stats;
+  char pad[64];
+};
+
+/**
+ * What the last frame gathered
+ **/
+struct FrameStats {
+  std::mutex lock;
+  std::vector<PaddedStats *> threads;
+  RayStats total;
+  double time;
+  int width, height;
+  std::vector<unsigned int> cost;
+  std::vector<TileTime> tiles;
+};
+
+static FrameStats frame;
+
+RayStats *stats_register() {
+  PaddedStats *slot = new PaddedStats();
+  std::lock_guard<std::mutex> guard(frame.lock);
+  frame.threads.push_back(slot);
+  return &slot->stats;
+}
+
+void stats_begin_frame(int width, int height) {
+  std::lock_guard<std::mutex> guard(frame.lock);
+  for (size_t i = 0; i < frame.threads.size(); i++)
+    memset(&frame.threads[i]->stats, 0, sizeof(RayStats));
+  frame.width = width;
+  frame.height = height;
+  frame.cost.assign((size_t)width * height, 0);
+  frame.tiles.clear();
+}
+
+void stats_end_frame(double time) {
+  std::lock_guard<std::mutex> guard(frame.lock);
+  const int n = sizeof(RayStats) / sizeof(long long);
+  long long *total = (long long *)&frame.total;
+  memset(total, 0, sizeof(RayStats));
+  for (size_t i = 0; i < frame.threads.size(); i++) {
+    long long *counters = (long long *)&frame.threads[i]->stats;
+    for (int k = 0; k < n; k++)
+      total[k] += counters[k];
+  }
+  frame.time = time;
+}
+
+void stats_pixel(int x, int y, long long cost) {
+  frame.cost[(size_t)y * frame.width + x] += cost;
+}
+
+void stats_tile(int x0, int y0, int x1, int y1, double seconds) {
+  TileTime tile = {x0, y0, x1, y1, seconds};
+  std::lock_guard<std::mutex> guard(frame.lock);
+  frame.tiles.push_back(tile);
+}
+
+bool stats_enabled() { return true; }
+
+static double ratio(long long a, long long b) {
+  return b > 0 ? (double)a / b : 0;
+}
+
+bool stats_write_json(const std::string &path) {
+  std::ofstream json(path);
+  if (!json.is_open()) {
+    std::cerr << "Could not create file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  const RayStats &s = frame.total;
+  json << "{\n  \"width\": " << frame.width << ",\n"
+       << "  \"height\": " << frame.height << ",\n"
+       << "  \"time\": " << frame.time << ",\n"
+       << "  \"counters\": {\n"
+       << "    \"primary_rays\": " << s.primary_rays << ",\n"
+       << "    \"primary_hits\": " << s.primary_hits << ",\n"
+       << "    \"shadow_rays\": " << s.shadow_rays << ",\n"
+       << "    \"shadow_occluded\": " << s.shadow_occluded << ",\n"
+       << "    \"secondary_rays\": " << s.secondary_rays << ",\n"
+       << "    \"roulette_stopped\": " << s.roulette_stopped << ",\n"
+       << "    \"node_visits\": " << s.node_visits << ",\n"
+       << "    \"triangle_tests\": " << s.triangle_tests << ",\n"
+       << "    \"sphere_tests\": " << s.sphere_tests << ",\n"
+       << "    \"triangle_parallel\": " << s.triangle_parallel << ",\n"
+       << "    \"triangle_behind\": " << s.triangle_behind << ",\n"
+       << "    \"triangle_outside\": " << s.triangle_outside << "\n"
+       << "  },\n";
+
+  long long rays = s.primary_rays + s.secondary_rays + s.shadow_rays;
+  json << "  \"per_ray\": {\n"
+       << "    \"node_visits\": " << ratio(s.node_visits, rays) << ",\n"
+       << "    \"triangle_tests\": " << ratio(s.triangle_tests, rays) << ",\n"
+       << "    \"sphere_tests\": " << ratio(s.sphere_tests, rays) << ",\n"
+       << "    \"shadow_per_primary\": " << ratio(s.shadow_rays, s.primary_rays)
+       << "\n  },\n"
+       << "  \"mrays_per_s\": " << (frame.time > 0 ? rays / frame.time * 1e-6 : 0)
+       << ",\n";
+
+  // Slowest tiles first, they are the ones worth looking at
+  std::vector<TileTime> tiles = frame.tiles;
+  std::sort(tiles.begin(), tiles.end(),
+            [](const TileTime &a, const TileTime &b) {
+              return a.seconds > b.seconds;
+            });
+  json << "  \"tiles\": [";
+  for (size_t i = 0; i < tiles.size(); i++)
+    json << (i ? "," : "") << "\n    [" << tiles[i].x0 << ", " << tiles[i].y0
+         << ", " << tiles[i].x1 << ", " << tiles[i].y1 << ", "
+         << tiles[i].seconds << "]";
+  json << "\n  ]\n}\n";
+  return json.good();
+}
+
+/**
+ * Maps the cost of a pixel, relative to the 99th percentile so a few
+ * outliers do not wash out the rest, along black, blue, red, yellow, white.
+ **/
+bool stats_write_heatmap(const std::string &path) {
+  size_t n = frame.cost.size();
+  if (n == 0) {
+    std::cerr << "No frame to write a heatmap of" << std::endl;
+    return false;
+  }
+
+  std::vector<unsigned int> sorted = frame.cost;
+  size_t p99 = n * 99 / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+  float scale = sorted[p99] > 0 ? 1.0f / sorted[p99] : 0;
+
+  static const float ramp[5][3] = {
+      {0, 0, 0}, {0, 0, 255}, {255, 0, 0}, {255, 255, 0}, {255, 255, 255}};
+
+  std::vector<unsigned char> image(n * 4);
+  for (size_t i = 0; i < n; i++) {
+    float v = std::min(frame.cost[i] * scale, 1.0f) * 4;
+    int k = std::min((int)v, 3);
+    float f = v - k;
+    for (int c = 0; c < 3; c++)
+      image[i * 4 + 2 - c] =
+          (unsigned char)(ramp[k][c] + (ramp[k + 1][c] - ramp[k][c]) * f);
+    image[i * 4 + 3] = 255;
+  }
+
+  std::cout << "Heatmap: white is " << sorted[p99]
+            << " node visits and primitive tests per pixel" << std::endl;
+  return write_image(path, &image[0], NULL, frame.width, frame.height);
+}
+
+#else
+
+bool stats_enabled() { return false; }
+
+bool stats_write_json(const std::string &path) {
+  std::cerr << "Not writing '" << path
+            << "', statistics need a build with USE_STATS" << std::endl;
+  return false;
+}
+
+bool stats_write_heatmap(const std::string &path) {
+  return stats_write_json(path);
+}
+
+#endif // USE_STATS
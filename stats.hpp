@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+
+/**
+ * Optional ray statistics, compiled in with -DUSE_STATS (cmake -DUSE_STATS=ON)
+ * and reduced to nothing otherwise. Every thread counts into its own
+ * RayStats; render() starts and ends the frame, which merges them, and the
+ * result can then be written as JSON and as a per pixel cost heatmap.
+ **/
+struct RayStats {
+  long long primary_rays, primary_hits;
+  long long shadow_rays, shadow_occluded;
+  long long secondary_rays, roulette_stopped; // mirror and glass bounces
+  long long node_visits;
+  long long triangle_tests, sphere_tests; // primitives handed to the kernels
+
+  // Early returns of rayTriangleIntersects, only reached by scalar kernels
+  long long triangle_parallel, triangle_behind, triangle_outside;
+};
+
+#ifdef USE_STATS
+
+RayStats *stats_register();
+
+inline RayStats *stats_thread() {
+  static thread_local RayStats *stats = NULL;
+  if (stats == NULL)
+    stats = stats_register();
+  return stats;
+}
+
+// Work done by this thread so far, pixels are charged the difference
+inline long long stats_cost() {
+  RayStats *s = stats_thread();
+  return s->node_visits + s->triangle_tests + s->sphere_tests;
+}
+
+void stats_begin_frame(int width, int height);
+void stats_end_frame(double time);
+void stats_pixel(int x, int y, long long cost);
+void stats_tile(int x0, int y0, int x1, int y1, double seconds);
+
+#define STAT_ADD(counter, n) (stats_thread()->counter += (n))
+#define STAT_COST(var) long long var = stats_cost()
+#define STAT_PIXEL(x, y, since) stats_pixel(x, y, stats_cost() - (since))
+#define STAT_TILE(tile, seconds)                                               \
+  stats_tile((tile).x0, (tile).y0, (tile).x1, (tile).y1, seconds)
+
+#else
+
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_COST(var) ((void)0)
+#define STAT_PIXEL(x, y, since) ((void)0)
+#define STAT_TILE(tile, seconds) ((void)0)
+
+#endif // USE_STATS
+
+bool stats_enabled();
+bool stats_write_json(const std::string &path);
+bool stats_write_heatmap(const std::string &path);
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <omp.h>
+#include <vector>
+
+// Files smaller than this are parsed by a single thread
+#define PARSE_CHUNK_MIN (1 << 20)
+
+/**
+ * Number and line helpers shared by the text readers. Every function works
+ * on [p, end) of a NUL terminated buffer.
+ **/
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && is_blank(*p))
+    p++;
+  return p;
+}
+
+static inline const char *line_end(const char *p, const char *end) {
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  return nl != NULL ? nl : end;
+}
+
+/**
+ * Parses a decimal float at p, leaving p past it. A mantissa of up to 53
+ * bits with a power of ten up to 22 is exact in double, so one multiply or
+ * divide rounds correctly there; narrowing to float then only goes wrong
+ * when the double lands exactly halfway between two floats. Those and
+ * everything else go through strtof, so the result always matches it.
+ **/
+static inline bool parse_float(const char *&p, const char *end, float *value) {
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+
+  // Up to 19 digits fit the mantissa, longer ones take the slow path
+  unsigned long long mantissa = 0;
+  const char *digits = p;
+  for (; p < end && is_digit(*p); p++)
+    mantissa = mantissa * 10 + (*p - '0');
+  int n_digits = p - digits, exponent = 0;
+  if (p < end && *p == '.') {
+    const char *fraction = ++p;
+    for (; p < end && is_digit(*p); p++)
+      mantissa = mantissa * 10 + (*p - '0');
+    exponent = fraction - p;
+    n_digits += p - fraction;
+  }
+  if (n_digits == 0)
+    return false;
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    bool exp_negative = false;
+    if (q < end && (*q == '-' || *q == '+'))
+      exp_negative = *q++ == '-';
+    if (q == end || !is_digit(*q))
+      return false;
+    int e = 0;
+    for (; q < end && is_digit(*q); q++)
+      e = e < 10000 ? e * 10 + (*q - '0') : e;
+    exponent += exp_negative ? -e : e;
+    p = q;
+  }
+
+  if (n_digits <= 19 && mantissa <= (1ULL << 53) && exponent >= -22 &&
+      exponent <= 22) {
+    double d = (double)mantissa;
+    d = exponent < 0 ? d / powers_of_ten[-exponent]
+                     : d * powers_of_ten[exponent];
+
+    // The 29 bits dropped by the narrowing
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if ((bits & 0x1FFFFFFF) != 0x10000000) {
+      *value = negative ? -(float)d : (float)d;
+      return true;
+    }
+  }
+
+  // The buffer is NUL terminated and the syntax checked, strtof stops
+  // where we did
+  *value = strtof(start, NULL);
+  return true;
+}
+
+static inline bool parse_int(const char *&p, const char *end, int *value) {
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  if (p == end || !is_digit(*p))
+    return false;
+  long long v = 0;
+  for (; p < end && is_digit(*p); p++)
+    v = v < INT_MAX ? v * 10 + (*p - '0') : v;
+  if (v > INT_MAX)
+    return false;
+  *value = negative ? -(int)v : (int)v;
+  return true;
+}
+
+/**
+ * Cuts [data, data + size) into pieces of at least PARSE_CHUNK_MIN bytes,
+ * up to four per thread, each ending on a line boundary. Returns the
+ * boundaries, piece i being [bounds[i], bounds[i + 1]).
+ **/
+static inline std::vector<const char *> split_lines(const char *data,
+                                                    long long size) {
+  int n_chunks = size / PARSE_CHUNK_MIN;
+  n_chunks = std::max(1, std::min(n_chunks, omp_get_max_threads() * 4));
+
+  // Cut at the first newline after every even split point
+  std::vector<const char *> bounds(1, data);
+  for (int i = 0; i < n_chunks; i++) {
+    const char *end = data + size * (i + 1) / n_chunks;
+    if (end < bounds.back())
+      end = bounds.back();
+    if (i < n_chunks - 1)
+      end = std::min(line_end(end, data + size) + 1, data + size);
+    bounds.push_back(end);
+  }
+  return bounds;
+}
@@ -0,0 +1,62 @@
+#include "tile_queue.hpp"
+
+DirtyTileQueue::DirtyTileQueue(unsigned capacity) : tail(0), head(0) {
+  unsigned size = 1;
+  while (size < capacity)
+    size <<= 1;
+
+  slots.reset(new Slot[size]);
+  mask = size - 1;
+  for (unsigned i = 0; i < size; i++)
+    slots[i].seq.store(i, std::memory_order_relaxed);
+  overflow.store(false);
+}
+
+bool DirtyTileQueue::push(const Tile &tile) {
+  unsigned pos = tail.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &slots[pos & mask];
+    unsigned seq = slot->seq.load(std::memory_order_acquire);
+    int dif = (int)seq - (int)pos;
+    if (dif == 0) {
+      if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      overflow.store(true, std::memory_order_release);
+      return false;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->tile = tile;
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool DirtyTileQueue::pop(Tile &tile) {
+  unsigned pos = head.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &slots[pos & mask];
+    unsigned seq = slot->seq.load(std::memory_order_acquire);
+    int dif = (int)seq - (int)(pos + 1);
+    if (dif == 0) {
+      if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      return false;
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
+  }
+
+  tile = slot->tile;
+  slot->seq.store(pos + mask + 1, std::memory_order_release);
+  return true;
+}
+
+bool DirtyTileQueue::overflowed() {
+  return overflow.exchange(false, std::memory_order_acq_rel);
+}
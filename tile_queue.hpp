@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "scheduler.hpp"
+
+#define DIRTY_QUEUE_SIZE 4096
+
+/**
+ * Bounded lock-free multi-producer queue of finished tiles, filled by the
+ * render workers and drained by the viewer so it only uploads what
+ * changed. Each slot carries a sequence number telling producers and
+ * consumers whose turn it is (Vyukov's bounded MPMC queue).
+ *
+ * A push that finds the queue full sets an overflow flag instead of
+ * blocking a worker; the viewer then refreshes the whole frame.
+ **/
+class DirtyTileQueue {
+public:
+  explicit DirtyTileQueue(unsigned capacity = DIRTY_QUEUE_SIZE);
+
+  bool push(const Tile &tile);
+  bool pop(Tile &tile);
+
+  // True once if anything was dropped since the last call
+  bool overflowed();
+
+private:
+  struct Slot {
+    std::atomic<unsigned> seq;
+    Tile tile;
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  unsigned mask;
+  char pad0[64];
+  std::atomic<unsigned> tail;
+  char pad1[64];
+  std::atomic<unsigned> head;
+  std::atomic<bool> overflow;
+};
@@ -0,0 +1,60 @@
+#include "tonemap.hpp"
+
+int tonemap_operator(const std::string &name) {
+  if (name == "reinhard")
+    return TONEMAP_REINHARD;
+  return TONEMAP_CLAMP;
+}
+
+const char *tonemap_name(int op) {
+  if (op == TONEMAP_REINHARD)
+    return "reinhard";
+  return "clamp";
+}
+
+/**
+ * One row of n pixels. Every lane, alpha included, does the same work and
+ * alpha is set afterwards, so both loops vectorize. They are written for
+ * that: the upper clamp is a float min, which keeps the conversion to int
+ * in range and maps to a vector min, and the lower one is done on the int.
+ **/
+static void tonemap_row(const float *in, unsigned char *out, int n, int op,
+                        float exposure) {
+  if (op == TONEMAP_REINHARD) {
+    // Radiance is never negative, x / (1 + x) stays below 1
+    for (int k = 0; k < n * 4; k++) {
+      float x = in[k] * exposure;
+      int v = (int)(x / (1 + x) * 255 + 0.5f);
+      out[k] = v > 0 ? v : 0;
+    }
+  } else {
+    for (int k = 0; k < n * 4; k++) {
+      float x = in[k] * exposure * 255 + 0.5f;
+      int v = (int)(x < 255 ? x : 255);
+      out[k] = v > 0 ? v : 0;
+    }
+  }
+
+  for (int j = 0; j < n; j++)
+    out[j * 4 + 3] = 255;
+}
+
+void tonemap(const float *hdr, int width, Tile tile, unsigned char *out,
+             int pitch, int op, float exposure) {
+  int n = tile.x1 - tile.x0;
+  for (int i = tile.y0; i < tile.y1; i++)
+    tonemap_row(hdr + ((size_t)i * width + tile.x0) * 4,
+                out + (size_t)(i - tile.y0) * pitch, n, op, exposure);
+}
+
+/**
+ * The whole image, rows spread over the threads
+ **/
+void tonemap_frame(const float *hdr, int width, int height, unsigned char *out,
+                   int pitch, int op, float exposure) {
+#pragma omp parallel for
+  for (int i = 0; i < height; i++) {
+    Tile row = {0, i, width, i + 1};
+    tonemap(hdr, width, row, out + (size_t)i * pitch, pitch, op, exposure);
+  }
+}
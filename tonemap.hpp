@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+#include "scheduler.hpp"
+
+#define TONEMAP_CLAMP 0    // linear, saturating at 1
+#define TONEMAP_REINHARD 1 // x / (1 + x), rolls highlights off instead
+
+/**
+ * Turns the rows of tile from hdr, a width wide float RGBA image (1 being
+ * full intensity), into ARGB8888 pixels at out, which holds the top left
+ * pixel of the tile and advances pitch bytes per row. out may be a frame
+ * buffer or a locked texture alike.
+ **/
+void tonemap(const float *hdr, int width, Tile tile, unsigned char *out,
+             int pitch, int op, float exposure);
+void tonemap_frame(const float *hdr, int width, int height, unsigned char *out,
+                   int pitch, int op, float exposure);
+
+int tonemap_operator(const std::string &name);
+const char *tonemap_name(int op);